@@ -0,0 +1,223 @@
+#include "Test.hpp"
+#include "rlm3-wifi.h"
+#include "rlm3-uart.h"
+#include "rlm3-sim.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+
+// Each transcript is fed this many times for the throughput numbers.
+static const size_t BENCH_REPEAT_COUNT = 200;
+// Passes used to find the worst case time for a single byte.
+static const size_t WORST_CASE_PASS_COUNT = 5;
+
+static size_t g_receive_count = 0;
+static size_t g_receive_block_count = 0;
+static size_t g_connect_count = 0;
+static size_t g_disconnect_count = 0;
+
+
+extern void RLM3_WIFI_Receive_Callback(size_t link_id, uint8_t data)
+{
+	g_receive_count++;
+}
+
+extern void RLM3_WIFI_ReceiveBlock_Callback(size_t link_id, const uint8_t* data, size_t size)
+{
+	g_receive_block_count++;
+}
+
+extern void RLM3_WIFI_NetworkConnect_Callback(size_t link_id, bool local_connection)
+{
+	g_connect_count++;
+}
+
+extern void RLM3_WIFI_NetworkDisconnect_Callback(size_t link_id, bool local_connection)
+{
+	g_disconnect_count++;
+}
+
+static void InitDriver()
+{
+	SIM_RLM3_UART4_Transmit("AT\r\n");
+	SIM_RLM3_UART4_Receive("AT\r\nOK\r\n");
+	SIM_RLM3_UART4_Transmit("ATE0\r\n");
+	SIM_RLM3_UART4_Receive("ATE0\r\nOK\r\n");
+	SIM_RLM3_UART4_Transmit("AT+CIPMODE=0\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n");
+	SIM_RLM3_UART4_Transmit("AT+CIPMUX=1\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n");
+	SIM_RLM3_UART4_Transmit("AT+CWMODE_CUR=1\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n");
+	SIM_RLM3_UART4_Transmit("AT+CWAUTOCONN=0\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n");
+	ASSERT(RLM3_WIFI_Init());
+}
+
+static uint32_t NextRandom(uint32_t* seed)
+{
+	// Fixed generator so every run feeds exactly the same bytes.
+	*seed = *seed * 1664525 + 1013904223;
+	return *seed >> 8;
+}
+
+static std::string MakeIpd(size_t link_id, size_t size, uint32_t* seed)
+{
+	std::string result = "+IPD," + std::to_string(link_id) + "," + std::to_string(size) + ":";
+	for (size_t i = 0; i < size; i++)
+		result += (char)NextRandom(seed);
+	return result + "\r\n";
+}
+
+static std::string MakeUrcTranscript()
+{
+	static const char* const URCS[] =
+	{
+		"OK\r\n", "ERROR\r\n", "WIFI CONNECTED\r\n", "WIFI GOT IP\r\n", "WIFI DISCONNECT\r\n", "0,CONNECT\r\n", "0,CLOSED\r\n",
+		"3,CONNECT\r\n", "3,CLOSED\r\n", "> ", "Recv 512 bytes\r\n", "SEND OK\r\n", "SEND FAIL\r\n", "1,12,SEND OK\r\n", "1,13\r\n",
+		"busy p...\r\n", "DNS Fail\r\n", "+CWJAP:3\r\n", "FAIL\r\n", "no ip\r\n", "+CIFSR:STAIP,\"192.168.1.17\"\r\n",
+		"AT version:1.7.4.0(May 11 2020 19:13:04)\r\n", "SDK version:3.0.4(9532ceb)\r\n", "ALREADY CONNECT\r\n", "STATUS:2\r\n",
+	};
+	uint32_t seed = 1;
+	std::string result;
+	for (size_t i = 0; i < 2000; i++)
+		result += URCS[NextRandom(&seed) % (sizeof(URCS) / sizeof(URCS[0]))];
+	return result;
+}
+
+static std::string MakeIpdTranscript()
+{
+	uint32_t seed = 2;
+	std::string result;
+	for (size_t i = 0; i < 200; i++)
+	{
+		result += MakeIpd(NextRandom(&seed) % RLM3_WIFI_LINK_COUNT, 1 + NextRandom(&seed) % 1460, &seed);
+		if (i % 4 == 0)
+			result += "Recv 1024 bytes\r\n\r\nSEND OK\r\n";
+	}
+	return result;
+}
+
+static std::string MakeGarbageTranscript()
+{
+	uint32_t seed = 3;
+	std::string result;
+	for (size_t i = 0; i < 2000; i++)
+	{
+		// Line noise with the occasional good response to resynchronize on.
+		size_t length = NextRandom(&seed) % 40;
+		for (size_t j = 0; j < length; j++)
+			result += (char)NextRandom(&seed);
+		result += "\r\nOK\r\n";
+	}
+	return result;
+}
+
+static std::string MakeRecordedTranscript()
+{
+	// Boot, join, connect, a short exchange, and disconnect as captured from an ESP-WROOM-02 with AT 1.7.4.
+	std::string result =
+		"\xff\xfe\r\n ets Jan  8 2013,rst cause:2, boot mode:(3,6)\r\n\r\nload 0x40100000, len 2408, room 16 \r\n"
+		"tail 8\r\nchksum 0xe5\r\nload 0x3ffe8000, len 776, room 0 \r\ntail 8\r\nchksum 0x84\r\n\r\n"
+		"Ai-Thinker Technology Co. Ltd.\r\n\r\nready\r\n"
+		"AT\r\n\r\nOK\r\nATE0\r\n\r\nOK\r\n\r\nOK\r\n\r\nOK\r\n\r\nOK\r\n\r\nOK\r\n"
+		"AT version:1.7.4.0(May 11 2020 19:13:04)\r\nSDK version:3.0.4(9532ceb)\r\ncompile time:May 27 2020 10:12:17\r\n"
+		"Bin version(Wroom 02):1.7.4\r\nOK\r\n"
+		"WIFI CONNECTED\r\nWIFI GOT IP\r\n\r\nOK\r\n"
+		"2,CONNECT\r\n\r\nOK\r\n\r\nOK\r\n> \r\nRecv 78 bytes\r\n\r\nSEND OK\r\n";
+	uint32_t seed = 4;
+	for (size_t i = 0; i < 20; i++)
+	{
+		result += MakeIpd(2, 536, &seed);
+		result += MakeIpd(2, 64, &seed);
+		result += "\r\nOK\r\n> \r\nRecv 24 bytes\r\n\r\nSEND OK\r\n";
+	}
+	result += "2,CLOSED\r\n\r\nOK\r\nWIFI DISCONNECT\r\n";
+	return result;
+}
+
+static void ResetCounts()
+{
+	g_receive_count = 0;
+	g_receive_block_count = 0;
+	g_connect_count = 0;
+	g_disconnect_count = 0;
+}
+
+static void RunBenchmark(const char* name, const std::string& transcript)
+{
+	typedef std::chrono::steady_clock Clock;
+	const uint8_t* data = (const uint8_t*)transcript.data();
+	size_t size = transcript.size();
+
+	// One pass to count callbacks.  This also leaves the parser in the state it will be in for the timed passes.
+	ResetCounts();
+	for (size_t i = 0; i < size; i++)
+		RLM3_UART4_ReceiveCallback(data[i]);
+	size_t receive_count = g_receive_count;
+	size_t receive_block_count = g_receive_block_count;
+	size_t connect_count = g_connect_count;
+	size_t disconnect_count = g_disconnect_count;
+
+	Clock::time_point start = Clock::now();
+	for (size_t r = 0; r < BENCH_REPEAT_COUNT; r++)
+		for (size_t i = 0; i < size; i++)
+			RLM3_UART4_ReceiveCallback(data[i]);
+	double isr_ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+
+	start = Clock::now();
+	for (size_t r = 0; r < BENCH_REPEAT_COUNT; r++)
+		RLM3_WIFI_ParseBytes(data, size);
+	double chunk_ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+
+	// The worst single byte, less the cost of reading the clock.
+	double clock_ns = 1e9;
+	for (size_t i = 0; i < 1000; i++)
+	{
+		Clock::time_point before = Clock::now();
+		clock_ns = std::min(clock_ns, std::chrono::duration<double, std::nano>(Clock::now() - before).count());
+	}
+	// Take the fastest of several passes for each byte so preemption by the host does not show up as parser cost.
+	std::vector<double> byte_ns(size, 1e9);
+	for (size_t r = 0; r < WORST_CASE_PASS_COUNT; r++)
+	{
+		for (size_t i = 0; i < size; i++)
+		{
+			Clock::time_point before = Clock::now();
+			RLM3_UART4_ReceiveCallback(data[i]);
+			byte_ns[i] = std::min(byte_ns[i], std::chrono::duration<double, std::nano>(Clock::now() - before).count() - clock_ns);
+		}
+	}
+	double worst_ns = *std::max_element(byte_ns.begin(), byte_ns.end());
+
+	std::printf("%-10s %8zu bytes  isr %6.2f ns/byte  chunk %6.2f ns/byte  worst %8.0f ns  receive %zu  block %zu  connect %zu  disconnect %zu\n",
+			name, size, isr_ns / BENCH_REPEAT_COUNT / size, chunk_ns / BENCH_REPEAT_COUNT / size, worst_ns,
+			receive_count, receive_block_count, connect_count, disconnect_count);
+}
+
+TEST_CASE(RLM3_WIFI_Bench_Urc)
+{
+	InitDriver();
+	RunBenchmark("urc", MakeUrcTranscript());
+}
+
+TEST_CASE(RLM3_WIFI_Bench_Ipd)
+{
+	InitDriver();
+	RunBenchmark("ipd", MakeIpdTranscript());
+}
+
+TEST_CASE(RLM3_WIFI_Bench_Garbage)
+{
+	InitDriver();
+	RunBenchmark("garbage", MakeGarbageTranscript());
+}
+
+TEST_CASE(RLM3_WIFI_Bench_Recorded)
+{
+	InitDriver();
+	RunBenchmark("recorded", MakeRecordedTranscript());
+}
@@ -0,0 +1,188 @@
+#include "Test.hpp"
+#include "rlm3-wifi.h"
+#include "rlm3-wifi-emulator.hpp"
+#include "rlm3-task.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+
+// Everything is measured in simulated time against the emulated module, so results only change when the driver or the emulator does.
+
+typedef enum BenchMode
+{
+	BENCH_MODE_TRANSMIT,
+	BENCH_MODE_TRANSMIT2,
+	BENCH_MODE_TRANSMIT_BUFFERED,
+	BENCH_MODE_RECEIVE,
+	BENCH_MODE_PASSTHROUGH,
+	BENCH_MODE_RECEIVE_PASSIVE,
+} BenchMode;
+
+static const char* const BENCH_MODE_NAMES[] = { "transmit", "transmit2", "transmit_buffered", "receive", "passthrough", "receive_passive" };
+static const uint32_t BENCH_BAUD_RATES[] = { 115200, 921600 };
+static const size_t BENCH_LINK_COUNTS[] = { 1, 3, RLM3_WIFI_LINK_COUNT };
+static const size_t BENCH_SIZES[] = { 1, 16, 64, 256, 1024, 2048 };
+// Bytes sent by each run.  Small payloads are capped by count instead.
+static const size_t BENCH_RUN_BYTES = 32768;
+static const size_t BENCH_MAX_COUNT = 200;
+
+// Set by the make target.  Results are appended one JSON object per line.
+static const char* const BENCH_OUTPUT_ENV = "RLM3_WIFI_BENCH_OUTPUT";
+
+
+static std::string MakeData(size_t size, size_t seed)
+{
+	std::string result(size, 0);
+	for (size_t i = 0; i < size; i++)
+		result[i] = (char)(seed * 31 + i * 7);
+	return result;
+}
+
+static void Connect(BenchMode mode, uint32_t baud_rate, size_t link_count)
+{
+	ASSERT(RLM3_WIFI_Init());
+	if (baud_rate != 115200)
+		ASSERT(RLM3_WIFI_SetBaudRate(baud_rate));
+	ASSERT(RLM3_WIFI_NetworkConnect("emu-sid", "emu-pwd"));
+	if (mode == BENCH_MODE_PASSTHROUGH)
+	{
+		ASSERT(RLM3_WIFI_PassthroughBegin(0, "emu-server", "7"));
+		return;
+	}
+	for (size_t i = 0; i < link_count; i++)
+		ASSERT(RLM3_WIFI_ServerConnect(i, "emu-server", "7"));
+	if (mode == BENCH_MODE_RECEIVE_PASSIVE)
+		ASSERT(RLM3_WIFI_SetReceivePassive(true));
+}
+
+static size_t PeerDataSize(size_t link_count)
+{
+	size_t result = 0;
+	for (size_t i = 0; i < link_count; i++)
+		result += EMU_WIFI_GetPeerData(i).size();
+	return result;
+}
+
+static bool ReadAll(size_t link_id, size_t size)
+{
+	std::vector<uint8_t> buffer(size);
+	size_t count = 0;
+	while (count < size)
+	{
+		size_t read = RLM3_WIFI_Read(link_id, buffer.data() + count, size - count, 1000);
+		if (read == 0)
+			return false;
+		count += read;
+	}
+	return true;
+}
+
+static uint64_t Percentile(const std::vector<uint64_t>& sorted, size_t percent)
+{
+	return sorted[std::min(sorted.size() - 1, sorted.size() * percent / 100)];
+}
+
+static void RunBenchmark(BenchMode mode, uint32_t baud_rate, size_t link_count, size_t size)
+{
+	EMU_WIFI_Start(EMU_WIFI_Config());
+	Connect(mode, baud_rate, link_count);
+	RLM3_WIFI_SetTransmitBuffered(mode == BENCH_MODE_TRANSMIT_BUFFERED);
+
+	size_t count = std::min(BENCH_MAX_COUNT, std::max<size_t>(1, BENCH_RUN_BYTES / size));
+	EMU_WIFI_Stats before = EMU_WIFI_GetStats();
+	uint64_t start_time = EMU_WIFI_GetTime();
+	std::vector<uint64_t> latencies;
+	size_t failures = 0;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		size_t link_id = i % link_count;
+		std::string data = MakeData(size, i);
+		const uint8_t* bytes = (const uint8_t*)data.data();
+		uint64_t send_time = EMU_WIFI_GetTime();
+		bool result = false;
+		if (mode == BENCH_MODE_TRANSMIT || mode == BENCH_MODE_TRANSMIT_BUFFERED || mode == BENCH_MODE_PASSTHROUGH)
+			result = RLM3_WIFI_Transmit(link_id, bytes, size);
+		else if (mode == BENCH_MODE_TRANSMIT2)
+			result = RLM3_WIFI_Transmit2(link_id, bytes, size / 2, bytes + size / 2, size - size / 2);
+		else
+		{
+			EMU_WIFI_PeerSend(link_id, data);
+			result = ReadAll(link_id, size);
+		}
+		latencies.push_back(EMU_WIFI_GetTime() - send_time);
+		if (!result)
+			failures++;
+	}
+
+	// Throughput counts until the peer actually has everything.
+	if (mode != BENCH_MODE_RECEIVE && mode != BENCH_MODE_RECEIVE_PASSIVE)
+		for (size_t i = 0; i < 1000 && PeerDataSize(link_count) < count * size; i++)
+			RLM3_Delay(1);
+
+	uint64_t elapsed = EMU_WIFI_GetTime() - start_time;
+	EMU_WIFI_Stats after = EMU_WIFI_GetStats();
+	size_t payload = count * size;
+	size_t wire = (after.bytes_to_module - before.bytes_to_module) + (after.bytes_from_module - before.bytes_from_module);
+	double bytes_per_second = 1e9 * payload / elapsed;
+	double overhead = (double)(wire - payload) / payload;
+	std::sort(latencies.begin(), latencies.end());
+
+	std::printf("%-18s %7u baud %u links %5zu B  %10.0f B/s  p50 %8.0f us  p99 %8.0f us  overhead %6.2f  failures %zu\n",
+			BENCH_MODE_NAMES[mode], (unsigned int)baud_rate, (unsigned int)link_count, size, bytes_per_second,
+			Percentile(latencies, 50) / 1e3, Percentile(latencies, 99) / 1e3, overhead, failures);
+
+	const char* output_path = std::getenv(BENCH_OUTPUT_ENV);
+	if (output_path == nullptr)
+		return;
+	FILE* output = std::fopen(output_path, "a");
+	ASSERT(output != nullptr);
+	std::fprintf(output, "{\"mode\":\"%s\",\"baud_rate\":%u,\"links\":%u,\"size\":%zu,\"count\":%zu,\"failures\":%zu,"
+			"\"bytes_per_second\":%.1f,\"latency_us\":{\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"max\":%.1f},\"overhead\":%.4f}\n",
+			BENCH_MODE_NAMES[mode], (unsigned int)baud_rate, (unsigned int)link_count, size, count, failures, bytes_per_second,
+			Percentile(latencies, 50) / 1e3, Percentile(latencies, 90) / 1e3, Percentile(latencies, 99) / 1e3,
+			latencies.back() / 1e3, overhead);
+	std::fclose(output);
+}
+
+static void RunBenchmarks(BenchMode mode)
+{
+	for (uint32_t baud_rate : BENCH_BAUD_RATES)
+		for (size_t link_count : BENCH_LINK_COUNTS)
+			for (size_t size : BENCH_SIZES)
+				if (mode != BENCH_MODE_PASSTHROUGH || link_count == 1)	// Passthrough only has the one link.
+					RunBenchmark(mode, baud_rate, link_count, size);
+}
+
+TEST_CASE(RLM3_WIFI_Bench_Transmit)
+{
+	RunBenchmarks(BENCH_MODE_TRANSMIT);
+}
+
+TEST_CASE(RLM3_WIFI_Bench_Transmit2)
+{
+	RunBenchmarks(BENCH_MODE_TRANSMIT2);
+}
+
+TEST_CASE(RLM3_WIFI_Bench_TransmitBuffered)
+{
+	RunBenchmarks(BENCH_MODE_TRANSMIT_BUFFERED);
+}
+
+TEST_CASE(RLM3_WIFI_Bench_Receive)
+{
+	RunBenchmarks(BENCH_MODE_RECEIVE);
+}
+
+TEST_CASE(RLM3_WIFI_Bench_ReceivePassive)
+{
+	RunBenchmarks(BENCH_MODE_RECEIVE_PASSIVE);
+}
+
+TEST_CASE(RLM3_WIFI_Bench_Passthrough)
+{
+	RunBenchmarks(BENCH_MODE_PASSTHROUGH);
+}
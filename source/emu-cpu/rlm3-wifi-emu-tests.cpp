@@ -0,0 +1,453 @@
+#include "Test.hpp"
+#include "rlm3-wifi.h"
+#include "rlm3-wifi-emulator.hpp"
+#include "rlm3-task.h"
+#include <string>
+#include <vector>
+
+
+static std::vector<std::string> g_datagrams;
+
+extern void RLM3_WIFI_ReceiveDatagram_Callback(size_t link_id, const uint8_t* data, size_t size)
+{
+	g_datagrams.emplace_back((const char*)data, size);
+}
+
+
+static std::string MakeData(size_t size)
+{
+	std::string result;
+	for (size_t i = 0; i < size; i++)
+		result += (char)('a' + i % 26);
+	return result;
+}
+
+static void ConnectLink(size_t link_id)
+{
+	ASSERT(RLM3_WIFI_Init());
+	ASSERT(RLM3_WIFI_NetworkConnect("emu-sid", "emu-pwd"));
+	ASSERT(RLM3_WIFI_ServerConnect(link_id, "emu-server", "7"));
+}
+
+static std::string ReadAll(size_t link_id, size_t size)
+{
+	std::string result(size, 0);
+	size_t count = 0;
+	while (count < size)
+	{
+		size_t read = RLM3_WIFI_Read(link_id, (uint8_t*)&result[count], size - count, 1000);
+		if (read == 0)
+			break;
+		count += read;
+	}
+	result.resize(count);
+	return result;
+}
+
+TEST_CASE(RLM3_WIFI_Emulator_Init)
+{
+	EMU_WIFI_Start(EMU_WIFI_Config());
+
+	ASSERT(RLM3_WIFI_Init());
+	// Boots in 300 ms, so Init should not have waited out the full second.
+	ASSERT(EMU_WIFI_GetTime() < 500000000);
+	uint32_t at_version = 0;
+	uint32_t sdk_version = 0;
+	ASSERT(RLM3_WIFI_GetVersion(&at_version, &sdk_version));
+	ASSERT(at_version == 0x01070400);
+	ASSERT(sdk_version == 0x030004);
+}
+
+TEST_CASE(RLM3_WIFI_Emulator_WrongPassword)
+{
+	EMU_WIFI_Start(EMU_WIFI_Config());
+
+	ASSERT(RLM3_WIFI_Init());
+	ASSERT(!RLM3_WIFI_NetworkConnect("emu-sid", "wrong-pwd"));
+	ASSERT(!RLM3_WIFI_IsNetworkConnected());
+}
+
+TEST_CASE(RLM3_WIFI_Emulator_UnknownServer)
+{
+	EMU_WIFI_Start(EMU_WIFI_Config());
+
+	ASSERT(RLM3_WIFI_Init());
+	ASSERT(RLM3_WIFI_NetworkConnect("emu-sid", "emu-pwd"));
+	ASSERT(!RLM3_WIFI_ServerConnect(1, "unknown-server", "7"));
+	ASSERT(!RLM3_WIFI_IsServerConnected(1));
+}
+
+TEST_CASE(RLM3_WIFI_Emulator_TransmitEcho)
+{
+	EMU_WIFI_Config config;
+	config.is_peer_echo = true;
+	EMU_WIFI_Start(config);
+	std::string data = MakeData(900);
+
+	ConnectLink(2);
+	ASSERT(RLM3_WIFI_Transmit(2, (const uint8_t*)data.data(), data.size()));
+	ASSERT(EMU_WIFI_GetPeerData(2) == data);
+	ASSERT(ReadAll(2, data.size()) == data);
+}
+
+TEST_CASE(RLM3_WIFI_Emulator_TransmitBufferedFull)
+{
+	EMU_WIFI_Config config;
+	config.segment_buffer_count = 1;
+	config.link_bytes_per_second = 20000;
+	EMU_WIFI_Start(config);
+	std::string data = MakeData(3 * 2048);
+
+	ConnectLink(0);
+	RLM3_WIFI_SetTransmitBuffered(true);
+	ASSERT(RLM3_WIFI_Transmit(0, (const uint8_t*)data.data(), data.size()));
+	RLM3_Delay(1000);
+	ASSERT(EMU_WIFI_GetPeerData(0) == data);
+	ASSERT(EMU_WIFI_GetStats().busy_count > 0);
+}
+
+TEST_CASE(RLM3_WIFI_Emulator_Disconnect)
+{
+	EMU_WIFI_Config config;
+	config.disconnect_probability = 1.0;
+	EMU_WIFI_Start(config);
+	std::string data = MakeData(100);
+
+	ConnectLink(3);
+	ASSERT(!RLM3_WIFI_Transmit(3, (const uint8_t*)data.data(), data.size()));
+	RLM3_Delay(10);
+	ASSERT(!RLM3_WIFI_IsServerConnected(3));
+	ASSERT(EMU_WIFI_GetStats().disconnect_count == 1);
+}
+
+TEST_CASE(RLM3_WIFI_Emulator_PeerClose)
+{
+	EMU_WIFI_Start(EMU_WIFI_Config());
+
+	ConnectLink(1);
+	EMU_WIFI_PeerSend(1, "hello");
+	EMU_WIFI_PeerClose(1);
+	ASSERT(ReadAll(1, 10) == "hello");
+	ASSERT(!RLM3_WIFI_IsServerConnected(1));
+}
+
+TEST_CASE(RLM3_WIFI_Emulator_AccessPointLost)
+{
+	EMU_WIFI_Start(EMU_WIFI_Config());
+
+	ConnectLink(4);
+	EMU_WIFI_AccessPointLost();
+	RLM3_Delay(10);
+	ASSERT(!RLM3_WIFI_IsNetworkConnected());
+	ASSERT(!RLM3_WIFI_IsServerConnected(4));
+}
+
+TEST_CASE(RLM3_WIFI_Emulator_BaudRate)
+{
+	EMU_WIFI_Config config;
+	config.is_peer_echo = true;
+	EMU_WIFI_Start(config);
+	std::string data = MakeData(2048);
+
+	ConnectLink(2);
+	uint64_t start = EMU_WIFI_GetTime();
+	ASSERT(RLM3_WIFI_Transmit(2, (const uint8_t*)data.data(), data.size()));
+	uint64_t slow = EMU_WIFI_GetTime() - start;
+	ASSERT(ReadAll(2, data.size()) == data);
+
+	ASSERT(RLM3_WIFI_SetBaudRate(921600));
+	start = EMU_WIFI_GetTime();
+	ASSERT(RLM3_WIFI_Transmit(2, (const uint8_t*)data.data(), data.size()));
+	uint64_t fast = EMU_WIFI_GetTime() - start;
+	ASSERT(ReadAll(2, data.size()) == data);
+	ASSERT(fast < slow);
+}
+
+TEST_CASE(RLM3_WIFI_Emulator_InitWarm)
+{
+	EMU_WIFI_Config config;
+	config.is_peer_echo = true;
+	EMU_WIFI_Start(config);
+	std::string data = MakeData(100);
+
+	// Only this side restarts, so the module keeps its network and link.
+	ConnectLink(3);
+	uint64_t start = EMU_WIFI_GetTime();
+	ASSERT(RLM3_WIFI_InitWarm());
+	ASSERT(EMU_WIFI_GetTime() - start < 100000000);
+	ASSERT(RLM3_WIFI_IsNetworkConnected());
+	ASSERT(RLM3_WIFI_IsServerConnected(3));
+	ASSERT(!RLM3_WIFI_IsServerConnected(2));
+	ASSERT(RLM3_WIFI_Transmit(3, (const uint8_t*)data.data(), data.size()));
+	ASSERT(ReadAll(3, data.size()) == data);
+}
+
+TEST_CASE(RLM3_WIFI_Emulator_InitWarmLinkTypes)
+{
+	EMU_WIFI_Config config;
+	config.is_peer_echo = true;
+	EMU_WIFI_Start(config);
+	g_datagrams.clear();
+	std::string data = MakeData(20);
+
+	// A UDP link and a link opened by a station on the local network both survive the restart.
+	ConnectLink(1);
+	ASSERT(RLM3_WIFI_LocalNetworkEnable("emu-ap", "emu-pwd", 4, "192.168.4.1", "333"));
+	ASSERT(RLM3_WIFI_UdpConnect(3, "emu-server", "7", "4000", RLM3_WIFI_UDP_MODE_ANY_PEER));
+	EMU_WIFI_PeerConnect(2);
+	RLM3_Delay(10);
+	ASSERT(RLM3_WIFI_InitWarm());
+	ASSERT(RLM3_WIFI_IsLocalNetworkEnabled());
+	ASSERT(RLM3_WIFI_IsServerConnected(1));
+	ASSERT(RLM3_WIFI_IsServerConnected(2));
+	ASSERT(RLM3_WIFI_IsServerConnected(3));
+	ASSERT(RLM3_WIFI_TransmitDatagram(3, (const uint8_t*)data.data(), data.size(), NULL, NULL));
+	ASSERT(!RLM3_WIFI_TransmitDatagram(2, (const uint8_t*)data.data(), data.size(), NULL, NULL));
+	ASSERT(ReadAll(3, data.size()) == data);
+	ASSERT(g_datagrams.size() == 1);
+}
+
+TEST_CASE(RLM3_WIFI_Emulator_InitWarmPoweredOff)
+{
+	EMU_WIFI_Start(EMU_WIFI_Config());
+
+	ASSERT(RLM3_WIFI_InitWarm());
+	ASSERT(!RLM3_WIFI_IsNetworkConnected());
+	ASSERT(RLM3_WIFI_NetworkConnect("emu-sid", "emu-pwd"));
+}
+
+TEST_CASE(RLM3_WIFI_Emulator_Passthrough)
+{
+	EMU_WIFI_Config config;
+	config.is_peer_echo = true;
+	EMU_WIFI_Start(config);
+	std::string data = MakeData(900);
+
+	// The module has a single connection in passthrough, which it reports as link 0.
+	ASSERT(RLM3_WIFI_Init());
+	ASSERT(RLM3_WIFI_NetworkConnect("emu-sid", "emu-pwd"));
+	ASSERT(RLM3_WIFI_PassthroughBegin(2, "emu-server", "7"));
+	ASSERT(RLM3_WIFI_Transmit(2, (const uint8_t*)data.data(), data.size()));
+	ASSERT(ReadAll(2, data.size()) == data);
+	ASSERT(EMU_WIFI_GetPeerData(0) == data);
+
+	ASSERT(RLM3_WIFI_PassthroughEnd());
+	ASSERT(!RLM3_WIFI_IsServerConnected(2));
+	ASSERT(EMU_WIFI_GetPeerData(0) == data);
+	ASSERT(RLM3_WIFI_ServerConnect(1, "emu-server", "7"));
+	ASSERT(RLM3_WIFI_Transmit(1, (const uint8_t*)data.data(), 100));
+}
+
+TEST_CASE(RLM3_WIFI_Emulator_ReceivePassive)
+{
+	EMU_WIFI_Start(EMU_WIFI_Config());
+	std::string data = MakeData(5000);
+
+	// Far more than the driver can buffer, but the module keeps it until it is read.
+	ConnectLink(1);
+	ASSERT(RLM3_WIFI_SetReceivePassive(true));
+	EMU_WIFI_PeerSend(1, data);
+	RLM3_Delay(1000);
+	ASSERT(RLM3_WIFI_Available(1) == data.size());
+	ASSERT(ReadAll(1, data.size()) == data);
+	ASSERT(RLM3_WIFI_Available(1) == 0);
+
+	RLM3_WIFI_Stats stats;
+	RLM3_WIFI_GetStats(&stats);
+	ASSERT(stats.links[1].bytes_received == data.size());
+	ASSERT(stats.links[1].bytes_dropped == 0);
+}
+
+TEST_CASE(RLM3_WIFI_Emulator_Udp)
+{
+	EMU_WIFI_Config config;
+	config.is_peer_echo = true;
+	EMU_WIFI_Start(config);
+	g_datagrams.clear();
+	std::string data = MakeData(200);
+
+	ConnectLink(1);
+	uint64_t start = EMU_WIFI_GetTime();
+	ASSERT(RLM3_WIFI_Transmit(1, (const uint8_t*)data.data(), data.size()));
+	uint64_t tcp_time = EMU_WIFI_GetTime() - start;
+	ASSERT(ReadAll(1, data.size()) == data);
+
+	// No round trip to the peer before the module reports the send.
+	ASSERT(RLM3_WIFI_UdpConnect(3, "emu-server", "7", "4000", RLM3_WIFI_UDP_MODE_ANY_PEER));
+	ASSERT(RLM3_WIFI_IsServerConnected(3));
+	start = EMU_WIFI_GetTime();
+	ASSERT(RLM3_WIFI_Transmit(3, (const uint8_t*)data.data(), data.size()));
+	ASSERT(EMU_WIFI_GetTime() - start < tcp_time);
+	ASSERT(RLM3_WIFI_TransmitDatagram(3, (const uint8_t*)data.data(), 10, "10.0.0.2", "4001"));
+	ASSERT(!RLM3_WIFI_TransmitDatagram(1, (const uint8_t*)data.data(), 10, NULL, NULL));
+	ASSERT(ReadAll(3, data.size() + 10) == data + data.substr(0, 10));
+	ASSERT(g_datagrams.size() == 2);
+	ASSERT(g_datagrams[0] == data);
+	ASSERT(g_datagrams[1] == data.substr(0, 10));
+
+	RLM3_WIFI_ServerDisconnect(3);
+	ASSERT(!RLM3_WIFI_IsServerConnected(3));
+}
+
+TEST_CASE(RLM3_WIFI_Emulator_DnsCache)
+{
+	EMU_WIFI_Start(EMU_WIFI_Config());
+
+	ConnectLink(1);
+	RLM3_WIFI_SetDnsCache(true, true);
+	ASSERT(RLM3_WIFI_ServerConnect(2, "emu-server", "7"));
+	ASSERT(EMU_WIFI_GetStats().dns_lookup_count == 2);
+
+	// Reconnecting by address skips the lookup.
+	uint64_t start = EMU_WIFI_GetTime();
+	ASSERT(RLM3_WIFI_ServerConnect(1, "emu-server", "7"));
+	uint64_t cached = EMU_WIFI_GetTime() - start;
+	ASSERT(EMU_WIFI_GetStats().dns_lookup_count == 2);
+	RLM3_WIFI_SetDnsCache(false, false);
+	start = EMU_WIFI_GetTime();
+	ASSERT(RLM3_WIFI_ServerConnect(1, "emu-server", "7"));
+	ASSERT(cached < EMU_WIFI_GetTime() - start);
+
+	// Once the entry expires, a failed lookup falls back to the old address only when allowed.
+	RLM3_WIFI_SetDnsCache(true, false);
+	ASSERT(RLM3_WIFI_ServerConnect(3, "emu-server", "7"));
+	RLM3_Delay(RLM3_WIFI_DNS_TTL);
+	EMU_WIFI_SetDnsAvailable(false);
+	ASSERT(!RLM3_WIFI_ServerConnect(3, "emu-server", "7"));
+	ASSERT(!RLM3_WIFI_ServerConnect(4, "emu-server", "7"));
+	RLM3_WIFI_SetDnsCache(true, true);
+	ASSERT(RLM3_WIFI_ServerConnect(4, "emu-server", "7"));
+
+	RLM3_WIFI_Stats stats;
+	RLM3_WIFI_GetStats(&stats);
+	ASSERT(stats.dns_hit_count == 2);
+	ASSERT(stats.dns_stale_count == 1);
+}
+
+TEST_CASE(RLM3_WIFI_Emulator_Pool)
+{
+	EMU_WIFI_Config config;
+	config.is_peer_echo = true;
+	EMU_WIFI_Start(config);
+	std::string data = MakeData(100);
+
+	ASSERT(RLM3_WIFI_Init());
+	ASSERT(RLM3_WIFI_NetworkConnect("emu-sid", "emu-pwd"));
+	ASSERT(RLM3_WIFI_ServerConnect(4, "emu-server", "7"));
+	uint64_t start = EMU_WIFI_GetTime();
+	size_t link_id = RLM3_WIFI_PoolAcquire("emu-server", "80");
+	uint64_t connect_time = EMU_WIFI_GetTime() - start;
+	ASSERT(link_id == 0);
+	ASSERT(RLM3_WIFI_Transmit(link_id, (const uint8_t*)data.data(), data.size()));
+	ASSERT(ReadAll(link_id, data.size()) == data);
+	RLM3_WIFI_PoolRelease(link_id, true);
+
+	// No handshake the second time around.
+	start = EMU_WIFI_GetTime();
+	ASSERT(RLM3_WIFI_PoolAcquire("emu-server", "80") == 0);
+	ASSERT(EMU_WIFI_GetTime() - start < connect_time / 10);
+	RLM3_WIFI_PoolRelease(0, true);
+
+	// Fill the links the pool may use, then one more server pushes out the one idle longest.  Link 4 belongs to the caller.
+	ASSERT(RLM3_WIFI_PoolAcquire("emu-server", "81") == 1);
+	ASSERT(RLM3_WIFI_PoolAcquire("emu-server", "82") == 2);
+	ASSERT(RLM3_WIFI_PoolAcquire("emu-server", "83") == 3);
+	RLM3_WIFI_PoolRelease(3, true);
+	RLM3_Delay(10);
+	RLM3_WIFI_PoolRelease(1, true);
+	ASSERT(RLM3_WIFI_PoolAcquire("emu-server", "84") == 0);
+	ASSERT(RLM3_WIFI_PoolAcquire("emu-server", "85") == 3);
+	ASSERT(RLM3_WIFI_PoolAcquire("emu-server", "86") == 1);
+	ASSERT(RLM3_WIFI_PoolAcquire("emu-server", "87") == RLM3_WIFI_LINK_COUNT);
+	ASSERT(RLM3_WIFI_IsServerConnected(4));
+
+	RLM3_WIFI_Stats stats;
+	RLM3_WIFI_GetStats(&stats);
+	ASSERT(stats.pool_reuse_count == 1);
+	ASSERT(stats.pool_evict_count == 3);
+}
+
+TEST_CASE(RLM3_WIFI_Emulator_Busy)
+{
+	EMU_WIFI_Config config;
+	config.busy_probability = 1.0;
+	EMU_WIFI_Start(config);
+
+	ASSERT(!RLM3_WIFI_Init());
+	ASSERT(EMU_WIFI_GetStats().busy_count > 0);
+}
+
+TEST_CASE(RLM3_WIFI_Emulator_TasksShareDriver)
+{
+	EMU_WIFI_Config config;
+	config.is_peer_echo = true;
+	EMU_WIFI_Start(config);
+	std::string data = MakeData(100);
+
+	// The other task asks for the driver while this one is still connecting.
+	ConnectLink(1);
+	bool is_task_done = false;
+	bool task_result = false;
+	EMU_WIFI_StartTask([&]() {
+		task_result = RLM3_WIFI_Transmit(1, (const uint8_t*)data.data(), data.size());
+		is_task_done = true;
+	});
+	ASSERT(RLM3_WIFI_ServerConnect(2, "emu-server", "7"));
+	while (!is_task_done)
+		RLM3_Delay(1);
+	ASSERT(task_result);
+	ASSERT(EMU_WIFI_GetPeerData(1) == data);
+	ASSERT(ReadAll(1, data.size()) == data);
+	ASSERT(RLM3_WIFI_Transmit(2, (const uint8_t*)data.data(), data.size()));
+	ASSERT(ReadAll(2, data.size()) == data);
+}
+
+TEST_CASE(RLM3_WIFI_Emulator_TasksPastQueueSize)
+{
+	EMU_WIFI_Start(EMU_WIFI_Config());
+	std::string data = MakeData(10);
+
+	// More tasks wait than the queue can wake directly.
+	ConnectLink(1);
+	const size_t task_count = RLM3_WIFI_COMMAND_QUEUE_SIZE + 3;
+	size_t done_count = 0;
+	size_t pass_count = 0;
+	for (size_t i = 0; i < task_count; i++)
+	{
+		EMU_WIFI_StartTask([&]() {
+			if (RLM3_WIFI_Transmit(1, (const uint8_t*)data.data(), data.size()))
+				pass_count++;
+			done_count++;
+		});
+	}
+	ASSERT(RLM3_WIFI_Transmit(1, (const uint8_t*)data.data(), data.size()));
+	while (done_count < task_count)
+		RLM3_Delay(1);
+	ASSERT(pass_count == task_count);
+	ASSERT(EMU_WIFI_GetPeerData(1).size() == (task_count + 1) * data.size());
+}
+
+TEST_CASE(RLM3_WIFI_Emulator_TasksNested)
+{
+	EMU_WIFI_Start(EMU_WIFI_Config());
+	std::string large = MakeData(5000);
+	std::string small = MakeData(10);
+
+	// A transmit of several segments runs each as a nested command, and the other task waits for all of them.
+	ConnectLink(1);
+	ASSERT(RLM3_WIFI_ServerConnect(2, "emu-server", "7"));
+	uint64_t task_done_time = 0;
+	bool task_result = false;
+	EMU_WIFI_StartTask([&]() {
+		task_result = RLM3_WIFI_Transmit(2, (const uint8_t*)small.data(), small.size());
+		task_done_time = EMU_WIFI_GetTime();
+	});
+	ASSERT(RLM3_WIFI_Transmit(1, (const uint8_t*)large.data(), large.size()));
+	uint64_t done_time = EMU_WIFI_GetTime();
+	while (task_done_time == 0)
+		RLM3_Delay(1);
+	ASSERT(task_result);
+	ASSERT(task_done_time > done_time);
+	ASSERT(EMU_WIFI_GetPeerData(1) == large);
+	ASSERT(EMU_WIFI_GetPeerData(2) == small);
+}
@@ -0,0 +1,1013 @@
+#include "rlm3-wifi-emulator.hpp"
+#include "rlm3-wifi.h"
+#include "rlm3-uart.h"
+#include "rlm3-gpio.h"
+#include "rlm3-task.h"
+#include "Assert.h"
+#include <algorithm>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+// The emulator replaces the simulator's UART, task, and GPIO drivers.  Everything runs one task at a time against a simulated clock.
+// Interrupts are events on that clock, and they run whenever the driver blocks and no other task is ready.
+
+static const size_t MAX_IPD_SIZE = 1460;
+static const size_t MAX_SEGMENT_SIZE = 2048;
+static const size_t MAX_LINE_SIZE = 256;
+static const uint32_t DEFAULT_BAUD_RATE = 115200;
+static const uint64_t PASSTHROUGH_PACKET_TIME = 20000000;
+
+
+struct Link
+{
+	bool is_connected;
+	bool is_udp;
+	bool is_server;				// Opened by a station connecting to the module's server.
+	std::string peer_data;
+	std::string held_data;		// Received in passive mode and not yet asked for.
+};
+
+struct Module
+{
+	bool is_running;
+	uint32_t generation;
+	uint32_t baud_rate;
+	bool is_echo;
+	bool is_multiple_connections;
+	bool is_passthrough_mode;
+	bool is_receive_passive;
+	bool is_joined;
+	int wifi_mode;
+	bool is_server_enabled;
+	std::string line;
+	uint64_t busy_until;
+	const char* busy_text;
+
+	bool is_data_mode;
+	bool is_data_buffered;
+	size_t data_link_id;
+	size_t data_size;
+	uint32_t data_segment;
+	std::string data;
+
+	// Without multiple connections link 0 is the only link.  In passthrough, whatever arrives within a packet time goes out together.
+	bool is_passthrough;
+	bool is_passthrough_gap;
+	uint64_t passthrough_last;
+	uint32_t passthrough_packet;
+	std::string passthrough_data;
+
+	uint32_t next_segment;
+	uint32_t sent_segment;
+	size_t outstanding_segments;
+	uint64_t link_free;
+	Link links[RLM3_WIFI_LINK_COUNT];
+};
+
+struct Task
+{
+	std::function<void()> body;
+	bool is_started = true;
+	bool is_done = false;
+	bool is_notified = false;
+	bool is_delay = false;
+	uint64_t deadline = UINT64_MAX;
+};
+
+
+static EMU_WIFI_Config g_config;
+static EMU_WIFI_Stats g_stats;
+static uint32_t g_random;
+
+static uint64_t g_now = 0;
+static std::multimap<uint64_t, std::function<void()>> g_events;
+static Task g_main_task;
+static std::vector<Task*> g_tasks;
+static Task* g_current_task = &g_main_task;
+static std::mutex g_task_mutex;
+static std::condition_variable g_task_switch;
+
+static bool g_uart_is_init = false;
+static uint32_t g_uart_baud_rate = 0;
+static bool g_uart_is_transmitting = false;
+static uint64_t g_uart_receive_free = 0;
+
+static uint32_t g_gpio_state = 0;
+static Module g_module;
+static bool g_is_dns_available = true;
+
+
+static void Schedule(uint64_t time, std::function<void()> event)
+{
+	g_events.emplace(std::max(time, g_now), std::move(event));
+}
+
+static bool RunNextEvent(uint64_t deadline)
+{
+	if (g_events.empty() || g_events.begin()->first > deadline)
+		return false;
+	std::multimap<uint64_t, std::function<void()>>::iterator next = g_events.begin();
+	g_now = next->first;
+	std::function<void()> event = std::move(next->second);
+	g_events.erase(next);
+	event();
+	return true;
+}
+
+static uint64_t ByteTime(uint32_t baud_rate)
+{
+	// Start bit, eight data bits, and a stop bit.
+	return 10000000000ull / baud_rate;
+}
+
+static uint64_t Microseconds(uint32_t time_us)
+{
+	return 1000ull * time_us;
+}
+
+static double Random()
+{
+	g_random = g_random * 1664525 + 1013904223;
+	return (g_random >> 8) / (double)(1 << 24);
+}
+
+static uint8_t Garble(uint8_t x)
+{
+	// What a byte looks like when the two ends disagree about the baud rate.
+	return x ^ 0xA5;
+}
+
+static void DriverReceive(uint8_t x)
+{
+	if (!g_uart_is_init)
+		return;
+	RLM3_UART4_ReceiveCallback((g_uart_baud_rate == g_module.baud_rate) ? x : Garble(x));
+}
+
+static void ModuleWrite(const std::string& text)
+{
+	for (char c : text)
+	{
+		g_uart_receive_free = std::max(g_uart_receive_free, g_now) + ByteTime(g_module.baud_rate);
+		uint8_t x = (uint8_t)c;
+		Schedule(g_uart_receive_free, [x]() { DriverReceive(x); });
+	}
+	g_stats.bytes_from_module += text.size();
+}
+
+static void ModuleLater(uint64_t delay, std::function<void()> event)
+{
+	// Anything the module planned before a reset never happens.
+	uint32_t generation = g_module.generation;
+	Schedule(g_now + delay, [generation, event]() { if (g_module.generation == generation) event(); });
+}
+
+static void ModuleWriteLater(uint64_t delay, const std::string& text)
+{
+	ModuleLater(delay, [text]() { ModuleWrite(text); });
+}
+
+static void ModuleReply(const std::string& text)
+{
+	ModuleWriteLater(Microseconds(g_config.command_time_us), text);
+}
+
+static std::string Format(const char* format, ...) __attribute__((format(printf, 1, 2)));
+static std::string Format(const char* format, ...)
+{
+	char buffer[128];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(buffer, sizeof(buffer), format, args);
+	va_end(args);
+	return buffer;
+}
+
+static void PeerWrite(size_t link_id, const std::string& data)
+{
+	if (link_id >= RLM3_WIFI_LINK_COUNT || !g_module.links[link_id].is_connected)
+		return;
+	if (g_module.is_passthrough)
+	{
+		ModuleWrite(data);
+		return;
+	}
+	// A datagram always arrives whole.  The module only holds TCP data in passive mode.
+	bool is_udp = g_module.links[link_id].is_udp;
+	size_t chunk_size = is_udp ? data.size() : MAX_IPD_SIZE;
+	for (size_t i = 0; i < data.size(); i += chunk_size)
+	{
+		std::string chunk = data.substr(i, chunk_size);
+		if (g_module.is_receive_passive && g_module.is_multiple_connections && !is_udp)
+		{
+			g_module.links[link_id].held_data += chunk;
+			ModuleWrite(Format("+IPD,%u,%u\r\n", (unsigned int)link_id, (unsigned int)chunk.size()));
+		}
+		else if (g_module.is_multiple_connections)
+			ModuleWrite(Format("\r\n+IPD,%u,%u:", (unsigned int)link_id, (unsigned int)chunk.size()) + chunk);
+		else
+			ModuleWrite(Format("\r\n+IPD,%u:", (unsigned int)chunk.size()) + chunk);
+	}
+}
+
+static void CloseLink(size_t link_id)
+{
+	if (!g_module.links[link_id].is_connected)
+		return;
+	g_module.links[link_id].is_connected = false;
+	g_module.links[link_id].held_data.clear();
+	if (g_module.is_multiple_connections)
+		ModuleWrite(Format("%u,CLOSED\r\n", (unsigned int)link_id));
+	else
+		ModuleWrite("CLOSED\r\n");
+}
+
+static void ResetModule()
+{
+	g_module.generation++;
+	g_module.is_running = false;
+	g_module.baud_rate = DEFAULT_BAUD_RATE;
+	g_module.is_echo = true;
+	g_module.is_multiple_connections = false;
+	g_module.is_passthrough_mode = false;
+	g_module.is_receive_passive = false;
+	g_module.is_joined = false;
+	g_module.wifi_mode = 1;
+	g_module.is_server_enabled = false;
+	g_module.line.clear();
+	g_module.busy_until = 0;
+	g_module.busy_text = "busy p...";
+	g_module.is_data_mode = false;
+	g_module.is_passthrough = false;
+	g_module.passthrough_data.clear();
+	g_module.next_segment = 0;
+	g_module.sent_segment = 0;
+	g_module.outstanding_segments = 0;
+	g_module.link_free = 0;
+	for (size_t i = 0; i < RLM3_WIFI_LINK_COUNT; i++)
+		g_module.links[i].is_connected = false;
+}
+
+static void BootModule()
+{
+	ResetModule();
+	ModuleLater(Microseconds(g_config.boot_time_us), []()
+	{
+		// The boot ROM talks at 74880 baud, which is noise at any rate the driver uses.
+		g_module.is_running = true;
+		ModuleWrite("\r\n\x8f\x12\xe4\x7f\xa3\r\n");
+		ModuleWrite("\r\nAi-Thinker Technology Co. Ltd.\r\n\r\nready\r\n");
+	});
+}
+
+static bool ParseArguments(const std::string& text, std::string* arguments, size_t count)
+{
+	// Comma separated, with optional quotes.
+	size_t index = 0;
+	std::string current;
+	bool is_quoted = false;
+	for (char c : text)
+	{
+		if (c == '"')
+			is_quoted = !is_quoted;
+		else if (c == ',' && !is_quoted)
+		{
+			if (index >= count)
+				return false;
+			arguments[index++] = current;
+			current.clear();
+		}
+		else
+			current += c;
+	}
+	if (index >= count)
+		return false;
+	arguments[index++] = current;
+	return index == count && !is_quoted;
+}
+
+static bool ParseLinkId(const std::string& text, size_t* link_id)
+{
+	if (text.size() != 1 || text[0] < '0' || text[0] >= '0' + (int)RLM3_WIFI_LINK_COUNT)
+		return false;
+	*link_id = text[0] - '0';
+	return true;
+}
+
+static uint64_t LookupTime(const std::string& server)
+{
+	// The module looks up anything it is not given as an address.
+	if (server == g_config.server_address)
+		return 0;
+	g_stats.dns_lookup_count++;
+	return Microseconds(g_config.dns_time_us);
+}
+
+static bool IsResolvable(const std::string& server)
+{
+	return server == g_config.server_address || (server != g_config.unknown_server && g_is_dns_available);
+}
+
+static void FinishSegment(size_t link_id, bool is_buffered, uint32_t segment, const std::string& data)
+{
+	g_stats.segment_count++;
+	if (is_buffered)
+		g_module.outstanding_segments--;
+	g_module.sent_segment = segment;
+
+	Link& link = g_module.links[link_id];
+	bool is_dropped = link.is_connected && !link.is_udp && Random() < g_config.disconnect_probability;
+	if (is_dropped)
+		g_stats.disconnect_count++;
+	if (!link.is_connected || is_dropped)
+	{
+		if (is_buffered)
+			ModuleWrite(Format("%u,%u,SEND FAIL\r\n", (unsigned int)link_id, (unsigned int)segment));
+		else
+			ModuleWrite("\r\nSEND FAIL\r\n");
+		CloseLink(link_id);
+		return;
+	}
+
+	link.peer_data += data;
+	if (is_buffered)
+		ModuleWrite(Format("%u,%u,SEND OK\r\n", (unsigned int)link_id, (unsigned int)segment));
+	else
+		ModuleWrite("\r\nSEND OK\r\n");
+	if (g_config.is_peer_echo)
+		ModuleLater(Microseconds(g_config.send_time_us) / 2, [link_id, data]() { PeerWrite(link_id, data); });
+}
+
+static void FinishData()
+{
+	g_module.is_data_mode = false;
+	ModuleWrite(Format("\r\nRecv %u bytes\r\n", (unsigned int)g_module.data.size()));
+
+	// Segments go out one at a time at the link rate.
+	size_t link_id = g_module.data_link_id;
+	bool is_buffered = g_module.is_data_buffered;
+	uint32_t segment = g_module.data_segment;
+	std::string data = g_module.data;
+	// UDP reports the send without waiting for the peer.
+	uint64_t round_trip = g_module.links[link_id].is_udp ? 0 : Microseconds(g_config.send_time_us);
+	uint64_t duration = round_trip + 1000000000ull * data.size() / g_config.link_bytes_per_second;
+	g_module.link_free = std::max(g_module.link_free, g_now) + duration;
+	ModuleLater(g_module.link_free - g_now, [link_id, is_buffered, segment, data]() { FinishSegment(link_id, is_buffered, segment, data); });
+
+	// A plain send holds the command channel until it completes.
+	if (!is_buffered)
+	{
+		g_module.busy_until = g_module.link_free;
+		g_module.busy_text = "busy s...";
+	}
+}
+
+static void BeginData(size_t link_id, size_t size, bool is_buffered, uint32_t segment)
+{
+	g_module.is_data_mode = true;
+	g_module.is_data_buffered = is_buffered;
+	g_module.data_link_id = link_id;
+	g_module.data_size = size;
+	g_module.data_segment = segment;
+	g_module.data.clear();
+}
+
+static void SendPassthroughPacket()
+{
+	std::string data;
+	data.swap(g_module.passthrough_data);
+	g_module.passthrough_packet++;
+
+	// A packet of just "+++" after a quiet spell is the escape back to commands.  The module says nothing.
+	if (data == "+++" && g_module.is_passthrough_gap)
+	{
+		g_module.is_passthrough = false;
+		return;
+	}
+
+	g_stats.segment_count++;
+	uint64_t duration = 1000000000ull * data.size() / g_config.link_bytes_per_second;
+	g_module.link_free = std::max(g_module.link_free, g_now) + duration;
+	ModuleLater(g_module.link_free - g_now, [data]()
+	{
+		Link& link = g_module.links[0];
+		if (!link.is_connected)
+			return;
+		link.peer_data += data;
+		if (g_config.is_peer_echo)
+			ModuleLater(Microseconds(g_config.send_time_us) / 2, [data]() { PeerWrite(0, data); });
+	});
+}
+
+static void PassthroughReceive(uint8_t x)
+{
+	if (g_module.passthrough_data.empty())
+	{
+		g_module.is_passthrough_gap = (g_now - g_module.passthrough_last >= PASSTHROUGH_PACKET_TIME);
+		uint32_t packet = g_module.passthrough_packet;
+		ModuleLater(PASSTHROUGH_PACKET_TIME, [packet]() { if (g_module.passthrough_packet == packet) SendPassthroughPacket(); });
+	}
+	g_module.passthrough_data += (char)x;
+	g_module.passthrough_last = g_now;
+	if (g_module.passthrough_data.size() >= MAX_SEGMENT_SIZE)
+		SendPassthroughPacket();
+}
+
+static void ModuleCommand(const std::string& command)
+{
+	g_stats.command_count++;
+	if (g_module.is_echo)
+		ModuleWrite(command + "\r\n");
+
+	if (g_now < g_module.busy_until || Random() < g_config.busy_probability)
+	{
+		g_stats.busy_count++;
+		ModuleWrite(std::string(g_module.busy_text) + "\r\n");
+		return;
+	}
+	g_module.busy_text = "busy p...";
+
+	std::string name = command.substr(0, command.find('='));
+	std::string value = (name.size() < command.size()) ? command.substr(name.size() + 1) : "";
+	std::string arguments[6];
+	size_t link_id = 0;
+
+	if (command == "AT")
+		ModuleReply("\r\nOK\r\n");
+	else if (command == "ATE0" || command == "ATE1")
+	{
+		g_module.is_echo = (command == "ATE1");
+		ModuleReply("\r\nOK\r\n");
+	}
+	else if (command == "AT+GMR")
+		ModuleReply("AT version:1.7.4.0(May 11 2020 19:13:04)\r\nSDK version:3.0.4(9532ceb)\r\ncompile time:May 27 2020 10:12:17\r\nBin version(Wroom 02):1.7.4\r\nOK\r\n");
+	else if (name == "AT+CIPMODE" && (value == "0" || !g_module.is_multiple_connections))
+	{
+		g_module.is_passthrough_mode = (value == "1");
+		ModuleReply("\r\nOK\r\n");
+	}
+	else if (name == "AT+CWMODE_CUR" && (value == "1" || value == "2" || value == "3"))
+	{
+		g_module.wifi_mode = std::atoi(value.c_str());
+		ModuleReply("\r\nOK\r\n");
+	}
+	else if (command == "AT+CWMODE_CUR?")
+		ModuleReply(Format("+CWMODE_CUR:%d\r\n\r\nOK\r\n", g_module.wifi_mode));
+	else if (name == "AT+CIPSERVER" && g_module.is_multiple_connections)
+	{
+		g_module.is_server_enabled = (value.substr(0, 1) == "1");
+		ModuleReply("\r\nOK\r\n");
+	}
+	else if (name == "AT+CWAUTOCONN" || name == "AT+CIPAP_CUR" || name == "AT+CWSAP_CUR")
+		ModuleReply("\r\nOK\r\n");
+	else if (command == "AT+CIPMUX?")
+		ModuleReply(Format("+CIPMUX:%d\r\n\r\nOK\r\n", g_module.is_multiple_connections ? 1 : 0));
+	else if (command == "AT+CIPSTATUS")
+	{
+		std::string reply;
+		bool is_linked = false;
+		for (size_t i = 0; i < RLM3_WIFI_LINK_COUNT; i++)
+		{
+			if (!g_module.links[i].is_connected)
+				continue;
+			const Link& link = g_module.links[i];
+			reply += Format("+CIPSTATUS:%u,\"%s\",\"10.0.0.1\",7,%u,%d\r\n", (unsigned int)i, link.is_udp ? "UDP" : "TCP", (unsigned int)(4000 + i), link.is_server ? 1 : 0);
+			is_linked = true;
+		}
+		int status = !g_module.is_joined ? 5 : is_linked ? 3 : 2;
+		ModuleReply(Format("STATUS:%d\r\n", status) + reply + "\r\nOK\r\n");
+	}
+	else if (name == "AT+CIPRECVMODE" && (value == "0" || value == "1"))
+	{
+		g_module.is_receive_passive = (value == "1");
+		ModuleReply("\r\nOK\r\n");
+	}
+	else if (name == "AT+CIPRECVDATA" && ParseArguments(value, arguments, 2) && ParseLinkId(arguments[0], &link_id) && g_module.is_receive_passive)
+	{
+		size_t size = std::atoi(arguments[1].c_str());
+		Link& link = g_module.links[link_id];
+		if (!link.is_connected || size == 0 || size > MAX_SEGMENT_SIZE)
+			ModuleReply("\r\nERROR\r\n");
+		else
+		{
+			std::string data = link.held_data.substr(0, size);
+			link.held_data.erase(0, data.size());
+			ModuleReply(Format("+CIPRECVDATA,%u:", (unsigned int)data.size()) + data + "\r\nOK\r\n");
+		}
+	}
+	else if (name == "AT+CIPMUX")
+	{
+		bool is_linked = false;
+		for (size_t i = 0; i < RLM3_WIFI_LINK_COUNT; i++)
+			if (g_module.links[i].is_connected)
+				is_linked = true;
+		if (is_linked)
+		{
+			ModuleReply("link is builded\r\n\r\nERROR\r\n");
+			return;
+		}
+		g_module.is_multiple_connections = (value == "1");
+		ModuleReply("\r\nOK\r\n");
+	}
+	else if (name == "AT+UART_CUR" && ParseArguments(value, arguments, 5) && std::atoi(arguments[0].c_str()) > 0)
+	{
+		// Answer at the old rate, then switch.
+		uint32_t baud_rate = std::atoi(arguments[0].c_str());
+		ModuleLater(Microseconds(g_config.command_time_us), [baud_rate]()
+		{
+			ModuleWrite("\r\nOK\r\n");
+			ModuleLater(g_uart_receive_free - g_now, [baud_rate]() { g_module.baud_rate = baud_rate; });
+		});
+	}
+	else if (name == "AT+CWJAP_CUR" && ParseArguments(value, arguments, 2))
+	{
+		g_module.busy_until = g_now + Microseconds(g_config.join_time_us);
+		if (arguments[0] != g_config.ssid)
+			ModuleWriteLater(Microseconds(g_config.join_time_us), "+CWJAP:3\r\n\r\nFAIL\r\n");
+		else if (arguments[1] != g_config.password)
+			ModuleWriteLater(Microseconds(g_config.join_time_us), "+CWJAP:2\r\n\r\nFAIL\r\n");
+		else
+		{
+			ModuleWriteLater(Microseconds(g_config.join_time_us) / 2, "WIFI CONNECTED\r\n");
+			ModuleLater(Microseconds(g_config.join_time_us), []()
+			{
+				g_module.is_joined = true;
+				ModuleWrite("WIFI GOT IP\r\n\r\nOK\r\n");
+			});
+		}
+	}
+	else if (command == "AT+CWQAP")
+	{
+		ModuleReply("\r\nOK\r\n");
+		ModuleLater(Microseconds(g_config.command_time_us), []() { EMU_WIFI_AccessPointLost(); });
+	}
+	else if (name == "AT+CIPDOMAIN" && ParseArguments(value, arguments, 1))
+	{
+		if (!g_module.is_joined)
+			ModuleReply("no ip\r\n\r\nERROR\r\n");
+		else
+		{
+			uint64_t lookup_time = LookupTime(arguments[0]);
+			g_module.busy_until = g_now + lookup_time;
+			if (!IsResolvable(arguments[0]))
+				ModuleWriteLater(lookup_time, "DNS Fail\r\n\r\nERROR\r\n");
+			else
+				ModuleWriteLater(lookup_time, "+CIPDOMAIN:" + g_config.server_address + "\r\n\r\nOK\r\n");
+		}
+	}
+	else if (name == "AT+CIPSTART" && (ParseArguments(value, arguments, 4) || ParseArguments(value, arguments, 6)) && ParseLinkId(arguments[0], &link_id) && g_module.is_multiple_connections)
+	{
+		// UDP has no handshake, so it is connected as soon as the command is done.
+		bool is_udp = (arguments[1] == "UDP");
+		uint64_t lookup_time = LookupTime(arguments[2]);
+		uint64_t connect_time = lookup_time + Microseconds(is_udp ? g_config.command_time_us : g_config.connect_time_us);
+		if (!g_module.is_joined)
+			ModuleReply("no ip\r\n\r\nERROR\r\n");
+		else if (g_module.links[link_id].is_connected)
+			ModuleReply("ALREADY CONNECTED\r\n\r\nERROR\r\n");
+		else if (!IsResolvable(arguments[2]))
+			ModuleWriteLater(lookup_time, "DNS Fail\r\n\r\nERROR\r\n");
+		else
+		{
+			g_module.busy_until = g_now + connect_time;
+			ModuleLater(connect_time, [link_id, is_udp]()
+			{
+				g_module.links[link_id].is_connected = true;
+				g_module.links[link_id].is_udp = is_udp;
+				g_module.links[link_id].is_server = false;
+				g_module.links[link_id].peer_data.clear();
+				ModuleWrite(Format("%u,CONNECT\r\n\r\nOK\r\n", (unsigned int)link_id));
+			});
+		}
+	}
+	else if (name == "AT+CIPSTART" && ParseArguments(value, arguments, 3) && !g_module.is_multiple_connections)
+	{
+		if (!g_module.is_joined)
+			ModuleReply("no ip\r\n\r\nERROR\r\n");
+		else if (g_module.links[0].is_connected)
+			ModuleReply("ALREADY CONNECTED\r\n\r\nERROR\r\n");
+		else if (!IsResolvable(arguments[1]))
+			ModuleWriteLater(LookupTime(arguments[1]), "DNS Fail\r\n\r\nERROR\r\n");
+		else
+		{
+			uint64_t connect_time = LookupTime(arguments[1]) + Microseconds(g_config.connect_time_us);
+			g_module.busy_until = g_now + connect_time;
+			ModuleLater(connect_time, []()
+			{
+				g_module.links[0].is_connected = true;
+				g_module.links[0].is_udp = false;
+				g_module.links[0].is_server = false;
+				g_module.links[0].peer_data.clear();
+				ModuleWrite("CONNECT\r\n\r\nOK\r\n");
+			});
+		}
+	}
+	else if (command == "AT+CIPCLOSE" && !g_module.is_multiple_connections)
+	{
+		if (!g_module.links[0].is_connected)
+			ModuleReply("UNLINK\r\n\r\nERROR\r\n");
+		else
+			ModuleLater(Microseconds(g_config.command_time_us), []()
+			{
+				CloseLink(0);
+				ModuleWrite("\r\nOK\r\n");
+			});
+	}
+	else if (command == "AT+CIPSEND" && g_module.is_passthrough_mode && g_module.links[0].is_connected)
+	{
+		g_module.is_passthrough = true;
+		g_module.passthrough_last = g_now;
+		ModuleReply("\r\nOK\r\n\r\n>");
+	}
+	else if (name == "AT+CIPCLOSE" && ParseLinkId(value, &link_id))
+	{
+		if (!g_module.links[link_id].is_connected)
+			ModuleReply("UNLINK\r\n\r\nERROR\r\n");
+		else
+			ModuleLater(Microseconds(g_config.command_time_us), [link_id]()
+			{
+				CloseLink(link_id);
+				ModuleWrite("\r\nOK\r\n");
+			});
+	}
+	else if ((name == "AT+CIPSEND" || name == "AT+CIPSENDBUF") && (ParseArguments(value, arguments, 2) || ParseArguments(value, arguments, 4)) && ParseLinkId(arguments[0], &link_id))
+	{
+		// Only UDP takes a remote address, and only TCP can be buffered.
+		size_t size = std::atoi(arguments[1].c_str());
+		bool is_buffered = (name == "AT+CIPSENDBUF");
+		bool is_remote = !arguments[2].empty();
+		if (!g_module.links[link_id].is_connected)
+			ModuleReply("link is not valid\r\n\r\nERROR\r\n");
+		else if (g_module.links[link_id].is_udp ? is_buffered : is_remote)
+			ModuleReply("\r\nERROR\r\n");
+		else if (size == 0 || size > MAX_SEGMENT_SIZE)
+			ModuleReply("\r\nERROR\r\n");
+		else if (is_buffered && g_module.outstanding_segments >= g_config.segment_buffer_count)
+		{
+			g_stats.busy_count++;
+			ModuleWrite("busy s...\r\n");
+		}
+		else if (is_buffered)
+		{
+			uint32_t segment = ++g_module.next_segment;
+			g_module.outstanding_segments++;
+			ModuleReply(Format("%u,%u\r\n\r\nOK\r\n> ", (unsigned int)segment, (unsigned int)g_module.sent_segment));
+			BeginData(link_id, size, true, segment);
+		}
+		else
+		{
+			ModuleReply("\r\nOK\r\n> ");
+			BeginData(link_id, size, false, 0);
+		}
+	}
+	else
+		ModuleReply("\r\nERROR\r\n");
+}
+
+static void ModuleReceive(uint8_t x)
+{
+	g_stats.bytes_to_module++;
+	if (!g_module.is_running)
+		return;
+
+	if (g_module.is_passthrough)
+	{
+		PassthroughReceive(x);
+		return;
+	}
+
+	if (g_module.is_data_mode)
+	{
+		g_module.data += (char)x;
+		if (g_module.data.size() == g_module.data_size)
+			FinishData();
+		return;
+	}
+
+	g_module.line += (char)x;
+	if (g_module.line.size() >= 2 && g_module.line.compare(g_module.line.size() - 2, 2, "\r\n") == 0)
+	{
+		std::string command = g_module.line.substr(0, g_module.line.size() - 2);
+		g_module.line.clear();
+		ModuleCommand(command);
+	}
+	else if (g_module.line.size() > MAX_LINE_SIZE)
+		g_module.line.clear();
+}
+
+static void TransmitNextByte()
+{
+	uint8_t x;
+	if (!g_uart_is_init || !RLM3_UART4_TransmitCallback(&x))
+	{
+		g_uart_is_transmitting = false;
+		return;
+	}
+
+	// The byte arrives once it is fully on the wire, and only makes sense if both ends agree on the rate.
+	uint64_t done = g_now + ByteTime(g_uart_baud_rate);
+	uint8_t received = (g_uart_baud_rate == g_module.baud_rate) ? x : Garble(x);
+	Schedule(done, [received]() { ModuleReceive(received); });
+	Schedule(done, TransmitNextByte);
+}
+
+extern void EMU_WIFI_Start(const EMU_WIFI_Config& config)
+{
+	g_config = config;
+	g_stats = EMU_WIFI_Stats();
+	g_random = config.seed;
+	g_now = 0;
+	g_events.clear();
+	// Tasks left over from a failed test stay blocked forever, so they are dropped but never freed.  Finished ones are already gone.
+	g_main_task = Task();
+	g_tasks.clear();
+	g_current_task = &g_main_task;
+	g_uart_is_init = false;
+	g_uart_baud_rate = 0;
+	g_uart_is_transmitting = false;
+	g_uart_receive_free = 0;
+	g_gpio_state = 0;
+	g_is_dns_available = true;
+	ResetModule();
+}
+
+extern uint64_t EMU_WIFI_GetTime()
+{
+	return g_now;
+}
+
+extern void EMU_WIFI_PeerSend(size_t link_id, const std::string& data)
+{
+	PeerWrite(link_id, data);
+}
+
+extern void EMU_WIFI_PeerConnect(size_t link_id)
+{
+	if (link_id >= RLM3_WIFI_LINK_COUNT || !g_module.is_server_enabled || g_module.links[link_id].is_connected)
+		return;
+	Link& link = g_module.links[link_id];
+	link.is_connected = true;
+	link.is_udp = false;
+	link.is_server = true;
+	link.peer_data.clear();
+	ModuleWrite(Format("%u,CONNECT\r\n", (unsigned int)link_id));
+}
+
+extern void EMU_WIFI_PeerClose(size_t link_id)
+{
+	if (link_id < RLM3_WIFI_LINK_COUNT)
+		CloseLink(link_id);
+}
+
+extern std::string EMU_WIFI_GetPeerData(size_t link_id)
+{
+	return (link_id < RLM3_WIFI_LINK_COUNT) ? g_module.links[link_id].peer_data : "";
+}
+
+extern void EMU_WIFI_AccessPointLost()
+{
+	if (!g_module.is_joined)
+		return;
+	g_module.is_joined = false;
+	for (size_t i = 0; i < RLM3_WIFI_LINK_COUNT; i++)
+		CloseLink(i);
+	ModuleWrite("WIFI DISCONNECT\r\n");
+}
+
+extern void EMU_WIFI_SetDnsAvailable(bool is_available)
+{
+	g_is_dns_available = is_available;
+}
+
+extern EMU_WIFI_Stats EMU_WIFI_GetStats()
+{
+	return g_stats;
+}
+
+
+// UART
+
+extern void RLM3_UART4_Init(uint32_t baud_rate)
+{
+	g_uart_is_init = true;
+	g_uart_baud_rate = baud_rate;
+}
+
+extern void RLM3_UART4_Deinit()
+{
+	g_uart_is_init = false;
+	g_uart_is_transmitting = false;
+}
+
+extern bool RLM3_UART4_IsInit()
+{
+	return g_uart_is_init;
+}
+
+extern void RLM3_UART4_EnsureTransmit()
+{
+	if (!g_uart_is_init || g_uart_is_transmitting)
+		return;
+	g_uart_is_transmitting = true;
+	Schedule(g_now, TransmitNextByte);
+}
+
+
+// Task
+
+static bool IsTaskReady(const Task* task)
+{
+	if (task->is_done)
+		return false;
+	return !task->is_started || (task->is_notified && !task->is_delay) || g_now >= task->deadline;
+}
+
+static void RunTask(Task* task)
+{
+	{
+		std::unique_lock<std::mutex> lock(g_task_mutex);
+		g_task_switch.wait(lock, [task]() { return g_current_task == task; });
+	}
+	task->body();
+
+	// The main task decides what runs next.
+	std::unique_lock<std::mutex> lock(g_task_mutex);
+	task->is_done = true;
+	g_current_task = &g_main_task;
+	g_task_switch.notify_all();
+}
+
+static void SwitchTask(Task* next)
+{
+	std::unique_lock<std::mutex> lock(g_task_mutex);
+	Task* self = g_current_task;
+	g_current_task = next;
+	if (!next->is_started)
+	{
+		next->is_started = true;
+		std::thread(RunTask, next).detach();
+	}
+	g_task_switch.notify_all();
+	g_task_switch.wait(lock, [self]() { return g_current_task == self; });
+}
+
+static bool Block(uint64_t deadline, bool is_delay)
+{
+	Task* self = g_current_task;
+	self->deadline = deadline;
+	self->is_delay = is_delay;
+	bool result = false;
+	while (true)
+	{
+		for (size_t i = 0; i < g_tasks.size(); )
+		{
+			if (g_tasks[i]->is_done)
+			{
+				delete g_tasks[i];
+				g_tasks.erase(g_tasks.begin() + i);
+			}
+			else
+				i++;
+		}
+
+		if (self->is_notified && !is_delay)
+		{
+			self->is_notified = false;
+			result = true;
+			break;
+		}
+		if (g_now >= deadline)
+			break;
+
+		// Another task that is ready runs before any more time passes.
+		Task* next = NULL;
+		uint64_t until = deadline;
+		for (size_t i = 0; i <= g_tasks.size() && next == NULL; i++)
+		{
+			Task* task = (i == 0) ? &g_main_task : g_tasks[i - 1];
+			if (task == self || task->is_done)
+				continue;
+			if (IsTaskReady(task))
+				next = task;
+			until = std::min(until, task->deadline);
+		}
+		if (next != NULL)
+		{
+			SwitchTask(next);
+			continue;
+		}
+
+		if (RunNextEvent(until))
+			continue;
+		ASSERT(until != UINT64_MAX);
+		g_now = std::max(g_now, until);
+		if (until == deadline)
+			break;
+	}
+	self->deadline = UINT64_MAX;
+	self->is_delay = false;
+	return result;
+}
+
+extern void EMU_WIFI_StartTask(std::function<void()> body)
+{
+	Task* task = new Task();
+	task->body = std::move(body);
+	task->is_started = false;
+	g_tasks.push_back(task);
+}
+
+extern RLM3_Time RLM3_GetCurrentTime()
+{
+	return (RLM3_Time)(g_now / 1000000);
+}
+
+extern RLM3_Task RLM3_GetCurrentTask()
+{
+	return g_current_task;
+}
+
+extern void RLM3_Give(RLM3_Task task)
+{
+	if (task != NULL)
+		((Task*)task)->is_notified = true;
+}
+
+extern void RLM3_GiveFromISR(RLM3_Task task)
+{
+	if (task != NULL)
+		((Task*)task)->is_notified = true;
+}
+
+extern void RLM3_Take()
+{
+	Block(UINT64_MAX, false);
+}
+
+extern bool RLM3_TakeUntil(RLM3_Time start_time, RLM3_Time delay_ms)
+{
+	return Block(1000000ull * ((uint64_t)start_time + delay_ms), false);
+}
+
+extern bool RLM3_TakeTimeout(RLM3_Time timeout_ms)
+{
+	return RLM3_TakeUntil(RLM3_GetCurrentTime(), timeout_ms);
+}
+
+extern void RLM3_Delay(RLM3_Time time_ms)
+{
+	Block(g_now + 1000000ull * time_ms, true);
+}
+
+
+// GPIO
+
+#ifndef GPIOG
+static GPIO_TypeDef g_gpiog;
+GPIO_TypeDef* GPIOG = &g_gpiog;
+#endif
+
+extern void HAL_GPIO_Init(GPIO_TypeDef* port, GPIO_InitTypeDef* init)
+{
+}
+
+extern void HAL_GPIO_DeInit(GPIO_TypeDef* port, uint32_t pins)
+{
+}
+
+extern GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef* port, uint16_t pin)
+{
+	return (port == GPIOG && (g_gpio_state & pin) != 0) ? GPIO_PIN_SET : GPIO_PIN_RESET;
+}
+
+extern void HAL_GPIO_WritePin(GPIO_TypeDef* port, uint16_t pins, GPIO_PinState state)
+{
+	if (port != GPIOG)
+		return;
+
+	uint32_t run_pins = WIFI_ENABLE_Pin | WIFI_RESET_Pin;
+	bool was_running = (g_gpio_state & run_pins) == run_pins;
+	if (state == GPIO_PIN_SET)
+		g_gpio_state |= pins;
+	else
+		g_gpio_state &= ~pins;
+	bool is_running = (g_gpio_state & run_pins) == run_pins;
+
+	// The module boots when it is both enabled and out of reset, and stops as soon as either goes away.
+	if (is_running && !was_running)
+		BootModule();
+	if (!is_running && was_running)
+		ResetModule();
+}
+
+extern void RLM3_DebugOutputFromISR(uint8_t x)
+{
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "rlm3-base.h"
+#include <functional>
+#include <string>
+
+
+// Behavior of the emulated ESP-AT module.  Times are in microseconds of simulated time.
+struct EMU_WIFI_Config
+{
+	std::string ssid = "emu-sid";
+	std::string password = "emu-pwd";
+	std::string unknown_server = "unknown-server";	// CIPSTART to this server fails with DNS Fail.
+	std::string server_address = "10.0.0.1";		// What every other server name resolves to.
+
+	uint32_t boot_time_us = 300000;					// From reset released to "ready".
+	uint32_t command_time_us = 1000;				// From the end of a command to its response.
+	uint32_t join_time_us = 1500000;				// From CWJAP to WIFI GOT IP.
+	uint32_t connect_time_us = 40000;				// From CIPSTART to CONNECT, when given an address.
+	uint32_t dns_time_us = 20000;					// Looking up a server name, whether in CIPSTART or CIPDOMAIN.
+	uint32_t send_time_us = 4000;					// Round trip for one segment to the peer, not counting the payload.
+	uint32_t link_bytes_per_second = 500000;		// Rate at which the module pushes payload to the peer.
+	size_t segment_buffer_count = 4;				// CIPSENDBUF segments the module holds before it answers busy.
+
+	double busy_probability = 0.0;					// Chance that any command is refused with "busy p...".
+	double disconnect_probability = 0.0;			// Chance that a link drops while sending each segment.
+	bool is_peer_echo = false;						// The peer on every link sends back whatever it receives.
+	uint32_t seed = 1;
+};
+
+struct EMU_WIFI_Stats
+{
+	size_t command_count;
+	size_t busy_count;
+	size_t segment_count;
+	size_t disconnect_count;
+	size_t dns_lookup_count;
+	size_t bytes_to_module;
+	size_t bytes_from_module;
+};
+
+// Resets simulated time and powers down the module.  Call at the start of every test.
+extern void EMU_WIFI_Start(const EMU_WIFI_Config& config);
+
+// Current simulated time in nanoseconds.  RLM3_GetCurrentTime() reports the same clock in milliseconds.
+extern uint64_t EMU_WIFI_GetTime();
+
+// Runs body as another task whenever the current one blocks.  Body must record results for the test instead of asserting.
+extern void EMU_WIFI_StartTask(std::function<void()> body);
+
+// Things the other end of the connection or the access point can do.
+// A station on the module's local network connecting to its server.  Does nothing unless the server is running.
+extern void EMU_WIFI_PeerConnect(size_t link_id);
+extern void EMU_WIFI_PeerSend(size_t link_id, const std::string& data);
+extern void EMU_WIFI_PeerClose(size_t link_id);
+extern std::string EMU_WIFI_GetPeerData(size_t link_id);
+extern void EMU_WIFI_AccessPointLost();
+extern void EMU_WIFI_SetDnsAvailable(bool is_available);
+
+extern EMU_WIFI_Stats EMU_WIFI_GetStats();
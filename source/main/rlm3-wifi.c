@@ -6,12 +6,27 @@
 #include "logger.h"
 #include "Assert.h"
 #include <stdarg.h>
+#include <string.h>
+#include <time.h>
 
 
 LOGGER_ZONE(WIFI);
 
 
-#define MAX_SEND_COMMAND_ARGUMENTS (7)
+#define MAX_SEND_COMMAND_ARGUMENTS (9)
+#define DEFAULT_BAUD_RATE (115200)
+#define MAX_TRANSMIT_SEGMENT_SIZE (2048)
+#define MAX_RECEIVE_PASSIVE_SIZE (2048)
+#define TRANSMIT_ASYNC_TIMEOUT (10000)
+#define DEFAULT_TRANSMIT_TIMEOUT (10000)
+#define MAX_BOOT_TIME (990)
+#define PASSTHROUGH_ESCAPE_GUARD_TIME (50)
+#define PASSTHROUGH_EXIT_TIME (1000)
+#define LATENCY_LOOKUP_SIZE (64)
+#define CAPTURE_TIME_RECORD (0x00)
+#define CAPTURE_TIME_RECORD_SIZE (5)
+#define CAPTURE_TRANSMIT (0x80)
+#define CAPTURE_MAX_COUNT (0x7F)
 
 
 typedef enum State
@@ -21,43 +36,66 @@ typedef enum State
 	STATE_READ_DATA,
 	STATE_IGNORE_NEXT_LINE,
 	STATE_END,
-	// The STATE_X states contain the text actually received with SPACE, COMMA, COLON, DASH, DOT, ANY, and NN tokens.
-	STATE_X_A,
-	STATE_X_ALREADY_SPACE_CONNECT,
-	STATE_X_AT,
-	STATE_X_AT_SPACE_version_COLON_NN,
-	STATE_X_busy_SPACE,
-	STATE_X_busy_SPACE_p_DOT_DOT_DOT,
-	STATE_X_busy_SPACE_s_DOT_DOT_DOT,
-	STATE_X_DNS_SPACE_Fail,
-	STATE_X_ERROR,
-	STATE_X_FAIL,
-	STATE_X_NN,
-	STATE_X_NN_COMMA,
-	STATE_X_NN_COMMA_C,
-	STATE_X_NN_COMMA_CLOSED,
-	STATE_X_NN_COMMA_CONNECT,
-	STATE_X_NN_COMMA_SEND_SPACE_OK,
-	STATE_X_no_SPACE_ip,
-	STATE_X_OK,
-	STATE_X_PLUS,
-	STATE_X_PLUS_C,
-	STATE_X_PLUS_CWJAP_COLON,
-	STATE_X_PLUS_IPD_COMMA_NN,
-	STATE_X_PLUS_IPD_COMMA_NN_COMMA,
-	STATE_X_Recv_SPACE_NN,
-	STATE_X_Recv_SPACE_NN_SPACE_bytes,
-	STATE_X_S,
-	STATE_X_SDK_SPACE_version_COLON_NN,
-	STATE_X_SEND_SPACE,
-	STATE_X_SEND_SPACE_FAIL,
-	STATE_X_SEND_SPACE_OK,
-	STATE_X_WIFI_SPACE,
-	STATE_X_WIFI_SPACE_CONNECTED,
-	STATE_X_WIFI_SPACE_DISCONNECT,
-	STATE_X_WIFI_SPACE_GOT_SPACE_IP,
+	STATE_MATCH,
+	STATE_AT_VERSION,
+	STATE_SDK_VERSION,
+	STATE_DNS_ADDRESS,
+	STATE_LINK_STATUS,
+	STATE_PASSTHROUGH,
+	STATE_COUNT
 } State;
 
+typedef enum Owner
+{
+	OWNER_NONE,
+	OWNER_COMMAND,
+	OWNER_TRANSMIT_ASYNC,
+	OWNER_ABORT,
+} Owner;
+
+typedef struct DnsEntry
+{
+	char name[RLM3_WIFI_DNS_NAME_SIZE];
+	uint32_t address;
+	RLM3_Time time;
+	bool is_valid;
+} DnsEntry;
+
+typedef enum PoolState
+{
+	POOL_FREE,
+	POOL_BUSY,
+	POOL_IDLE,
+} PoolState;
+
+typedef struct PoolLink
+{
+	PoolState state;
+	char server[RLM3_WIFI_POOL_SERVER_SIZE];
+	char service[RLM3_WIFI_POOL_SERVICE_SIZE];
+	RLM3_Time release_time;
+} PoolLink;
+
+typedef enum TransmitAsyncState
+{
+	TRANSMIT_ASYNC_FREE,
+	TRANSMIT_ASYNC_CLAIMED,
+	TRANSMIT_ASYNC_QUEUED,
+	TRANSMIT_ASYNC_ACTIVE,
+} TransmitAsyncState;
+
+typedef struct TransmitAsync
+{
+	volatile uint32_t state;
+	uint32_t sequence;
+	size_t link_id;
+	const uint8_t* data;
+	size_t size;
+	size_t offset;
+	RLM3_WIFI_TransmitComplete on_complete;
+	void* context;
+} TransmitAsync;
+
 #define FLAG(COMMAND) (1 << (COMMAND))
 
 typedef enum Command
@@ -78,6 +116,10 @@ typedef enum Command
 	COMMAND_WIFI_GOT_IP,
 	COMMAND_BYTES_RECEIVED,
 	COMMAND_DNS_FAIL,
+	COMMAND_BUSY,
+	COMMAND_SEGMENT_SENT,
+	COMMAND_NO_IP,
+	COMMAND_READY,
 	COMMAND_CLOSED_BEGIN,
 	COMMAND_CLOSED_END = COMMAND_CLOSED_BEGIN + RLM3_WIFI_LINK_COUNT - 1,
 	COMMAND_CONNECT_BEGIN,
@@ -85,11 +127,147 @@ typedef enum Command
 	COMMAND_COUNT
 } Command;
 
+typedef enum Response
+{
+	RESPONSE_IGNORE,
+	RESPONSE_IGNORE_NEXT_LINE,
+	RESPONSE_GO_AHEAD,
+	RESPONSE_OK,
+	RESPONSE_ERROR,
+	RESPONSE_FAIL,
+	RESPONSE_ALREADY_CONNECTED,
+	RESPONSE_AT_VERSION,
+	RESPONSE_SDK_VERSION,
+	RESPONSE_BUSY_SENDING,
+	RESPONSE_BUSY_PROCESSING,
+	RESPONSE_DNS_FAIL,
+	RESPONSE_DNS_ADDRESS,
+	RESPONSE_NO_IP,
+	RESPONSE_READY,
+	RESPONSE_SINGLE_CONNECT,
+	RESPONSE_SINGLE_CLOSED,
+	RESPONSE_MULTIPLE_CONNECTIONS,
+	RESPONSE_STATUS,
+	RESPONSE_LINK_STATUS_TCP,
+	RESPONSE_LINK_STATUS_UDP,
+	RESPONSE_WIFI_MODE,
+	RESPONSE_SEND_OK,
+	RESPONSE_SEND_FAIL,
+	RESPONSE_BYTES_RECEIVED,
+	RESPONSE_SEGMENT_SENT,
+	RESPONSE_SEGMENT_FAIL,
+	RESPONSE_WIFI_CONNECTED,
+	RESPONSE_WIFI_DISCONNECT,
+	RESPONSE_WIFI_GOT_IP,
+	RESPONSE_JOIN_FAILED,
+	RESPONSE_LINK_CONNECT,
+	RESPONSE_LINK_CLOSED,
+	RESPONSE_RECEIVE_DATA,
+	RESPONSE_RECEIVE_PENDING,
+	RESPONSE_RECEIVE_PASSIVE_DATA,
+} Response;
+
+#ifdef RLM3_WIFI_ISR_TIMING
+typedef enum IsrTimer
+{
+	ISR_TIMER_RECEIVE,
+	ISR_TIMER_TRANSMIT,
+	ISR_TIMER_PARSE_BYTES,
+	ISR_TIMER_STATE_BEGIN,
+	ISR_TIMER_COUNT = ISR_TIMER_STATE_BEGIN + STATE_COUNT	// One for each parser state.
+} IsrTimer;
+
+typedef struct IsrTiming
+{
+	uint32_t count;
+	uint32_t min_time;
+	uint32_t max_time;
+	uint64_t total_time;
+} IsrTiming;
+
+static const char* const g_isr_timer_names[] =
+{
+	"receive", "transmit", "parse_bytes",
+	"state_initial", "state_invalid", "state_read_data", "state_ignore_next_line", "state_end", "state_match", "state_at_version", "state_sdk_version",
+	"state_dns_address", "state_link_status", "state_passthrough",
+};
+#endif
+
+typedef struct Pattern
+{
+	const char* text;
+	Response response;
+} Pattern;
+
+// Everything the module can say to us.  In the text, '#' matches a decimal number and '*' matches any other character.  A response
+// is recognized on the last character of its pattern.  The table must stay sorted and no pattern may be a prefix of another, so
+// the patterns that share the text received so far are always one contiguous range.  Any other line starting with IGNORE_PREFIX is
+// the reply to a query we do not parse, and is skipped rather than counted as a resync.
+static const Pattern g_patterns[] =
+{
+	{ "#,#\r", RESPONSE_IGNORE },
+	{ "#,#,SEND FAIL\r", RESPONSE_SEGMENT_FAIL },
+	{ "#,#,SEND OK\r", RESPONSE_SEGMENT_SENT },
+	{ "#,CLOSED\r", RESPONSE_LINK_CLOSED },
+	{ "#,CONNECT\r", RESPONSE_LINK_CONNECT },
+	{ "#,SEND OK\r", RESPONSE_SEGMENT_SENT },
+	{ "+CIPDOMAIN:", RESPONSE_DNS_ADDRESS },
+	{ "+CIPMUX:#\r", RESPONSE_MULTIPLE_CONNECTIONS },
+	{ "+CIPRECVDATA,#:", RESPONSE_RECEIVE_PASSIVE_DATA },
+	{ "+CIPSTATUS:#,\"TCP\",", RESPONSE_LINK_STATUS_TCP },
+	{ "+CIPSTATUS:#,\"UDP\",", RESPONSE_LINK_STATUS_UDP },
+	{ "+CWJAP:#*", RESPONSE_JOIN_FAILED },
+	{ "+CWMODE_CUR:#\r", RESPONSE_WIFI_MODE },
+	{ "+IPD,#,#\r", RESPONSE_RECEIVE_PENDING },
+	{ "+IPD,#,#:", RESPONSE_RECEIVE_DATA },
+	{ ">", RESPONSE_GO_AHEAD },
+	{ "ALREADY CONNECT\r", RESPONSE_ALREADY_CONNECTED },
+	{ "AT version:", RESPONSE_AT_VERSION },
+	{ "AT*", RESPONSE_IGNORE },
+	{ "Ai-Thinker", RESPONSE_IGNORE_NEXT_LINE },
+	{ "Bin version", RESPONSE_IGNORE },
+	{ "CLOSED\r", RESPONSE_SINGLE_CLOSED },
+	{ "CONNECT\r", RESPONSE_SINGLE_CONNECT },
+	{ "DNS Fail\r", RESPONSE_DNS_FAIL },
+	{ "ERROR\r", RESPONSE_ERROR },
+	{ "FAIL\r", RESPONSE_FAIL },
+	{ "OK\r", RESPONSE_OK },
+	{ "Recv # bytes\r", RESPONSE_BYTES_RECEIVED },
+	{ "SDK version:", RESPONSE_SDK_VERSION },
+	{ "SEND FAIL\r", RESPONSE_SEND_FAIL },
+	{ "SEND OK\r", RESPONSE_SEND_OK },
+	{ "STATUS:#\r", RESPONSE_STATUS },
+	{ "WIFI CONNECTED\r", RESPONSE_WIFI_CONNECTED },
+	{ "WIFI DISCONNECT\r", RESPONSE_WIFI_DISCONNECT },
+	{ "WIFI GOT IP\r", RESPONSE_WIFI_GOT_IP },
+	{ "busy p...\r", RESPONSE_BUSY_PROCESSING },
+	{ "busy s...\r", RESPONSE_BUSY_SENDING },
+	{ "compile time", RESPONSE_IGNORE },
+	{ "no ip\r", RESPONSE_NO_IP },
+	{ "ready\r", RESPONSE_READY },
+};
+
+#define PATTERN_COUNT (sizeof(g_patterns) / sizeof(g_patterns[0]))
+#define IGNORE_PREFIX "+CI"
+#define MAX_PATTERN_NUMBERS (2)
 
-static State g_state = STATE_INITIAL;
-static const char* g_expected = NULL;
 
+static State g_state = STATE_INITIAL;
+static size_t g_pattern_begin = 0;
+static size_t g_pattern_end = 0;
+static const char* g_pattern_text = NULL;
+static uint8_t g_pattern_index[0x80 + 1];
+static bool g_pattern_in_number = false;
+static size_t g_pattern_number_count = 0;
+static uint32_t g_pattern_numbers[MAX_PATTERN_NUMBERS];
+
+static volatile uint32_t g_owner = OWNER_NONE;
+static volatile RLM3_Task g_owner_waiting_thread = NULL;
 static volatile RLM3_Task g_client_thread = NULL;
+static volatile uint32_t g_command_ticket = 0;
+static volatile uint32_t g_command_serving = 0;
+static volatile RLM3_Task g_command_waiting_threads[RLM3_WIFI_COMMAND_QUEUE_SIZE] = { 0 };
+static uint32_t g_command_depth = 0;
 static volatile uint32_t g_command_flags = 0;
 static const char* volatile* g_transmit_data = NULL;
 static volatile uint32_t g_raw_transmit_count = 0;
@@ -100,42 +278,398 @@ static volatile bool g_wifi_connected = false;
 static volatile bool g_wifi_has_ip = false;
 static volatile bool g_is_tcp_outgoing[RLM3_WIFI_LINK_COUNT] = { 0 };
 static volatile bool g_tcp_connected[RLM3_WIFI_LINK_COUNT] = { 0 };
-static volatile uint32_t g_segment_count = 0;
+static volatile bool g_is_udp[RLM3_WIFI_LINK_COUNT] = { 0 };
+static volatile uint32_t g_segments_queued[RLM3_WIFI_LINK_COUNT] = { 0 };
+static volatile uint32_t g_segments_done[RLM3_WIFI_LINK_COUNT] = { 0 };
+static volatile size_t g_segment_buffered_link = RLM3_WIFI_LINK_COUNT;
+static bool g_is_transmit_buffered = false;
+
+static TransmitAsync g_transmit_async[RLM3_WIFI_TRANSMIT_ASYNC_QUEUE_SIZE];
+static volatile uint32_t g_transmit_async_sequence = 0;
+static TransmitAsync* volatile g_transmit_async_active = NULL;
+static volatile bool g_transmit_async_go_ahead = false;
+static volatile bool g_transmit_async_out_of_sync = false;
+static volatile RLM3_Time g_transmit_async_time = 0;
+static size_t g_transmit_async_segment = 0;
+static char g_transmit_async_command[24];
+static const char* g_transmit_async_command_data[2];
+static const char* g_transmit_async_raw_data = NULL;
+
+static uint8_t g_receive_buffer[RLM3_WIFI_LINK_COUNT][RLM3_WIFI_RECEIVE_BUFFER_SIZE];
+static volatile uint32_t g_receive_head[RLM3_WIFI_LINK_COUNT] = { 0 };
+static volatile uint32_t g_receive_tail[RLM3_WIFI_LINK_COUNT] = { 0 };
+static volatile uint32_t g_receive_start[RLM3_WIFI_LINK_COUNT] = { 0 };
+static volatile RLM3_Task g_receive_thread[RLM3_WIFI_LINK_COUNT] = { 0 };
+static volatile uint32_t g_receive_pending[RLM3_WIFI_LINK_COUNT] = { 0 };
+static volatile size_t g_receive_passive_link = RLM3_WIFI_LINK_COUNT;
+static volatile uint32_t g_receive_passive_length = 0;
+
+static uint8_t g_receive_block[RLM3_WIFI_RECEIVE_BLOCK_SIZE];
+static size_t g_receive_block_length = 0;
+
+// Only one segment arrives at a time, so a single buffer holds the datagram being received on any UDP link.
+static uint8_t g_datagram[RLM3_WIFI_DATAGRAM_SIZE];
+static size_t g_datagram_length = 0;
+static bool g_is_datagram = false;
+
+// Only touched by the task that owns the UART.
+static DnsEntry g_dns_cache[RLM3_WIFI_DNS_CACHE_SIZE];
+static bool g_is_dns_cache_enabled = false;
+static bool g_is_dns_stale_allowed = false;
+static volatile uint32_t g_dns_address = 0;
+
+// Only touched by the task that owns the UART.
+static PoolLink g_pool[RLM3_WIFI_LINK_COUNT];
 
 static uint8_t g_number = 0;
 static volatile uint32_t g_at_version = 0;
 static volatile uint32_t g_sdk_version = 0;
+static volatile bool g_is_multiple_connections = false;
+static volatile uint32_t g_wifi_mode = 0;
+static size_t g_link_status_link = 0;
+static bool g_is_link_status_udp = false;
+static uint32_t g_link_status_field = 0;
+static volatile size_t g_passthrough_link = RLM3_WIFI_LINK_COUNT;
+static volatile bool g_is_passthrough = false;
 static uint32_t g_receive_length = 0;
 
+static RLM3_WIFI_Stats g_stats;
+static volatile uint32_t g_operation = RLM3_WIFI_OPERATION_INIT;
+static RLM3_WIFI_LatencyHistogram g_latency[RLM3_WIFI_LATENCY_STAGE_COUNT];
+static volatile uint32_t g_latency_count = 0;
+static volatile uint32_t g_latency_sequence = 0;
+static uint8_t g_latency_lookup[LATENCY_LOOKUP_SIZE];
+static RLM3_Time g_stage_time = 0;
+
+#ifdef RLM3_WIFI_ISR_TIMING
+static IsrTiming g_isr_timing[ISR_TIMER_COUNT];
+static volatile uint32_t g_isr_timing_sequence = 0;
+#endif
+
+static uint8_t g_capture_buffer[RLM3_WIFI_CAPTURE_BUFFER_SIZE];
+static volatile bool g_is_capture_enabled = false;
+static uint32_t g_capture_head = 0;
+static uint32_t g_capture_tail = 0;
+static uint32_t g_capture_record = 0;
+static bool g_is_capture_record_open = false;
+static bool g_is_capture_time_written = false;
+static RLM3_Time g_capture_time = 0;
+
 #ifdef TEST
 static uint8_t g_invalid_buffer[32];
 static uint32_t g_invalid_buffer_length = 0;
 static State g_last_valid_state = STATE_INVALID;
 static uint32_t g_invalid_count = 0;
-static uint32_t g_error_count = 0;
 #endif
 
 
-static void BeginCommand()
+static uint32_t LinkFailFlags(size_t link_id)
+{
+	return FLAG(COMMAND_CLOSED_BEGIN + link_id) | FLAG(COMMAND_WIFI_DISCONNECT) | FLAG(COMMAND_NO_IP);
+}
+
+static void CountStat(uint32_t* counter, uint32_t amount)
+{
+	// Tasks and the interrupt both count.  Nothing is ordered by the counters, so relaxed is enough.
+	__atomic_fetch_add(counter, amount, __ATOMIC_RELAXED);
+}
+
+static bool TryAcquireOwner(Owner owner)
+{
+	uint32_t expected = OWNER_NONE;
+	return __atomic_compare_exchange_n(&g_owner, &expected, owner, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static void ReleaseOwner()
+{
+	__atomic_store_n(&g_owner, OWNER_NONE, __ATOMIC_RELEASE);
+	if (g_owner_waiting_thread != NULL)
+		RLM3_GiveFromISR(g_owner_waiting_thread);
+}
+
+static void StartTransmitAsyncSegment()
+{
+	TransmitAsync* transmit = g_transmit_async_active;
+	size_t remaining = transmit->size - transmit->offset;
+	g_transmit_async_segment = (remaining < MAX_TRANSMIT_SEGMENT_SIZE) ? remaining : MAX_TRANSMIT_SEGMENT_SIZE;
+	RLM3_Format(g_transmit_async_command, sizeof(g_transmit_async_command), "AT+CIPSEND=%u,%u\r\n", (unsigned int)transmit->link_id, (unsigned int)g_transmit_async_segment);
+
+	g_transmit_async_go_ahead = false;
+	g_transmit_async_time = RLM3_GetCurrentTime();
+	g_transmit_async_command_data[0] = g_transmit_async_command;
+	g_transmit_async_command_data[1] = NULL;
+	g_raw_transmit_count = 0;
+	g_transmit_data = g_transmit_async_command_data;
+	RLM3_UART4_EnsureTransmit();
+}
+
+static bool StartTransmitAsync()
+{
+	// The module may still be waiting for the rest of a failed transmit, so a new CIPSEND would land in its payload.
+	if (g_transmit_async_out_of_sync)
+		return false;
+
+	// Pick the oldest queued transmit.
+	TransmitAsync* next = NULL;
+	for (size_t i = 0; i < RLM3_WIFI_TRANSMIT_ASYNC_QUEUE_SIZE; i++)
+	{
+		TransmitAsync* transmit = &g_transmit_async[i];
+		if (transmit->state == TRANSMIT_ASYNC_QUEUED && (next == NULL || (int32_t)(transmit->sequence - next->sequence) < 0))
+			next = transmit;
+	}
+	if (next == NULL)
+		return false;
+
+	next->state = TRANSMIT_ASYNC_ACTIVE;
+	g_transmit_async_active = next;
+	StartTransmitAsyncSegment();
+	return true;
+}
+
+static void RunTransmitAsync()
+{
+	// Another queued transmit may show up between giving up ownership and checking the queue, so keep trying until one of them starts or the queue is empty.
+	for (;;)
+	{
+		bool is_queued = false;
+		for (size_t i = 0; i < RLM3_WIFI_TRANSMIT_ASYNC_QUEUE_SIZE; i++)
+			if (g_transmit_async[i].state == TRANSMIT_ASYNC_QUEUED)
+				is_queued = true;
+		if (!is_queued || g_transmit_async_out_of_sync || !TryAcquireOwner(OWNER_TRANSMIT_ASYNC))
+			return;
+		if (StartTransmitAsync())
+			return;
+		ReleaseOwner();
+	}
+}
+
+static void CompleteTransmitAsync(TransmitAsync* transmit, bool success, bool is_in_sync)
+{
+	// The interrupt and a task giving up on a stalled transmit can both get here.  Only one of them gets to report it.
+	uint32_t expected = TRANSMIT_ASYNC_ACTIVE;
+	if (!__atomic_compare_exchange_n(&transmit->state, &expected, TRANSMIT_ASYNC_CLAIMED, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		return;
+
+	RLM3_WIFI_TransmitComplete on_complete = transmit->on_complete;
+	void* context = transmit->context;
+	g_transmit_async_active = NULL;
+	transmit->state = TRANSMIT_ASYNC_FREE;
+	if (!is_in_sync)
+	{
+		g_transmit_async_time = RLM3_GetCurrentTime();
+		g_transmit_async_out_of_sync = true;
+	}
+	if (on_complete != NULL)
+		on_complete(context, success);
+
+	// Let a waiting command have the UART before starting the next transmit.
+	if (g_owner_waiting_thread != NULL || !StartTransmitAsync())
+		ReleaseOwner();
+}
+
+static void NotifyTransmitAsync(Command command)
+{
+	TransmitAsync* transmit = g_transmit_async_active;
+	if (transmit == NULL)
+		return;
+
+	if (command == COMMAND_ERROR || command == COMMAND_FAIL || command == COMMAND_SEND_FAIL)
+	{
+		CompleteTransmitAsync(transmit, false, true);
+	}
+	else if ((FLAG(command) & LinkFailFlags(transmit->link_id)) != 0)
+	{
+		// The module has not answered the CIPSEND yet, so stop feeding it and hold the queue until it does.
+		g_transmit_data = NULL;
+		CompleteTransmitAsync(transmit, false, false);
+	}
+	else if (command == COMMAND_GO_AHEAD && !g_transmit_async_go_ahead)
+	{
+		g_transmit_async_go_ahead = true;
+		g_transmit_async_time = RLM3_GetCurrentTime();
+		g_transmit_async_raw_data = (const char*)(transmit->data + transmit->offset);
+		g_raw_transmit_count = g_transmit_async_segment;
+		g_transmit_data = &g_transmit_async_raw_data;
+		RLM3_UART4_EnsureTransmit();
+	}
+	else if (command == COMMAND_SEND_OK && g_transmit_async_go_ahead)
+	{
+		CountStat(&g_stats.links[transmit->link_id].bytes_sent, g_transmit_async_segment);
+		CountStat(&g_stats.links[transmit->link_id].segments_sent, 1);
+		transmit->offset += g_transmit_async_segment;
+		if (transmit->offset < transmit->size)
+			StartTransmitAsyncSegment();
+		else
+			CompleteTransmitAsync(transmit, true, true);
+	}
+}
+
+static void AbortTransmitAsync()
+{
+	// Take the UART away from the interrupt first so it cannot move the transmit along while we tear it down.
+	uint32_t expected = OWNER_TRANSMIT_ASYNC;
+	if (!__atomic_compare_exchange_n(&g_owner, &expected, OWNER_ABORT, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+	TransmitAsync* transmit = g_transmit_async_active;
+	if (transmit == NULL)
+	{
+		// The transmit is still being started by another task.
+		__atomic_store_n(&g_owner, OWNER_TRANSMIT_ASYNC, __ATOMIC_RELEASE);
+		return;
+	}
+	LOG_WARN("Timeout transmit_async %x", (int)g_command_flags);
+	g_transmit_data = NULL;
+	CompleteTransmitAsync(transmit, false, false);
+}
+
+static void ResumeTransmitAsync()
+{
+	g_transmit_async_out_of_sync = false;
+	RunTransmitAsync();
+}
+
+static void CheckTransmitAsync()
+{
+	// A module that never answers after a failed transmit is assumed to have given up on it.
+	if (g_transmit_async_out_of_sync && RLM3_GetCurrentTime() - g_transmit_async_time >= TRANSMIT_ASYNC_TIMEOUT)
+		ResumeTransmitAsync();
+
+	// Commands give up on a stalled transmit while they wait for the UART, but with no command waiting nothing else would.
+	if (g_owner != OWNER_TRANSMIT_ASYNC || g_transmit_async_active == NULL)
+		return;
+	if (RLM3_GetCurrentTime() - g_transmit_async_time < TRANSMIT_ASYNC_TIMEOUT)
+		return;
+	CountStat(&g_stats.timeout_count[RLM3_WIFI_OPERATION_TRANSMIT_ASYNC], 1);
+	AbortTransmitAsync();
+}
+
+static void BeginCommand(RLM3_WIFI_Operation operation)
 {
-	ASSERT(g_client_thread == NULL);
+	RLM3_Task task = RLM3_GetCurrentTask();
+
+	// Operations made of several commands hold the UART for all of them.
+	if (g_client_thread == task)
+	{
+		g_command_depth++;
+		g_command_flags = 0;
+		return;
+	}
+
+	// Commands from different tasks run one at a time in the order they arrive.
+	// A task too far back in line to have a slot checks back every tick until one frees up.
+	uint32_t ticket = __atomic_fetch_add(&g_command_ticket, 1, __ATOMIC_RELAXED);
+	volatile RLM3_Task* slot = &g_command_waiting_threads[ticket % RLM3_WIFI_COMMAND_QUEUE_SIZE];
+	bool is_registered = false;
+	while (__atomic_load_n(&g_command_serving, __ATOMIC_ACQUIRE) != ticket)
+	{
+		RLM3_Task empty = NULL;
+		if (is_registered)
+			RLM3_Take();
+		else if (ticket - g_command_serving < RLM3_WIFI_COMMAND_QUEUE_SIZE && __atomic_compare_exchange_n(slot, &empty, task, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			is_registered = true;
+		else
+			RLM3_Delay(1);
+	}
+	if (is_registered)
+		*slot = NULL;
+
+	// Wait for any asynchronous transmit in progress to finish.
+	g_owner_waiting_thread = task;
+	while (!TryAcquireOwner(OWNER_COMMAND))
+	{
+		if (!RLM3_TakeUntil(g_transmit_async_time, TRANSMIT_ASYNC_TIMEOUT))
+		{
+			CountStat(&g_stats.timeout_count[RLM3_WIFI_OPERATION_TRANSMIT_ASYNC], 1);
+			AbortTransmitAsync();
+		}
+	}
+	g_owner_waiting_thread = NULL;
+
+	// Nested commands are counted as part of the operation that started them.
+	g_operation = operation;
+	CountStat(&g_stats.operation_count[operation], 1);
+
+	g_command_depth = 1;
 	g_command_flags = 0;
-	g_client_thread = RLM3_GetCurrentTask();
+	g_client_thread = task;
 }
 
 static void EndCommand()
 {
+	ASSERT(g_client_thread == RLM3_GetCurrentTask());
+	if (--g_command_depth > 0)
+		return;
+
 	g_client_thread = NULL;
+	ReleaseOwner();
+
+	// Hand the UART to the next task in line.
+	uint32_t serving = __atomic_add_fetch(&g_command_serving, 1, __ATOMIC_RELEASE);
+	RLM3_Task next = g_command_waiting_threads[serving % RLM3_WIFI_COMMAND_QUEUE_SIZE];
+	if (next != NULL)
+		RLM3_Give(next);
+
+	RunTransmitAsync();
+}
+
+static void RecordLatency(const char* action, RLM3_Time start_time, bool is_timeout)
+{
+	// Only the task that owns the UART records, so there is a single writer.
+	RLM3_Time now = RLM3_GetCurrentTime();
+	g_stage_time = now;
+
+	// Actions are string literals, so the same call site almost always finds its stage by address alone.
+	size_t count = g_latency_count;
+	uint8_t* lookup = &g_latency_lookup[((uintptr_t)action >> 2) % LATENCY_LOOKUP_SIZE];
+	size_t index = *lookup;
+	if (index == 0 || index > count || g_latency[index - 1].stage != action)
+	{
+		index = 0;
+		while (index < count && strcmp(g_latency[index].stage, action) != 0)
+			index++;
+		if (index == RLM3_WIFI_LATENCY_STAGE_COUNT)
+			return;
+		*lookup = (uint8_t)(index + 1);
+	}
+	else
+		index--;
+	RLM3_WIFI_LatencyHistogram* histogram = &g_latency[index];
+
+	// An odd sequence tells readers an update is under way.
+	uint32_t sequence = g_latency_sequence;
+	__atomic_store_n(&g_latency_sequence, sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	if (index == count)
+	{
+		memset(histogram, 0, sizeof(*histogram));
+		histogram->stage = action;
+		__atomic_store_n(&g_latency_count, count + 1, __ATOMIC_RELEASE);
+	}
+
+	uint32_t time = now - start_time;
+	size_t bucket = 0;
+	while (bucket + 1 < RLM3_WIFI_LATENCY_BUCKET_COUNT && (time >> bucket) != 0)
+		bucket++;
+	histogram->buckets[bucket]++;
+	histogram->count++;
+	histogram->total_time += time;
+	if (histogram->max_time < time)
+		histogram->max_time = time;
+	if (is_timeout)
+		histogram->timeout_count++;
+	__atomic_store_n(&g_latency_sequence, sequence + 2, __ATOMIC_RELEASE);
 }
 
 static bool WaitForResponse(const char* action, uint32_t timeout, uint32_t pass_command_flags, uint32_t fail_command_flags)
 {
 	RLM3_Time start_time = RLM3_GetCurrentTime();
+	RLM3_Time stage_time = g_stage_time;
 
 	// Wait until the server notifies us of one of the monitored commands.
 	uint32_t monitored_command_flags = pass_command_flags | fail_command_flags;
 	while ((g_command_flags & monitored_command_flags) == 0 && RLM3_TakeUntil(start_time, timeout))
 		;
+	RecordLatency(action, stage_time, (g_command_flags & monitored_command_flags) == 0);
 
 	if ((g_command_flags & fail_command_flags) != 0)
 	{
@@ -145,6 +679,7 @@ static bool WaitForResponse(const char* action, uint32_t timeout, uint32_t pass_
 
 	if ((g_command_flags & pass_command_flags) == 0)
 	{
+		CountStat(&g_stats.timeout_count[g_operation], 1);
 		LOG_WARN("Timeout %s %x", action, (int)g_command_flags);
 		return false;
 	}
@@ -152,20 +687,37 @@ static bool WaitForResponse(const char* action, uint32_t timeout, uint32_t pass_
 	return true;
 }
 
-static void SendRaw(const uint8_t* buffer, size_t size)
+static uint32_t TimeRemaining(RLM3_Time start_time, uint32_t timeout)
+{
+	RLM3_Time elapsed = RLM3_GetCurrentTime() - start_time;
+	return (elapsed < timeout) ? timeout - elapsed : 0;
+}
+
+static void SendRaw(const char* action, const uint8_t* buffer, size_t size)
 {
 	if (size == 0)
 		return;
+	RLM3_Time start_time = RLM3_GetCurrentTime();
 	g_raw_transmit_count = size;
 	const char* data = (const char*)buffer;
 	g_transmit_data = &data;
 	RLM3_UART4_EnsureTransmit();
 	while (g_transmit_data != NULL)
 		RLM3_Take();
+	RecordLatency(action, start_time, false);
 }
 
 static void SendV(const char* action, va_list args)
 {
+	// The module would pass the command on to the server as data, so fail it the way the module fails a command it rejects.
+	if (g_is_passthrough)
+	{
+		LOG_WARN("Passthrough %s", action);
+		g_command_flags |= FLAG(COMMAND_ERROR);
+		return;
+	}
+
+	RLM3_Time start_time = RLM3_GetCurrentTime();
 	const char* command_data[MAX_SEND_COMMAND_ARGUMENTS + 2];
 	size_t command_count = 0;
 
@@ -185,6 +737,7 @@ static void SendV(const char* action, va_list args)
 	RLM3_UART4_EnsureTransmit();
 	while (g_transmit_data != NULL)
 		RLM3_Take();
+	RecordLatency(action, start_time, false);
 }
 
 static void __attribute__((sentinel)) Send(const char* action, ...)
@@ -200,7 +753,8 @@ static bool __attribute__((sentinel)) SendCommandStandard(const char* action, ui
 	va_list args;
 	va_start(args, timeout);
 
-	BeginCommand();
+	// Always part of some larger operation.
+	BeginCommand((RLM3_WIFI_Operation)g_operation);
 	SendV(action, args);
 	bool result = WaitForResponse(action, timeout, FLAG(COMMAND_OK), FLAG(COMMAND_ERROR) | FLAG(COMMAND_FAIL));
 	EndCommand();
@@ -214,27 +768,129 @@ static void NotifyCommand(Command command)
 {
 	g_command_flags |= FLAG(command);
 	RLM3_GiveFromISR(g_client_thread);
+	if (g_owner == OWNER_TRANSMIT_ASYNC)
+		NotifyTransmitAsync(command);
+	else if (g_transmit_async_out_of_sync && (command == COMMAND_OK || command == COMMAND_ERROR || command == COMMAND_FAIL || command == COMMAND_SEND_OK || command == COMMAND_SEND_FAIL))
+		ResumeTransmitAsync();
+}
+
+static uint32_t SegmentsOutstanding(size_t link_id)
+{
+	return g_segments_queued[link_id] - g_segments_done[link_id];
+}
+
+static void NotifySegmentQueued()
+{
+	// Only segments queued by CIPSENDBUF are reported again once they are sent.
+	size_t link_id = g_segment_buffered_link;
+	if (link_id < RLM3_WIFI_LINK_COUNT)
+		g_segments_queued[link_id] = g_segments_queued[link_id] + 1;
+}
+
+static void NotifySegmentDone(size_t link_id)
+{
+	if (link_id < RLM3_WIFI_LINK_COUNT && SegmentsOutstanding(link_id) > 0)
+		g_segments_done[link_id] = g_segments_done[link_id] + 1;
+}
+
+static uint32_t ReceiveTail(size_t link_id)
+{
+	// The interrupt marks where a new connection's data starts instead of moving the reader's tail, so anything older is skipped.
+	uint32_t tail = g_receive_tail[link_id];
+	uint32_t start = g_receive_start[link_id];
+	return ((int32_t)(start - tail) > 0) ? start : tail;
+}
+
+static void NotifyReceiveData(size_t link_id, uint8_t x)
+{
+	if (link_id >= RLM3_WIFI_LINK_COUNT)
+		return;
+
+	// The interrupt is the only writer of the head and start and the reading task is the only writer of the tail.  Drop data when the buffer is full.
+	uint32_t head = g_receive_head[link_id];
+	if (head - ReceiveTail(link_id) < RLM3_WIFI_RECEIVE_BUFFER_SIZE)
+	{
+		g_receive_buffer[link_id][head % RLM3_WIFI_RECEIVE_BUFFER_SIZE] = x;
+		g_receive_head[link_id] = head + 1;
+		CountStat(&g_stats.links[link_id].bytes_received, 1);
+	}
+	else
+		CountStat(&g_stats.links[link_id].bytes_dropped, 1);
+
+	if (g_receive_thread[link_id] != NULL)
+		RLM3_GiveFromISR(g_receive_thread[link_id]);
+}
+
+static void NotifyReceiveDataBlock(size_t link_id, const uint8_t* data, size_t size)
+{
+	if (link_id >= RLM3_WIFI_LINK_COUNT)
+		return;
+
+	// Same as NotifyReceiveData, but copies as much of the block as fits in at most two pieces.
+	uint32_t head = g_receive_head[link_id];
+	size_t space = RLM3_WIFI_RECEIVE_BUFFER_SIZE - (head - ReceiveTail(link_id));
+	if (size > space)
+	{
+		CountStat(&g_stats.links[link_id].bytes_dropped, size - space);
+		size = space;
+	}
+	CountStat(&g_stats.links[link_id].bytes_received, size);
+	size_t offset = head % RLM3_WIFI_RECEIVE_BUFFER_SIZE;
+	size_t first = RLM3_WIFI_RECEIVE_BUFFER_SIZE - offset;
+	if (first > size)
+		first = size;
+	memcpy(&g_receive_buffer[link_id][offset], data, first);
+	memcpy(&g_receive_buffer[link_id][0], data + first, size - first);
+	g_receive_head[link_id] = head + size;
+
+	if (g_receive_thread[link_id] != NULL)
+		RLM3_GiveFromISR(g_receive_thread[link_id]);
+}
+
+static void NotifyReceiveBlock(size_t link_id)
+{
+	if (g_receive_block_length > 0 && link_id < RLM3_WIFI_LINK_COUNT)
+		RLM3_WIFI_ReceiveBlock_Callback(link_id, g_receive_block, g_receive_block_length);
+	g_receive_block_length = 0;
+}
+
+static void NotifyReceiveDatagram()
+{
+	if (g_is_datagram)
+		RLM3_WIFI_ReceiveDatagram_Callback(g_number, g_datagram, g_datagram_length);
+	g_is_datagram = false;
 }
 
 static void NotifyConnectToServer(size_t link_id)
 {
 	if (link_id >= RLM3_WIFI_LINK_COUNT)
 		return;
+	// Discard anything left over from a previous connection on this link.
+	g_receive_start[link_id] = g_receive_head[link_id];
+	g_segments_done[link_id] = g_segments_queued[link_id];
 	g_tcp_connected[link_id] = true;
+	CountStat(&g_stats.links[link_id].connect_count, 1);
 	NotifyCommand((Command)(COMMAND_CONNECT_BEGIN + link_id));
-	RLM3_WIFI_NetworkConnect_Callback(link_id, !g_is_tcp_outgoing[g_number]);
+	RLM3_WIFI_NetworkConnect_Callback(link_id, !g_is_tcp_outgoing[link_id]);
 }
 
 static void NotifyDisconnectFromServer(size_t link_id)
 {
 	if (link_id >= RLM3_WIFI_LINK_COUNT)
 		return;
-	if (!g_tcp_connected[g_number])
+	if (!g_tcp_connected[link_id])
 		return;
+	CountStat(&g_stats.links[link_id].disconnect_count, 1);
+	// The module drops whatever it was still holding for the link, and never reports the segments it had not sent.
+	g_receive_pending[link_id] = 0;
+	g_segments_done[link_id] = g_segments_queued[link_id];
 	NotifyCommand((Command)(COMMAND_CLOSED_BEGIN + link_id));
-	RLM3_WIFI_NetworkDisconnect_Callback(link_id, !g_is_tcp_outgoing[g_number]);
+	if (g_receive_thread[link_id] != NULL)
+		RLM3_GiveFromISR(g_receive_thread[link_id]);
+	RLM3_WIFI_NetworkDisconnect_Callback(link_id, !g_is_tcp_outgoing[link_id]);
 	g_is_tcp_outgoing[link_id] = false;
 	g_tcp_connected[link_id] = false;
+	g_is_udp[link_id] = false;
 }
 
 static void NotifyDisconnectFromAllServers()
@@ -243,16 +899,155 @@ static void NotifyDisconnectFromAllServers()
 		NotifyDisconnectFromServer(i);
 }
 
-extern bool RLM3_WIFI_Init()
+#ifdef RLM3_WIFI_ISR_TIMING
+static void InitIsrTiming()
+{
+	ASSERT(sizeof(g_isr_timer_names) / sizeof(g_isr_timer_names[0]) == ISR_TIMER_COUNT);
+	memset(g_isr_timing, 0, sizeof(g_isr_timing));
+#ifdef DWT
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+}
+
+static uint32_t GetIsrTime()
+{
+#ifdef DWT
+	return DWT->CYCCNT;
+#else
+	return RLM3_WIFI_GetCycleCount();
+#endif
+}
+
+static void RecordIsrTime(size_t timer, uint32_t time)
+{
+	// Only the interrupt writes these.  An odd sequence tells readers an update is under way.
+	IsrTiming* timing = &g_isr_timing[timer];
+	uint32_t sequence = g_isr_timing_sequence;
+	__atomic_store_n(&g_isr_timing_sequence, sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	if (timing->count == 0 || timing->min_time > time)
+		timing->min_time = time;
+	if (timing->max_time < time)
+		timing->max_time = time;
+	timing->total_time += time;
+	timing->count++;
+	__atomic_store_n(&g_isr_timing_sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+#endif
+
+static size_t CaptureRecordSize(uint32_t offset)
+{
+	uint8_t header = g_capture_buffer[offset % RLM3_WIFI_CAPTURE_BUFFER_SIZE];
+	return (header == CAPTURE_TIME_RECORD) ? CAPTURE_TIME_RECORD_SIZE : 1 + (header & CAPTURE_MAX_COUNT);
+}
+
+static void CaptureReserve(size_t size)
+{
+	// Drop the oldest records until there is room.
+	while (g_capture_head + size - g_capture_tail > RLM3_WIFI_CAPTURE_BUFFER_SIZE)
+	{
+		if (g_capture_tail == g_capture_record)
+			g_is_capture_record_open = false;
+		g_capture_tail += CaptureRecordSize(g_capture_tail);
+	}
+}
+
+static void CaptureWrite(uint8_t x)
+{
+	g_capture_buffer[g_capture_head++ % RLM3_WIFI_CAPTURE_BUFFER_SIZE] = x;
+}
+
+static void CaptureByte(uint8_t direction, uint8_t x)
+{
+	// Bytes come from the UART interrupt, or from RLM3_WIFI_ParseBytes at the same priority, so writes never interleave.
+	RLM3_Time time = RLM3_GetCurrentTime();
+	if (!g_is_capture_time_written || time != g_capture_time)
+	{
+		CaptureReserve(CAPTURE_TIME_RECORD_SIZE);
+		CaptureWrite(CAPTURE_TIME_RECORD);
+		for (size_t i = 0; i < 4; i++)
+			CaptureWrite((uint8_t)(time >> (8 * i)));
+		g_capture_time = time;
+		g_is_capture_time_written = true;
+		g_is_capture_record_open = false;
+	}
+
+	// Consecutive bytes in the same direction share a header.
+	CaptureReserve(1);
+	uint8_t* header = &g_capture_buffer[g_capture_record % RLM3_WIFI_CAPTURE_BUFFER_SIZE];
+	if (!g_is_capture_record_open || (*header & CAPTURE_TRANSMIT) != direction || (*header & CAPTURE_MAX_COUNT) == CAPTURE_MAX_COUNT)
+	{
+		CaptureReserve(2);
+		g_capture_record = g_capture_head;
+		g_is_capture_record_open = true;
+		header = &g_capture_buffer[g_capture_record % RLM3_WIFI_CAPTURE_BUFFER_SIZE];
+		CaptureWrite(direction);
+	}
+	(*header)++;
+	CaptureWrite(x);
+}
+
+static void IndexPatterns()
+{
+	// The first pattern starting with each ASCII character, so the first character of a line needs no search.
+	size_t pattern = 0;
+	for (size_t c = 0; c < sizeof(g_pattern_index); c++)
+	{
+		while (pattern < PATTERN_COUNT && (uint8_t)g_patterns[pattern].text[0] < c)
+			pattern++;
+		g_pattern_index[c] = pattern;
+	}
+}
+
+#ifdef TEST
+static void CheckPatterns()
+{
+	for (size_t i = 0; i < PATTERN_COUNT; i++)
+	{
+		const char* text = g_patterns[i].text;
+		size_t numbers = 0;
+		for (const char* c = text; *c != 0; c++)
+			if (*c == '#')
+				numbers++;
+		ASSERT(numbers <= MAX_PATTERN_NUMBERS);
+		ASSERT(text[0] != 0 && text[strlen(text) - 1] != '#');
+		ASSERT(text[0] < '0' || text[0] > '9');
+		if (i > 0)
+		{
+			const char* previous = g_patterns[i - 1].text;
+			ASSERT(strcmp(previous, text) < 0);
+			ASSERT(strncmp(previous, text, strlen(previous)) != 0);
+		}
+	}
+}
+#endif
+
+static void InitDriver(GPIO_PinState pin_state)
 {
 	ASSERT(COMMAND_COUNT < 32);
+	ASSERT((RLM3_WIFI_RECEIVE_BUFFER_SIZE & (RLM3_WIFI_RECEIVE_BUFFER_SIZE - 1)) == 0);
+	ASSERT(PATTERN_COUNT < 0x100);
+	ASSERT((RLM3_WIFI_CAPTURE_BUFFER_SIZE & (RLM3_WIFI_CAPTURE_BUFFER_SIZE - 1)) == 0);
+	ASSERT(RLM3_WIFI_LATENCY_STAGE_COUNT < 0x100);
+#ifdef TEST
+	CheckPatterns();
+#endif
+	IndexPatterns();
+	memset(&g_stats, 0, sizeof(g_stats));
+	g_latency_count = 0;
+	memset(g_latency_lookup, 0, sizeof(g_latency_lookup));
+#ifdef RLM3_WIFI_ISR_TIMING
+	InitIsrTiming();
+#endif
 
 	if (RLM3_UART4_IsInit())
 		RLM3_UART4_Deinit();
 
 	__HAL_RCC_GPIOG_CLK_ENABLE();
 
-	HAL_GPIO_WritePin(GPIOG, WIFI_ENABLE_Pin | WIFI_BOOT_MODE_Pin | WIFI_RESET_Pin, GPIO_PIN_RESET);
+	// The pins take this state as soon as they become outputs.
+	HAL_GPIO_WritePin(GPIOG, WIFI_ENABLE_Pin | WIFI_BOOT_MODE_Pin | WIFI_RESET_Pin, pin_state);
 
 	GPIO_InitTypeDef GPIO_InitStruct = { 0 };
 	GPIO_InitStruct.Pin = WIFI_ENABLE_Pin | WIFI_BOOT_MODE_Pin | WIFI_RESET_Pin;
@@ -263,35 +1058,79 @@ extern bool RLM3_WIFI_Init()
 
 	g_transmit_data = NULL;
 	g_state = STATE_INITIAL;
-	g_expected = NULL;
 	g_wifi_has_ip = false;
 	g_wifi_connected = false;
 	for (size_t i = 0; i < RLM3_WIFI_LINK_COUNT; i++)
 	{
 		g_is_tcp_outgoing[i] = false;
 		g_tcp_connected[i] = false;
+		g_is_udp[i] = false;
+		g_receive_head[i] = 0;
+		g_receive_tail[i] = 0;
+		g_receive_start[i] = 0;
+		g_receive_thread[i] = NULL;
+		g_receive_pending[i] = 0;
+	}
+	for (size_t i = 0; i < RLM3_WIFI_LINK_COUNT; i++)
+	{
+		g_segments_queued[i] = 0;
+		g_segments_done[i] = 0;
 	}
-	g_segment_count = 0;
+	g_segment_buffered_link = RLM3_WIFI_LINK_COUNT;
+	g_is_transmit_buffered = false;
 	g_receive_length = 0;
+	g_receive_block_length = 0;
+	g_is_datagram = false;
+	for (size_t i = 0; i < RLM3_WIFI_TRANSMIT_ASYNC_QUEUE_SIZE; i++)
+		g_transmit_async[i].state = TRANSMIT_ASYNC_FREE;
+	g_transmit_async_active = NULL;
+	g_transmit_async_out_of_sync = false;
+	g_owner = OWNER_NONE;
+	g_owner_waiting_thread = NULL;
 	g_client_thread = NULL;
+	// Starting over drops every ticket, so no other task may be waiting on the driver.
+	g_command_ticket = 0;
+	g_command_serving = 0;
+	g_command_depth = 0;
+	for (size_t i = 0; i < RLM3_WIFI_COMMAND_QUEUE_SIZE; i++)
+		g_command_waiting_threads[i] = NULL;
 	g_is_local_network_enabled = false;
+	g_passthrough_link = RLM3_WIFI_LINK_COUNT;
+	g_is_passthrough = false;
+	for (size_t i = 0; i < RLM3_WIFI_DNS_CACHE_SIZE; i++)
+		g_dns_cache[i].is_valid = false;
+	for (size_t i = 0; i < RLM3_WIFI_LINK_COUNT; i++)
+		g_pool[i].state = POOL_FREE;
+	g_is_dns_cache_enabled = false;
+	g_is_dns_stale_allowed = false;
 
 #ifdef TEST
 	g_invalid_buffer_length = 0;
 	g_last_valid_state = STATE_INVALID;
 	g_invalid_count = 0;
-	g_error_count = 0;
 #endif
+}
+
+extern bool RLM3_WIFI_Init()
+{
+	InitDriver(GPIO_PIN_RESET);
+
+	// Listen from the start so the ready banner is not missed.
+	RLM3_UART4_Init(DEFAULT_BAUD_RATE);
+	BeginCommand(RLM3_WIFI_OPERATION_INIT);
 
 	HAL_GPIO_WritePin(GPIOG, WIFI_BOOT_MODE_Pin, GPIO_PIN_SET);
 	HAL_GPIO_WritePin(GPIOG, WIFI_RESET_Pin, GPIO_PIN_RESET);
 	HAL_GPIO_WritePin(GPIOG, WIFI_ENABLE_Pin, GPIO_PIN_SET);
 	RLM3_Delay(10);
 
+	// Go on as soon as the module says it is ready.  Firmware that never does just costs the old fixed delay before the ping.
 	HAL_GPIO_WritePin(GPIOG, WIFI_RESET_Pin, GPIO_PIN_SET);
-	RLM3_Delay(990);
-
-	RLM3_UART4_Init(115200);
+	RLM3_Time boot_time = RLM3_GetCurrentTime();
+	while ((g_command_flags & FLAG(COMMAND_READY)) == 0 && RLM3_TakeUntil(boot_time, MAX_BOOT_TIME))
+		;
+	if ((g_command_flags & FLAG(COMMAND_READY)) != 0)
+		RecordLatency("ready", boot_time, false);
 
 	bool result = true;
 	if (result)
@@ -306,21 +1145,80 @@ extern bool RLM3_WIFI_Init()
 		result = SendCommandStandard("wifi_mode", 1000, "AT+CWMODE_CUR=1", NULL);
 	if (result)
 		result = SendCommandStandard("manual_connect", 1000, "AT+CWAUTOCONN=0", NULL);
+	EndCommand();
 
 	return result;
 }
 
+extern bool RLM3_WIFI_InitWarm()
+{
+	// A module held in reset or disabled is not running, so there is nothing to keep.
+	__HAL_RCC_GPIOG_CLK_ENABLE();
+	if (HAL_GPIO_ReadPin(GPIOG, WIFI_ENABLE_Pin) != GPIO_PIN_SET || HAL_GPIO_ReadPin(GPIOG, WIFI_RESET_Pin) != GPIO_PIN_SET)
+		return RLM3_WIFI_Init();
+
+	// Leave the module running and keep anything it is still connected to.
+	InitDriver(GPIO_PIN_SET);
+	RLM3_UART4_Init(DEFAULT_BAUD_RATE);
+
+	BeginCommand(RLM3_WIFI_OPERATION_INIT);
+	g_is_multiple_connections = false;
+	g_wifi_mode = 0;
+	bool result = true;
+	if (result)
+		result = SendCommandStandard("warm_ping", 100, "AT", NULL);
+	if (result)
+		result = SendCommandStandard("disable_echo", 1000, "ATE0", NULL);
+	if (result)
+		result = SendCommandStandard("warm_multiple_connections", 1000, "AT+CIPMUX?", NULL);
+	if (result)
+		result = g_is_multiple_connections;
+	if (result)
+		result = SendCommandStandard("warm_wifi_mode", 1000, "AT+CWMODE_CUR?", NULL);
+	// Station only, or station plus the access point and server from RLM3_WIFI_LocalNetworkEnable.
+	if (result)
+		result = (g_wifi_mode == 1 || g_wifi_mode == 3);
+	g_is_local_network_enabled = (g_wifi_mode == 3);
+	// Put back what a cold start would have, since nothing the driver tracks says otherwise.
+	if (result)
+		result = SendCommandStandard("manual_connect", 1000, "AT+CWAUTOCONN=0", NULL);
+	if (result)
+		result = SendCommandStandard("receive_mode", 1000, "AT+CIPRECVMODE=0", NULL);
+	if (result)
+		result = SendCommandStandard("warm_status", 1000, "AT+CIPSTATUS", NULL);
+	EndCommand();
+
+	if (result)
+		return true;
+
+	// The module is not in a state we can pick up from, so start it over.
+	LOG_WARN("Warm Init Failed");
+	return RLM3_WIFI_Init();
+}
+
 extern void RLM3_WIFI_Deinit()
 {
 	RLM3_UART4_Deinit();
 
+	// Fail anything still waiting to be sent.
+	for (size_t i = 0; i < RLM3_WIFI_TRANSMIT_ASYNC_QUEUE_SIZE; i++)
+	{
+		TransmitAsync* transmit = &g_transmit_async[i];
+		if (transmit->state != TRANSMIT_ASYNC_QUEUED)
+			continue;
+		transmit->state = TRANSMIT_ASYNC_FREE;
+		if (transmit->on_complete != NULL)
+			transmit->on_complete(transmit->context, false);
+	}
+	AbortTransmitAsync();
+
 	NotifyDisconnectFromAllServers();
 
 	HAL_GPIO_WritePin(GPIOG, WIFI_ENABLE_Pin | WIFI_BOOT_MODE_Pin | WIFI_RESET_Pin, GPIO_PIN_RESET);
 	HAL_GPIO_DeInit(GPIOG, WIFI_ENABLE_Pin | WIFI_BOOT_MODE_Pin | WIFI_RESET_Pin);
 
 #ifdef TEST
-	LOG_ALWAYS("Invalid %d Error %d", (int)g_invalid_count, (int)g_error_count);
+	LOG_ALWAYS("Invalid %d Error %d", (int)g_invalid_count, (int)g_stats.uart_error_count);
 #endif
 }
 
@@ -331,20 +1229,166 @@ extern bool RLM3_WIFI_IsInit()
 
 extern bool RLM3_WIFI_GetVersion(uint32_t* at_version, uint32_t* sdk_version)
 {
-	if (!SendCommandStandard("get_version", 1000, "AT+GMR", NULL))
-		return false;
+	BeginCommand(RLM3_WIFI_OPERATION_GET_VERSION);
+	bool result = SendCommandStandard("get_version", 1000, "AT+GMR", NULL);
+	EndCommand();
+
+	if (!result)
+		return false;
 	*at_version = g_at_version;
 	*sdk_version = g_sdk_version;
 	return true;
 }
 
+extern void RLM3_WIFI_GetStats(RLM3_WIFI_Stats* stats)
+{
+	// The stats are nothing but counters, so copy them one word at a time.
+	const uint32_t* source = (const uint32_t*)&g_stats;
+	uint32_t* target = (uint32_t*)stats;
+	for (size_t i = 0; i < sizeof(RLM3_WIFI_Stats) / sizeof(uint32_t); i++)
+		target[i] = __atomic_load_n(&source[i], __ATOMIC_RELAXED);
+}
+
+extern bool RLM3_WIFI_GetLatencyHistogram(size_t index, RLM3_WIFI_LatencyHistogram* histogram)
+{
+	if (index >= __atomic_load_n(&g_latency_count, __ATOMIC_ACQUIRE))
+		return false;
+
+	// Copy again if the driver updated a stage part way through, waiting a tick so a lower priority command task can finish.
+	while (true)
+	{
+		uint32_t sequence = __atomic_load_n(&g_latency_sequence, __ATOMIC_ACQUIRE);
+		if ((sequence & 1) == 0)
+		{
+			*histogram = g_latency[index];
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&g_latency_sequence, __ATOMIC_RELAXED) == sequence)
+				return true;
+		}
+		RLM3_Delay(1);
+	}
+}
+
+extern void RLM3_WIFI_SetCapture(bool enable)
+{
+	g_is_capture_enabled = false;
+	if (enable)
+	{
+		g_capture_head = 0;
+		g_capture_tail = 0;
+		g_is_capture_record_open = false;
+		g_is_capture_time_written = false;
+	}
+	g_is_capture_enabled = enable;
+}
+
+extern size_t RLM3_WIFI_GetCapture(uint8_t* buffer, size_t size)
+{
+	// The interrupt checks the flag before touching the capture and always runs to completion, so once it is clear the capture holds still.
+	bool is_enabled = g_is_capture_enabled;
+	g_is_capture_enabled = false;
+
+	uint32_t tail = g_capture_tail;
+	while (g_capture_head - tail > size)
+		tail += CaptureRecordSize(tail);
+	size_t result = g_capture_head - tail;
+	for (size_t i = 0; i < result; i++)
+		buffer[i] = g_capture_buffer[(tail + i) % RLM3_WIFI_CAPTURE_BUFFER_SIZE];
+
+	// Mark the gap with a fresh time record.
+	g_is_capture_record_open = false;
+	g_is_capture_time_written = false;
+	g_is_capture_enabled = is_enabled;
+	return result;
+}
+
+extern bool RLM3_WIFI_GetIsrTiming(size_t index, RLM3_WIFI_IsrTiming* timing)
+{
+#ifdef RLM3_WIFI_ISR_TIMING
+	if (index >= ISR_TIMER_COUNT)
+		return false;
+
+	// The 64 bit total takes two loads, so copy again if the interrupt updated it in between.
+	IsrTiming source;
+	while (true)
+	{
+		uint32_t sequence = __atomic_load_n(&g_isr_timing_sequence, __ATOMIC_ACQUIRE);
+		source = g_isr_timing[index];
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if ((sequence & 1) == 0 && __atomic_load_n(&g_isr_timing_sequence, __ATOMIC_RELAXED) == sequence)
+			break;
+	}
+
+	timing->name = g_isr_timer_names[index];
+	timing->count = source.count;
+	timing->min_time = source.min_time;
+	timing->mean_time = (source.count > 0) ? source.total_time / source.count : 0;
+	timing->max_time = source.max_time;
+	return true;
+#else
+	return false;
+#endif
+}
+
+static void ResetUart(uint32_t baud_rate)
+{
+	RLM3_UART4_Deinit();
+	RLM3_UART4_Init(baud_rate);
+
+	// Anything received while the rates did not match is garbage.
+	g_state = STATE_INITIAL;
+}
+
+extern bool RLM3_WIFI_SetBaudRate(uint32_t baud_rate)
+{
+	ASSERT(RLM3_WIFI_IsInit());
+
+	char baud_rate_str[11];
+	RLM3_Format(baud_rate_str, sizeof(baud_rate_str), "%u", (unsigned int)baud_rate);
+
+	BeginCommand(RLM3_WIFI_OPERATION_SET_BAUD_RATE);
+
+	// The module answers at the old rate and then switches.  This setting does not survive a reset.
+	bool result = SendCommandStandard("set_baud_rate", 1000, "AT+UART_CUR=", baud_rate_str, ",8,1,0,0", NULL);
+	bool is_lost = false;
+	if (result)
+	{
+		RLM3_Delay(10);
+		ResetUart(baud_rate);
+		result = SendCommandStandard("set_baud_rate_ping", 100, "AT", NULL);
+		if (!result)
+		{
+			// The module may have switched and only the ping was lost, so tell it to go back before we do.
+			LOG_WARN("Baud Rate %u Failed", (unsigned int)baud_rate);
+			char default_str[11];
+			RLM3_Format(default_str, sizeof(default_str), "%u", (unsigned int)DEFAULT_BAUD_RATE);
+			Send("set_baud_rate_restore", "AT+UART_CUR=", default_str, ",8,1,0,0", NULL);
+			RLM3_Delay(10);
+			ResetUart(DEFAULT_BAUD_RATE);
+			is_lost = !SendCommandStandard("set_baud_rate_fallback", 100, "AT", NULL);
+		}
+	}
+
+	EndCommand();
+
+	// Nothing more can be done with a module that answers at neither rate.
+	if (is_lost)
+	{
+		LOG_ERROR("Module Lost");
+		RLM3_WIFI_Deinit();
+	}
+
+	return result;
+}
+
 extern bool RLM3_WIFI_NetworkConnect(const char* ssid, const char* password)
 {
 	ASSERT(RLM3_WIFI_IsInit());
 
-	RLM3_WIFI_NetworkDisconnect();
+	BeginCommand(RLM3_WIFI_OPERATION_NETWORK_CONNECT);
 
-	BeginCommand();
+	RLM3_WIFI_NetworkDisconnect();
+	g_command_flags = 0;
 
 	bool result = true;
 	if (result)
@@ -362,7 +1406,7 @@ extern bool RLM3_WIFI_NetworkConnect(const char* ssid, const char* password)
 
 extern void RLM3_WIFI_NetworkDisconnect()
 {
-	BeginCommand();
+	BeginCommand(RLM3_WIFI_OPERATION_NETWORK_DISCONNECT);
 
 	if (g_wifi_connected)
 	{
@@ -383,378 +1427,1163 @@ extern bool RLM3_WIFI_IsNetworkConnected()
 	return g_wifi_connected && g_wifi_has_ip;
 }
 
-extern bool RLM3_WIFI_ServerConnect(size_t link_id, const char* server, const char* service)
+static bool IsAddress(const char* server)
+{
+	for (const char* c = server; *c != 0; c++)
+		if ((*c < '0' || *c > '9') && *c != '.')
+			return false;
+	return true;
+}
+
+static DnsEntry* FindDnsEntry(const char* server)
+{
+	for (size_t i = 0; i < RLM3_WIFI_DNS_CACHE_SIZE; i++)
+		if (g_dns_cache[i].is_valid && strcmp(g_dns_cache[i].name, server) == 0)
+			return &g_dns_cache[i];
+	return NULL;
+}
+
+static DnsEntry* ReplaceDnsEntry()
+{
+	RLM3_Time now = RLM3_GetCurrentTime();
+	DnsEntry* entry = &g_dns_cache[0];
+	for (size_t i = 0; i < RLM3_WIFI_DNS_CACHE_SIZE; i++)
+	{
+		if (!g_dns_cache[i].is_valid)
+			return &g_dns_cache[i];
+		if (now - g_dns_cache[i].time > now - entry->time)
+			entry = &g_dns_cache[i];
+	}
+	return entry;
+}
+
+static bool ResolveServer(const char* server, DnsEntry** result_entry, RLM3_Time start_time, uint32_t timeout)
+{
+	// Leaves the entry NULL when the module should look up the name itself.
+	*result_entry = NULL;
+	if (!g_is_dns_cache_enabled || IsAddress(server) || strlen(server) >= RLM3_WIFI_DNS_NAME_SIZE)
+		return true;
+
+	DnsEntry* entry = FindDnsEntry(server);
+	if (entry != NULL && RLM3_GetCurrentTime() - entry->time < RLM3_WIFI_DNS_TTL)
+	{
+		CountStat(&g_stats.dns_hit_count, 1);
+		*result_entry = entry;
+		return true;
+	}
+
+	g_command_flags = 0;
+	g_dns_address = 0;
+
+	bool result = true;
+	if (result)
+		Send("dns_lookup_a", "AT+CIPDOMAIN=\"", server, "\"", NULL);
+	if (result)
+		result = WaitForResponse("dns_lookup_b", TimeRemaining(start_time, timeout), FLAG(COMMAND_OK), FLAG(COMMAND_ERROR) | FLAG(COMMAND_FAIL));
+	if (result && g_dns_address != 0)
+	{
+		if (entry == NULL)
+			entry = ReplaceDnsEntry();
+		strcpy(entry->name, server);
+		entry->address = g_dns_address;
+		entry->time = RLM3_GetCurrentTime();
+		entry->is_valid = true;
+		*result_entry = entry;
+		return true;
+	}
+
+	if (entry != NULL && g_is_dns_stale_allowed)
+	{
+		LOG_WARN("Stale Address %s", server);
+		CountStat(&g_stats.dns_stale_count, 1);
+		*result_entry = entry;
+		return true;
+	}
+
+	// Firmware without the lookup command just answers ERROR, and then the module can still look the name up while connecting.
+	return (g_command_flags & FLAG(COMMAND_DNS_FAIL)) == 0;
+}
+
+static bool ConnectToServer(size_t link_id, bool is_udp, const char* server, const char* service, const char* local_service, const char* udp_mode_str, RLM3_Time start_time, uint32_t timeout)
+{
+	BeginCommand(RLM3_WIFI_OPERATION_SERVER_CONNECT);
+
+	RLM3_WIFI_ServerDisconnect(link_id);
+
+	DnsEntry* entry = NULL;
+	char address_str[16];
+	if (!ResolveServer(server, &entry, start_time, timeout))
+	{
+		EndCommand();
+		return false;
+	}
+	if (entry != NULL)
+	{
+		RLM3_Format(address_str, sizeof(address_str), "%u.%u.%u.%u", (unsigned int)(entry->address >> 24), (unsigned int)((entry->address >> 16) & 0xFF), (unsigned int)((entry->address >> 8) & 0xFF), (unsigned int)(entry->address & 0xFF));
+		server = address_str;
+	}
+	g_command_flags = 0;
+
+	char link_id_str[2] = { 0 };
+	link_id_str[0] = '0' + link_id;
+
+	g_is_tcp_outgoing[link_id] = true;
+	g_is_udp[link_id] = is_udp;
+
+	bool result = true;
+	if (result)
+		Send(is_udp ? "udp_connect_a" : "tcp_connect_a", "AT+CIPSTART=", link_id_str, is_udp ? ",\"UDP\",\"" : ",\"TCP\",\"", server, "\",", service, (*local_service != 0) ? "," : "", local_service, udp_mode_str, NULL);
+	if (result)
+		result = WaitForResponse(is_udp ? "udp_connect_b" : "tcp_connect_b", TimeRemaining(start_time, timeout), FLAG(COMMAND_OK), FLAG(COMMAND_ERROR) | FLAG(COMMAND_FAIL));
+	if (result)
+		result = WaitForResponse(is_udp ? "udp_connect_c" : "tcp_connect_c", TimeRemaining(start_time, timeout), FLAG(COMMAND_CONNECT_BEGIN + link_id), FLAG(COMMAND_CONNECTION_TIMEOUT) | FLAG(COMMAND_CONNECTION_WRONG_PASSWORD) | FLAG(COMMAND_CONNECTION_MISSING_AP) | FLAG(COMMAND_CONNECTION_FAILED) | FLAG(COMMAND_DNS_FAIL) | LinkFailFlags(link_id));
+
+	// The host may have moved, so look it up again next time but keep the address in case that lookup fails.
+	if (!result && entry != NULL)
+		entry->time = RLM3_GetCurrentTime() - RLM3_WIFI_DNS_TTL;
+
+	EndCommand();
+
+	return result;
+}
+
+extern bool RLM3_WIFI_ServerConnect(size_t link_id, const char* server, const char* service)
+{
+	if (link_id >= RLM3_WIFI_LINK_COUNT)
+		return false;
+
+	return ConnectToServer(link_id, false, server, service, "", "", RLM3_GetCurrentTime(), 30000);
+}
+
+extern bool RLM3_WIFI_UdpConnect(size_t link_id, const char* server, const char* service, const char* local_service, RLM3_WIFI_UdpMode mode)
+{
+	if (link_id >= RLM3_WIFI_LINK_COUNT)
+		return false;
+
+	// The module only takes a mode along with a local port.
+	char udp_mode_str[3] = { ',', (char)('0' + mode), 0 };
+	if (local_service == NULL)
+	{
+		local_service = "";
+		udp_mode_str[0] = 0;
+	}
+
+	return ConnectToServer(link_id, true, server, service, local_service, udp_mode_str, RLM3_GetCurrentTime(), 30000);
+}
+
+extern void RLM3_WIFI_SetDnsCache(bool enable, bool use_stale)
+{
+	g_is_dns_cache_enabled = enable;
+	g_is_dns_stale_allowed = use_stale;
+}
+
+extern size_t RLM3_WIFI_ServerConnectMany(RLM3_WIFI_ServerConnectRequest* requests, size_t count, uint32_t timeout)
+{
+	RLM3_Time start_time = RLM3_GetCurrentTime();
+
+	// The module only works on one CIPSTART at a time, so issue them back to back under one deadline without letting other commands in between.
+	BeginCommand(RLM3_WIFI_OPERATION_SERVER_CONNECT);
+	// Once the deadline passes, a CIPSTART would only finish after we stopped listening.
+	for (size_t i = 0; i < count && TimeRemaining(start_time, timeout) > 0; i++)
+		if (requests[i].link_id < RLM3_WIFI_LINK_COUNT)
+			ConnectToServer(requests[i].link_id, false, requests[i].server, requests[i].service, "", "", start_time, timeout);
+	EndCommand();
+
+	// Links connected early in the batch may have closed while later ones were connecting.
+	size_t connected_count = 0;
+	for (size_t i = 0; i < count; i++)
+	{
+		requests[i].is_connected = RLM3_WIFI_IsServerConnected(requests[i].link_id);
+		if (requests[i].is_connected)
+			connected_count++;
+	}
+
+	return connected_count;
+}
+
+static size_t FindPoolLink(const char* server, const char* service)
+{
+	// Idle links the server has closed in the meantime are of no use to anyone.
+	for (size_t i = 0; i < RLM3_WIFI_LINK_COUNT; i++)
+		if (g_pool[i].state == POOL_IDLE && !g_tcp_connected[i])
+			g_pool[i].state = POOL_FREE;
+
+	for (size_t i = 0; i < RLM3_WIFI_LINK_COUNT; i++)
+		if (g_pool[i].state == POOL_IDLE && strcmp(g_pool[i].server, server) == 0 && strcmp(g_pool[i].service, service) == 0)
+			return i;
+	return RLM3_WIFI_LINK_COUNT;
+}
+
+static size_t AllocatePoolLink()
+{
+	for (size_t i = 0; i < RLM3_WIFI_LINK_COUNT; i++)
+		if (g_pool[i].state == POOL_FREE && !g_tcp_connected[i])
+			return i;
+
+	// Every link is taken, so close the idle one that has waited longest.
+	RLM3_Time now = RLM3_GetCurrentTime();
+	size_t oldest = RLM3_WIFI_LINK_COUNT;
+	for (size_t i = 0; i < RLM3_WIFI_LINK_COUNT; i++)
+		if (g_pool[i].state == POOL_IDLE && (oldest == RLM3_WIFI_LINK_COUNT || now - g_pool[i].release_time > now - g_pool[oldest].release_time))
+			oldest = i;
+	if (oldest < RLM3_WIFI_LINK_COUNT)
+	{
+		CountStat(&g_stats.pool_evict_count, 1);
+		RLM3_WIFI_ServerDisconnect(oldest);
+		g_pool[oldest].state = POOL_FREE;
+	}
+	return oldest;
+}
+
+extern size_t RLM3_WIFI_PoolAcquire(const char* server, const char* service)
+{
+	BeginCommand(RLM3_WIFI_OPERATION_SERVER_CONNECT);
+
+	size_t link_id = FindPoolLink(server, service);
+	if (link_id < RLM3_WIFI_LINK_COUNT)
+		CountStat(&g_stats.pool_reuse_count, 1);
+	else
+	{
+		link_id = AllocatePoolLink();
+		if (link_id < RLM3_WIFI_LINK_COUNT && !RLM3_WIFI_ServerConnect(link_id, server, service))
+			link_id = RLM3_WIFI_LINK_COUNT;
+	}
+
+	if (link_id < RLM3_WIFI_LINK_COUNT)
+	{
+		// Names that do not fit are left empty, which never matches, so the link is closed on release.
+		PoolLink* link = &g_pool[link_id];
+		link->state = POOL_BUSY;
+		link->server[0] = 0;
+		link->service[0] = 0;
+		if (strlen(server) < sizeof(link->server) && strlen(service) < sizeof(link->service))
+		{
+			strcpy(link->server, server);
+			strcpy(link->service, service);
+		}
+	}
+
+	EndCommand();
+
+	return link_id;
+}
+
+extern void RLM3_WIFI_PoolRelease(size_t link_id, bool keep)
+{
+	if (link_id >= RLM3_WIFI_LINK_COUNT)
+		return;
+
+	BeginCommand(RLM3_WIFI_OPERATION_SERVER_DISCONNECT);
+
+	PoolLink* link = &g_pool[link_id];
+	ASSERT(link->state == POOL_BUSY);
+	if (keep && g_tcp_connected[link_id] && link->server[0] != 0)
+	{
+		link->state = POOL_IDLE;
+		link->release_time = RLM3_GetCurrentTime();
+	}
+	else
+	{
+		RLM3_WIFI_ServerDisconnect(link_id);
+		link->state = POOL_FREE;
+	}
+
+	EndCommand();
+}
+
+extern void RLM3_WIFI_ServerDisconnect(size_t link_id)
+{
+	if (link_id >= RLM3_WIFI_LINK_COUNT)
+		return;
+
+	BeginCommand(RLM3_WIFI_OPERATION_SERVER_DISCONNECT);
+
+	if (g_tcp_connected[link_id])
+	{
+		char link_id_str[2] = { 0 };
+		link_id_str[0] = '0' + link_id;
+
+		bool result = true;
+		if (result)
+			Send("tcp_disconnect_a", "AT+CIPCLOSE=", link_id_str, NULL);
+		if (result)
+			result = WaitForResponse("tcp_disconnect_b", 1000, FLAG(COMMAND_OK), FLAG(COMMAND_ERROR) | FLAG(COMMAND_FAIL));
+		if (result)
+			result = WaitForResponse("tcp_disconnect_c", 1000, FLAG(COMMAND_CLOSED_BEGIN + link_id), 0);
+	}
+
+	EndCommand();
+}
+
+extern bool RLM3_WIFI_IsServerConnected(size_t link_id)
+{
+	if (link_id >= RLM3_WIFI_LINK_COUNT)
+		return false;
+
+	return g_tcp_connected[link_id];
+}
+
+extern bool RLM3_WIFI_LocalNetworkEnable(const char* ssid, const char* password, size_t max_clients, const char* ip_address, const char* service)
+{
+	if (max_clients > RLM3_WIFI_LINK_COUNT)
+		max_clients = RLM3_WIFI_LINK_COUNT;
+	char max_clients_str[2];
+	RLM3_Format(max_clients_str, sizeof(max_clients_str), "%u", (unsigned int)max_clients);
+
+	BeginCommand(RLM3_WIFI_OPERATION_LOCAL_NETWORK);
+
+	bool result = true;
+
+	if (result)
+		result = SendCommandStandard("wifi_mode", 1000, "AT+CWMODE_CUR=3", NULL);
+	if (result)
+		result = SendCommandStandard("ap_ip", 1000, "AT+CIPAP_CUR=\"", ip_address, "\"", NULL);
+	if (result)
+		result = SendCommandStandard("ap_set", 1000, "AT+CWSAP_CUR=\"", ssid, "\",\"", password, "\",1,3,", max_clients_str, ",0", NULL); // Channel 1, Encryption using WPA2_PSK, SSID broadcast
+	if (result)
+		result = SendCommandStandard("server", 1000, "AT+CIPSERVER=1,", service, NULL);
+
+	g_is_local_network_enabled = result;
+
+	EndCommand();
+
+	return result;
+}
+
+extern void RLM3_WIFI_LocalNetworkDisable()
+{
+	BeginCommand(RLM3_WIFI_OPERATION_LOCAL_NETWORK);
+
+	bool result = true;
+
+	if (result)
+		result = SendCommandStandard("server", 1000, "AT+CIPSERVER=0", NULL);
+	if (result)
+		result = SendCommandStandard("wifi_mode", 1000, "AT+CWMODE_CUR=1", NULL);
+
+	g_is_local_network_enabled = false;
+
+	EndCommand();
+}
+
+extern bool RLM3_WIFI_IsLocalNetworkEnabled()
+{
+	return g_is_local_network_enabled;
+}
+
+static bool ExitPassthrough()
+{
+	size_t link_id = g_passthrough_link;
+
+	BeginCommand(RLM3_WIFI_OPERATION_PASSTHROUGH);
+
+	// The module only takes "+++" as the escape when it arrives as a packet of its own, and needs a while before it listens to commands again.
+	if (g_is_passthrough)
+	{
+		RLM3_Delay(PASSTHROUGH_ESCAPE_GUARD_TIME);
+		SendRaw("passthrough_escape", (const uint8_t*)"+++", 3);
+		RLM3_Delay(PASSTHROUGH_EXIT_TIME);
+		g_is_passthrough = false;
+		g_state = STATE_INITIAL;
+		NotifyReceiveBlock(link_id);
+	}
+
+	bool result = true;
+	if (result)
+		result = SendCommandStandard("passthrough_exit_mode", 1000, "AT+CIPMODE=0", NULL);
+	if (result && g_tcp_connected[link_id])
+		result = SendCommandStandard("passthrough_close", 1000, "AT+CIPCLOSE", NULL);
+	if (result)
+		result = SendCommandStandard("passthrough_multiple_connections", 1000, "AT+CIPMUX=1", NULL);
+
+	// Whatever the module says, the link cannot be used from here on.
+	NotifyDisconnectFromServer(link_id);
+	g_passthrough_link = RLM3_WIFI_LINK_COUNT;
+
+	EndCommand();
+
+	return result;
+}
+
+extern bool RLM3_WIFI_PassthroughBegin(size_t link_id, const char* server, const char* service)
+{
+	if (link_id >= RLM3_WIFI_LINK_COUNT)
+		return false;
+	ASSERT(RLM3_WIFI_IsInit());
+
+	BeginCommand(RLM3_WIFI_OPERATION_PASSTHROUGH);
+
+	// Passthrough only works with a single connection, so nothing else can be open.
+	bool result = (g_passthrough_link == RLM3_WIFI_LINK_COUNT) && !g_is_local_network_enabled;
+	for (size_t i = 0; i < RLM3_WIFI_LINK_COUNT; i++)
+		if (g_tcp_connected[i])
+			result = false;
+	if (!result)
+	{
+		EndCommand();
+		return false;
+	}
+
+	g_passthrough_link = link_id;
+	g_is_tcp_outgoing[link_id] = true;
+	uint32_t fail_flags = FLAG(COMMAND_ERROR) | FLAG(COMMAND_FAIL);
+
+	if (result)
+		result = SendCommandStandard("passthrough_single_connection", 1000, "AT+CIPMUX=0", NULL);
+	if (result)
+		result = SendCommandStandard("passthrough_mode", 1000, "AT+CIPMODE=1", NULL);
+	if (result)
+	{
+		g_command_flags = 0;
+		Send("passthrough_connect_a", "AT+CIPSTART=\"TCP\",\"", server, "\",", service, NULL);
+	}
+	if (result)
+		result = WaitForResponse("passthrough_connect_b", 30000, FLAG(COMMAND_OK), fail_flags);
+	if (result)
+		result = WaitForResponse("passthrough_connect_c", 30000, FLAG(COMMAND_CONNECT_BEGIN + link_id), FLAG(COMMAND_CONNECTION_TIMEOUT) | FLAG(COMMAND_CONNECTION_FAILED) | FLAG(COMMAND_DNS_FAIL) | LinkFailFlags(link_id));
+	if (result)
+	{
+		g_command_flags = 0;
+		Send("passthrough_send_a", "AT+CIPSEND", NULL);
+	}
+	if (result)
+		result = WaitForResponse("passthrough_send_b", 1000, FLAG(COMMAND_OK), fail_flags | LinkFailFlags(link_id));
+	if (result)
+		result = WaitForResponse("passthrough_send_c", 1000, FLAG(COMMAND_GO_AHEAD), fail_flags | LinkFailFlags(link_id));
+
+	// Put the module back the way the rest of the driver expects it.
+	if (!result)
+		ExitPassthrough();
+
+	EndCommand();
+
+	return result;
+}
+
+extern bool RLM3_WIFI_PassthroughEnd()
+{
+	if (g_passthrough_link == RLM3_WIFI_LINK_COUNT)
+		return false;
+
+	return ExitPassthrough();
+}
+
+extern bool RLM3_WIFI_IsPassthrough()
+{
+	return g_is_passthrough;
+}
+
+static bool TransmitSegment(size_t link_id, const uint8_t* data_a, size_t size_a, const uint8_t* data_b, size_t size_b, const char* server, const char* service, RLM3_Time start_time, uint32_t timeout)
+{
+	size_t size = size_a + size_b;
+	char size_str[5];
+	RLM3_Format(size_str, sizeof(size_str), "%u", (unsigned int)size);
+	char link_id_str[2] = { 0 };
+	link_id_str[0] = '0' + link_id;
+	uint32_t fail_flags = FLAG(COMMAND_ERROR) | FLAG(COMMAND_FAIL) | LinkFailFlags(link_id);
+
+	BeginCommand(RLM3_WIFI_OPERATION_TRANSMIT);
+	if (server != NULL)
+		Send("transmit_a", "AT+CIPSEND=", link_id_str, ",", size_str, ",\"", server, "\",", service, NULL);
+	else
+		Send("transmit_a", "AT+CIPSEND=", link_id_str, ",", size_str, NULL);
+
+	bool result = true;
+	if (result)
+		result = WaitForResponse("transmit_b", TimeRemaining(start_time, timeout), FLAG(COMMAND_OK), fail_flags);
+	if (result)
+		result = WaitForResponse("transmit_c", TimeRemaining(start_time, timeout), FLAG(COMMAND_GO_AHEAD), fail_flags);
+	if (result && size_a > 0)
+		SendRaw("transmit_write", data_a, size_a);
+	if (result && size_b > 0)
+		SendRaw("transmit_write", data_b, size_b);
+	if (result)
+		result = WaitForResponse("transmit_d", TimeRemaining(start_time, timeout), FLAG(COMMAND_BYTES_RECEIVED), fail_flags);
+	if (result)
+		result = WaitForResponse("transmit_e", TimeRemaining(start_time, timeout), FLAG(COMMAND_SEND_OK), fail_flags | FLAG(COMMAND_SEND_FAIL));
+	if (result)
+	{
+		CountStat(&g_stats.links[link_id].bytes_sent, size);
+		CountStat(&g_stats.links[link_id].segments_sent, 1);
+	}
+	EndCommand();
+
+	return result;
+}
+
+static bool TransmitSegmentBuffered(size_t link_id, const uint8_t* data_a, size_t size_a, const uint8_t* data_b, size_t size_b, RLM3_Time start_time, uint32_t timeout)
+{
+	size_t size = size_a + size_b;
+	char size_str[5];
+	RLM3_Format(size_str, sizeof(size_str), "%u", (unsigned int)size);
+	char link_id_str[2] = { 0 };
+	link_id_str[0] = '0' + link_id;
+	uint32_t fail_flags = FLAG(COMMAND_ERROR) | FLAG(COMMAND_FAIL) | LinkFailFlags(link_id);
+
+	BeginCommand(RLM3_WIFI_OPERATION_TRANSMIT);
+	g_segment_buffered_link = link_id;
+
+	bool result = false;
+	while (!result)
+	{
+		g_command_flags = 0;
+		if (!g_tcp_connected[link_id])
+			break;
+		Send("transmit_buffered_a", "AT+CIPSENDBUF=", link_id_str, ",", size_str, NULL);
+		result = WaitForResponse("transmit_buffered_b", TimeRemaining(start_time, timeout), FLAG(COMMAND_OK), fail_flags | FLAG(COMMAND_BUSY) | FLAG(COMMAND_SEND_FAIL));
+		if (result)
+			break;
+
+		// The module rejects new segments while its send buffer is full.  Wait for one to drain and try again.
+		uint32_t segment_count = SegmentsOutstanding(link_id);
+		bool is_full = (g_command_flags & FLAG(COMMAND_BUSY)) != 0 || ((g_command_flags & FLAG(COMMAND_ERROR)) != 0 && segment_count > 0);
+		if (!is_full || (g_command_flags & (FLAG(COMMAND_SEND_FAIL) | LinkFailFlags(link_id))) != 0)
+			break;
+		while (SegmentsOutstanding(link_id) >= segment_count && (g_command_flags & LinkFailFlags(link_id)) == 0 && RLM3_TakeUntil(start_time, timeout))
+			;
+		if (SegmentsOutstanding(link_id) >= segment_count)
+		{
+			CountStat(&g_stats.timeout_count[g_operation], 1);
+			LOG_WARN("Fail transmit_buffered_c %x", (int)g_command_flags);
+			break;
+		}
+	}
+
+	if (result)
+		result = WaitForResponse("transmit_buffered_d", TimeRemaining(start_time, timeout), FLAG(COMMAND_GO_AHEAD), fail_flags);
+	if (result && size_a > 0)
+		SendRaw("transmit_buffered_write", data_a, size_a);
+	if (result && size_b > 0)
+		SendRaw("transmit_buffered_write", data_b, size_b);
+	if (result)
+		result = WaitForResponse("transmit_buffered_e", TimeRemaining(start_time, timeout), FLAG(COMMAND_BYTES_RECEIVED), fail_flags);
+	if (result)
+	{
+		CountStat(&g_stats.links[link_id].bytes_sent, size);
+		CountStat(&g_stats.links[link_id].segments_sent, 1);
+	}
+	g_segment_buffered_link = RLM3_WIFI_LINK_COUNT;
+	EndCommand();
+
+	return result;
+}
+
+static bool TransmitPassthrough(size_t link_id, const uint8_t* data_a, size_t size_a, const uint8_t* data_b, size_t size_b)
+{
+	BeginCommand(RLM3_WIFI_OPERATION_TRANSMIT);
+
+	// No handshake.  The module forwards whatever it gets, so the data is done once it is on the wire.
+	bool result = g_is_passthrough && link_id == g_passthrough_link;
+	if (result)
+	{
+		SendRaw("passthrough_write", data_a, size_a);
+		SendRaw("passthrough_write", data_b, size_b);
+		CountStat(&g_stats.links[link_id].bytes_sent, size_a + size_b);
+	}
+	EndCommand();
+
+	return result;
+}
+
+static bool TransmitData(size_t link_id, const uint8_t* data_a, size_t size_a, const uint8_t* data_b, size_t size_b, uint32_t timeout, bool is_timeout_per_segment)
+{
+	if (link_id >= RLM3_WIFI_LINK_COUNT)
+		return false;
+	if (size_a + size_b == 0)
+		return false;
+	if (g_is_passthrough)
+		return TransmitPassthrough(link_id, data_a, size_a, data_b, size_b);
+
+	RLM3_Time start_time = RLM3_GetCurrentTime();
+
+	// Send the data in the largest segments the module accepts so the handshake is paid as few times as possible.
+	BeginCommand(RLM3_WIFI_OPERATION_TRANSMIT);
+	bool result = true;
+	while (result && size_a + size_b > 0)
+	{
+		// Each segment starts with fresh flags, so a link that closed after the last one only shows up here.
+		result = g_tcp_connected[link_id];
+		if (!result)
+			break;
+		size_t segment_a = (size_a < MAX_TRANSMIT_SEGMENT_SIZE) ? size_a : MAX_TRANSMIT_SEGMENT_SIZE;
+		size_t segment_b = (size_b < MAX_TRANSMIT_SEGMENT_SIZE - segment_a) ? size_b : MAX_TRANSMIT_SEGMENT_SIZE - segment_a;
+		if (is_timeout_per_segment)
+			start_time = RLM3_GetCurrentTime();
+		// The module only buffers TCP.  On a UDP link each segment is a datagram.
+		if (g_is_transmit_buffered && !g_is_udp[link_id])
+			result = TransmitSegmentBuffered(link_id, data_a, segment_a, data_b, segment_b, start_time, timeout);
+		else
+			result = TransmitSegment(link_id, data_a, segment_a, data_b, segment_b, NULL, NULL, start_time, timeout);
+		data_a += segment_a;
+		size_a -= segment_a;
+		data_b += segment_b;
+		size_b -= segment_b;
+	}
+	EndCommand();
+
+	return result;
+}
+
+extern bool RLM3_WIFI_Transmit2(size_t link_id, const uint8_t* data_a, size_t size_a, const uint8_t* data_b, size_t size_b)
+{
+	return TransmitData(link_id, data_a, size_a, data_b, size_b, DEFAULT_TRANSMIT_TIMEOUT, true);
+}
+
+extern bool RLM3_WIFI_Transmit2Timeout(size_t link_id, const uint8_t* data_a, size_t size_a, const uint8_t* data_b, size_t size_b, uint32_t timeout)
+{
+	return TransmitData(link_id, data_a, size_a, data_b, size_b, timeout, false);
+}
+
+extern bool RLM3_WIFI_Transmit(size_t link_id, const uint8_t* data, size_t size)
+{
+	return RLM3_WIFI_Transmit2(link_id, data, size, NULL, 0);
+}
+
+extern bool RLM3_WIFI_TransmitTimeout(size_t link_id, const uint8_t* data, size_t size, uint32_t timeout)
+{
+	return RLM3_WIFI_Transmit2Timeout(link_id, data, size, NULL, 0, timeout);
+}
+
+extern bool RLM3_WIFI_TransmitDatagram(size_t link_id, const uint8_t* data, size_t size, const char* server, const char* service)
+{
+	if (link_id >= RLM3_WIFI_LINK_COUNT)
+		return false;
+	if (size == 0 || size > MAX_TRANSMIT_SEGMENT_SIZE)
+		return false;
+
+	BeginCommand(RLM3_WIFI_OPERATION_TRANSMIT);
+	bool result = g_tcp_connected[link_id] && g_is_udp[link_id];
+	if (result)
+		result = TransmitSegment(link_id, data, size, NULL, 0, server, service, RLM3_GetCurrentTime(), DEFAULT_TRANSMIT_TIMEOUT);
+	EndCommand();
+
+	return result;
+}
+
+extern bool RLM3_WIFI_TransmitAsync(size_t link_id, const uint8_t* data, size_t size, RLM3_WIFI_TransmitComplete on_complete, void* context)
 {
 	if (link_id >= RLM3_WIFI_LINK_COUNT)
 		return false;
+	if (size == 0)
+		return false;
+	if (g_is_passthrough)
+		return false;
 
-	RLM3_WIFI_ServerDisconnect(link_id);
+	// A stalled transmit would otherwise hold its slot forever.
+	CheckTransmitAsync();
 
-	BeginCommand();
+	// Claim a free slot in the queue.
+	TransmitAsync* transmit = NULL;
+	for (size_t i = 0; i < RLM3_WIFI_TRANSMIT_ASYNC_QUEUE_SIZE && transmit == NULL; i++)
+	{
+		uint32_t expected = TRANSMIT_ASYNC_FREE;
+		if (__atomic_compare_exchange_n(&g_transmit_async[i].state, &expected, TRANSMIT_ASYNC_CLAIMED, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			transmit = &g_transmit_async[i];
+	}
+	if (transmit == NULL)
+		return false;
 
-	char link_id_str[2] = { 0 };
-	link_id_str[0] = '0' + link_id;
+	transmit->link_id = link_id;
+	transmit->data = data;
+	transmit->size = size;
+	transmit->offset = 0;
+	transmit->on_complete = on_complete;
+	transmit->context = context;
+	transmit->sequence = __atomic_fetch_add(&g_transmit_async_sequence, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&transmit->state, TRANSMIT_ASYNC_QUEUED, __ATOMIC_RELEASE);
+	CountStat(&g_stats.operation_count[RLM3_WIFI_OPERATION_TRANSMIT_ASYNC], 1);
+
+	RunTransmitAsync();
+	return true;
+}
 
-	g_is_tcp_outgoing[link_id] = true;
+extern void RLM3_WIFI_CheckTransmitAsync()
+{
+	CheckTransmitAsync();
+}
 
-	bool result = true;
-	if (result)
-		Send("tcp_connect_a", "AT+CIPSTART=", link_id_str ,",\"TCP\",\"", server, "\",", service, NULL);
-	if (result)
-		result = WaitForResponse("tcp_connect_b", 30000, FLAG(COMMAND_OK), FLAG(COMMAND_ERROR) | FLAG(COMMAND_FAIL));
-	if (result)
-		result = WaitForResponse("tcp_connect_c", 30000, FLAG(COMMAND_CONNECT_BEGIN + link_id), FLAG(COMMAND_CONNECTION_TIMEOUT) | FLAG(COMMAND_CONNECTION_WRONG_PASSWORD) | FLAG(COMMAND_CONNECTION_MISSING_AP) | FLAG(COMMAND_CONNECTION_FAILED) | FLAG(COMMAND_WIFI_DISCONNECT) | FLAG(COMMAND_CLOSED_BEGIN + link_id) | FLAG(COMMAND_DNS_FAIL));
+extern void RLM3_WIFI_SetTransmitBuffered(bool enable)
+{
+	g_is_transmit_buffered = enable;
+}
+
+extern bool RLM3_WIFI_SetReceivePassive(bool enable)
+{
+	ASSERT(RLM3_WIFI_IsInit());
 
+	BeginCommand(RLM3_WIFI_OPERATION_RECEIVE);
+	bool result = SendCommandStandard("receive_mode", 1000, "AT+CIPRECVMODE=", enable ? "1" : "0", NULL);
 	EndCommand();
 
 	return result;
 }
 
-extern void RLM3_WIFI_ServerDisconnect(size_t link_id)
+static void ReceivePassive(size_t link_id)
 {
-	if (link_id >= RLM3_WIFI_LINK_COUNT)
-		return;
-
-	BeginCommand();
-
-	if (g_tcp_connected[link_id])
+	BeginCommand(RLM3_WIFI_OPERATION_RECEIVE);
+
+	// Ask for no more than fits, so the rest stays with the module and holds back the sender.
+	uint32_t pending = g_receive_pending[link_id];
+	size_t size = RLM3_WIFI_RECEIVE_BUFFER_SIZE - (g_receive_head[link_id] - ReceiveTail(link_id));
+	if (size > pending)
+		size = pending;
+	if (size > MAX_RECEIVE_PASSIVE_SIZE)
+		size = MAX_RECEIVE_PASSIVE_SIZE;
+	if (size > 0)
 	{
 		char link_id_str[2] = { 0 };
 		link_id_str[0] = '0' + link_id;
-
-		bool result = true;
-		if (result)
-			Send("tcp_disconnect_a", "AT+CIPCLOSE=", link_id_str, NULL);
-		if (result)
-			result = WaitForResponse("tcp_disconnect_b", 1000, FLAG(COMMAND_OK), FLAG(COMMAND_ERROR) | FLAG(COMMAND_FAIL));
-		if (result)
-			result = WaitForResponse("tcp_disconnect_c", 1000, FLAG(COMMAND_CLOSED_BEGIN + link_id), 0);
+		char size_str[5];
+		RLM3_Format(size_str, sizeof(size_str), "%u", (unsigned int)size);
+
+		g_receive_passive_link = link_id;
+		g_receive_passive_length = 0;
+		bool result = SendCommandStandard("receive_passive", 1000, "AT+CIPRECVDATA=", link_id_str, ",", size_str, NULL);
+		g_receive_passive_link = RLM3_WIFI_LINK_COUNT;
+
+		// Getting less than asked for means the module had less than it said.  Either way it has nothing left to give.
+		uint32_t received = g_receive_passive_length;
+		if (!result || received < size)
+			g_receive_pending[link_id] = 0;
+		else
+			__atomic_fetch_sub(&g_receive_pending[link_id], received, __ATOMIC_RELAXED);
 	}
 
 	EndCommand();
 }
 
-extern bool RLM3_WIFI_IsServerConnected(size_t link_id)
+extern size_t RLM3_WIFI_Read(size_t link_id, uint8_t* buffer, size_t size, RLM3_Time timeout)
 {
 	if (link_id >= RLM3_WIFI_LINK_COUNT)
-		return false;
+		return 0;
 
-	return g_tcp_connected[link_id];
-}
+	RLM3_Time start_time = RLM3_GetCurrentTime();
 
-extern bool RLM3_WIFI_LocalNetworkEnable(const char* ssid, const char* password, size_t max_clients, const char* ip_address, const char* service)
-{
-	if (max_clients > RLM3_WIFI_LINK_COUNT)
-		max_clients = RLM3_WIFI_LINK_COUNT;
-	char max_clients_str[2];
-	RLM3_Format(max_clients_str, sizeof(max_clients_str), "%u", (unsigned int)max_clients);
+	// Wait until some data arrives or the module has some waiting, the link closes, or we time out.
+	g_receive_thread[link_id] = RLM3_GetCurrentTask();
+	while (g_receive_head[link_id] == ReceiveTail(link_id) && g_receive_pending[link_id] == 0 && g_tcp_connected[link_id] && RLM3_TakeUntil(start_time, timeout))
+		;
+	g_receive_thread[link_id] = NULL;
 
-	bool result = true;
+	// Often the reply to something sent asynchronously, so a good time to notice that the send stalled.
+	CheckTransmitAsync();
 
-	if (result)
-		result = SendCommandStandard("wifi_mode", 1000, "AT+CWMODE_CUR=3", NULL);
-	if (result)
-		result = SendCommandStandard("ap_ip", 1000, "AT+CIPAP_CUR=\"", ip_address, "\"", NULL);
-	if (result)
-		result = SendCommandStandard("ap_set", 1000, "AT+CWSAP_CUR=\"", ssid, "\",\"", password, "\",1,3,", max_clients_str, ",0", NULL); // Channel 1, Encryption using WPA2_PSK, SSID broadcast
-	if (result)
-		result = SendCommandStandard("server", 1000, "AT+CIPSERVER=1,", service, NULL);
+	if (g_receive_head[link_id] == ReceiveTail(link_id) && g_receive_pending[link_id] > 0)
+		ReceivePassive(link_id);
 
-	g_is_local_network_enabled = result;
+	uint32_t tail = ReceiveTail(link_id);
+	size_t available = g_receive_head[link_id] - tail;
+	if (size > available)
+		size = available;
+	for (size_t i = 0; i < size; i++)
+		buffer[i] = g_receive_buffer[link_id][(tail + i) % RLM3_WIFI_RECEIVE_BUFFER_SIZE];
+	g_receive_tail[link_id] = tail + size;
 
-	return result;
+	return size;
 }
 
-extern void RLM3_WIFI_LocalNetworkDisable()
+extern size_t RLM3_WIFI_Available(size_t link_id)
 {
-	bool result = true;
-
-	if (result)
-		result = SendCommandStandard("server", 1000, "AT+CIPSERVER=0", NULL);
-	if (result)
-		result = SendCommandStandard("wifi_mode", 1000, "AT+CWMODE_CUR=1", NULL);
+	if (link_id >= RLM3_WIFI_LINK_COUNT)
+		return 0;
 
-	g_is_local_network_enabled = false;
+	return g_receive_head[link_id] - ReceiveTail(link_id) + g_receive_pending[link_id];
 }
 
-extern bool RLM3_WIFI_IsLocalNetworkEnabled()
+static bool NarrowPatterns(uint8_t x)
 {
-	return g_is_local_network_enabled;
+	// Ranges past the first character are short, so a linear scan beats a binary search.
+	size_t position = g_pattern_text - g_patterns[g_pattern_begin].text;
+	size_t begin = g_pattern_begin;
+	while (begin < g_pattern_end && (uint8_t)g_patterns[begin].text[position] < x)
+		begin++;
+	size_t end = begin;
+	while (end < g_pattern_end && (uint8_t)g_patterns[end].text[position] == x)
+		end++;
+	if (begin == end)
+		return false;
+	g_pattern_begin = begin;
+	g_pattern_end = end;
+	g_pattern_text = g_patterns[begin].text + position;
+	return true;
 }
 
-extern bool RLM3_WIFI_Transmit2(size_t link_id, const uint8_t* data_a, size_t size_a, const uint8_t* data_b, size_t size_b)
+static State ParseVersion(State state, volatile uint32_t* version, uint8_t x)
 {
-	if (link_id >= RLM3_WIFI_LINK_COUNT)
-		return false;
-
-	// We only support small blocks for now.
-	size_t size = size_a + size_b;
-	if (0 >= size || size > 1024)
-		return false;
-	char size_str[5];
-	RLM3_Format(size_str, sizeof(size_str), "%u", (unsigned int)size);
-	char link_id_str[2] = { 0 };
-	link_id_str[0] = '0' + link_id;
-
-	BeginCommand();
-	Send("transmit_a", "AT+CIPSEND=", link_id_str, ",", size_str, NULL);
-
-	bool result = true;
-	if (result)
-		result = WaitForResponse("transmit_b", 10000, FLAG(COMMAND_OK), FLAG(COMMAND_ERROR) | FLAG(COMMAND_FAIL));
-	if (result)
-		result = WaitForResponse("transmit_c", 10000, FLAG(COMMAND_GO_AHEAD), FLAG(COMMAND_ERROR) | FLAG(COMMAND_FAIL));
-	if (result && size_a > 0)
-		SendRaw(data_a, size_a);
-	if (result && size_b > 0)
-		SendRaw(data_b, size_b);
-	if (result)
-		result = WaitForResponse("transmit_d", 10000, FLAG(COMMAND_BYTES_RECEIVED), FLAG(COMMAND_ERROR) | FLAG(COMMAND_FAIL));
-	if (result)
-		result = WaitForResponse("transmit_e", 10000, FLAG(COMMAND_SEND_OK), FLAG(COMMAND_ERROR) | FLAG(COMMAND_FAIL) | FLAG(COMMAND_SEND_FAIL));
-	EndCommand();
-
-	return result;
+	State next = STATE_INVALID;
+	if (x >= '0' && x <= '9') { next = state; g_number = 10 * g_number + x - '0'; }
+	if (x == 'v') { next = state; }
+	if (x == '.') { next = state; }
+	if (x == '(' || x == '-' || x == '\r') { next = STATE_END; }
+	if (x == '.' || x == '(' || x == '-' || x == '\r') { *version = (*version << 8) | g_number; g_number = 0; }
+	return next;
 }
 
-extern bool RLM3_WIFI_Transmit(size_t link_id, const uint8_t* data, size_t size)
+static State ParseLinkStatus(uint8_t x)
 {
-	return RLM3_WIFI_Transmit2(link_id, data, size, NULL, 0);
+	// Skip over the address and ports to the last field, which is 0 when the module opened the link and 1 when its server accepted it.
+	if (x >= '0' && x <= '9') { g_link_status_field = 10 * g_link_status_field + x - '0'; return STATE_LINK_STATUS; }
+	if (x == ',') { g_link_status_field = 0; return STATE_LINK_STATUS; }
+	if (x != '\r') { return STATE_LINK_STATUS; }
+
+	size_t link_id = g_link_status_link;
+	if (link_id < RLM3_WIFI_LINK_COUNT)
+	{
+		g_is_tcp_outgoing[link_id] = (g_link_status_field == 0);
+		g_is_udp[link_id] = g_is_link_status_udp;
+		g_tcp_connected[link_id] = true;
+	}
+	return STATE_END;
 }
 
-extern void RLM3_UART4_ReceiveCallback(uint8_t x)
+static State HandleResponse(Response response)
 {
-	if (IS_LOG_TRACE() && x != '\r')
-		RLM3_DebugOutputFromISR(x);
-
-	// If we are expecting something specific, make sure that's what we get.
-	if (g_expected != NULL)
+	uint32_t number = g_pattern_numbers[0];
+	switch (response)
 	{
-		uint8_t expected = *(g_expected++);
-		if (x != expected)
-		{
-			LOG_ERROR("Expect %x '%c' Actual %x '%c' State %d", expected, expected, x, (x >= 0x20 && x <= 0x7F) ? x : '?', g_state);
-			g_expected = NULL;
-			g_state = STATE_INVALID;
-		}
-		else if (*g_expected == 0)
+	case RESPONSE_IGNORE:
+		break;
+
+	case RESPONSE_IGNORE_NEXT_LINE:
+		return STATE_IGNORE_NEXT_LINE;
+
+	case RESPONSE_GO_AHEAD:
+		// In passthrough everything after the prompt is data for the link.
+		if (g_passthrough_link < RLM3_WIFI_LINK_COUNT && !g_is_passthrough)
 		{
-			g_expected = NULL;
+			g_is_passthrough = true;
+			g_receive_block_length = 0;
+			NotifyCommand(COMMAND_GO_AHEAD);
+			return STATE_PASSTHROUGH;
 		}
-		return;
-	}
+		NotifyCommand(COMMAND_GO_AHEAD);
+		return STATE_INITIAL;
 
-	State next = STATE_INVALID;
-	switch (g_state)
-	{
-	case STATE_INVALID:
-		// Recover once we see a '\n' or a '\r'.
-		if (x == '\r' || x == '\n') { next = STATE_INITIAL; }
+	case RESPONSE_OK:
+		NotifyCommand(COMMAND_OK);
 		break;
 
-	case STATE_END:
-		next = STATE_END;
-		if (x == '\n') { next = STATE_INITIAL; }
+	case RESPONSE_ERROR:
+		NotifyCommand(COMMAND_ERROR);
 		break;
 
-	case STATE_IGNORE_NEXT_LINE:
-		next = STATE_IGNORE_NEXT_LINE;
-		if (x == '\n') { next = STATE_END; }
+	case RESPONSE_FAIL:
+		NotifyCommand(COMMAND_FAIL);
 		break;
 
-	case STATE_READ_DATA:
-		RLM3_WIFI_Receive_Callback(g_number, x);
-		next = STATE_READ_DATA;
-		if (--g_receive_length == 0)
-			next = STATE_INITIAL;
+	case RESPONSE_ALREADY_CONNECTED:
+		NotifyCommand(COMMAND_ALREADY_CONNECTED);
 		break;
 
-	case STATE_INITIAL:
-		if (x == ' ' || x == '\r' || x == '\n' || x == 0xff || x == 0xfe) { next = STATE_INITIAL; }
-		if (x == '+') { next = STATE_X_PLUS; }
-		if (x == '>') { next = STATE_INITIAL; NotifyCommand(COMMAND_GO_AHEAD); }
-		if (x == 'A') { next = STATE_X_A; }
-		if (x == 'B') { next = STATE_END; g_expected = "in version"; }
-		if (x == 'b') { next = STATE_X_busy_SPACE; g_expected = "usy "; }
-		if (x == 'c') { next = STATE_END; g_expected = "ompile time"; }
-		if (x == 'D') { next = STATE_X_DNS_SPACE_Fail; g_expected = "NS Fail"; }
-		if (x == 'E') { next = STATE_X_ERROR; g_expected = "RROR"; }
-		if (x == 'F') { next = STATE_X_FAIL; g_expected = "AIL"; }
-		if (x == 'n') { next = STATE_X_no_SPACE_ip; g_expected = "o ip"; }
-		if (x == 'O') { next = STATE_X_OK; g_expected = "K"; }
-		if (x == 'R') { next = STATE_X_Recv_SPACE_NN; g_expected = "ecv "; }
-		if (x == 'S') { next = STATE_X_S; }
-		if (x == 'W') { next = STATE_X_WIFI_SPACE; g_expected = "IFI "; }
-		if (x >= '0' && x <= '9') { next = STATE_X_NN; g_number = x - '0'; }
-		break;
-
-	case STATE_X_PLUS:
-		if (x == 'I') { next = STATE_X_PLUS_IPD_COMMA_NN; g_expected = "PD,"; g_number = 0; g_receive_length = 0; }
-		if (x == 'C') { next = STATE_X_PLUS_C; }
-		break;
-
-	case STATE_X_A:
-		if (x == 'T') { next = STATE_X_AT; }
-		if (x == 'L') { next = STATE_X_ALREADY_SPACE_CONNECT; g_expected = "READY CONNECT"; }
-		if (x == 'i') { next = STATE_IGNORE_NEXT_LINE; g_expected = "-Thinker"; }
-		break;
-
-	case STATE_X_AT:
-		next = STATE_END;
-		if (x == ' ') { next = STATE_X_AT_SPACE_version_COLON_NN; g_expected = "version:"; g_at_version = 0; g_number = 0; }
+	case RESPONSE_AT_VERSION:
+		g_at_version = 0;
+		g_number = 0;
+		return STATE_AT_VERSION;
+
+	case RESPONSE_SDK_VERSION:
+		g_sdk_version = 0;
+		g_number = 0;
+		return STATE_SDK_VERSION;
+
+	case RESPONSE_BUSY_SENDING:
+		LOG_INFO("Busy Sending");
+		CountStat(&g_stats.busy_count, 1);
+		NotifyCommand(COMMAND_BUSY);
 		break;
 
-	case STATE_X_AT_SPACE_version_COLON_NN:
-		if (x >= '0' && x <= '9') { next = STATE_X_AT_SPACE_version_COLON_NN; g_number = 10 * g_number + x - '0'; }
-		if (x == 'v') { next = STATE_X_AT_SPACE_version_COLON_NN; }
-		if (x == '.') { next = STATE_X_AT_SPACE_version_COLON_NN; }
-		if (x == '(' || x == '-' || x == '\r') { next = STATE_END; }
-		if (x == '.' || x == '(' || x == '-' || x == '\r') { g_at_version = (g_at_version << 8) | g_number; g_number = 0; }
+	case RESPONSE_BUSY_PROCESSING:
+		LOG_INFO("Busy With Command");
+		CountStat(&g_stats.busy_count, 1);
+		NotifyCommand(COMMAND_BUSY);
 		break;
 
-	case STATE_X_ALREADY_SPACE_CONNECT:
-		if (x == '\r') { next = STATE_END; NotifyCommand(COMMAND_ALREADY_CONNECTED); }
+	case RESPONSE_DNS_ADDRESS:
+		g_dns_address = 0;
+		g_number = 0;
+		return STATE_DNS_ADDRESS;
+
+	case RESPONSE_DNS_FAIL:
+		NotifyCommand(COMMAND_DNS_FAIL);
 		break;
 
-	case STATE_X_busy_SPACE:
-		if (x == 's') { next = STATE_X_busy_SPACE_s_DOT_DOT_DOT; g_expected = "..."; }
-		if (x == 'p') { next = STATE_X_busy_SPACE_p_DOT_DOT_DOT; g_expected = "..."; }
+	case RESPONSE_READY:
+		NotifyCommand(COMMAND_READY);
 		break;
 
-	case STATE_X_busy_SPACE_s_DOT_DOT_DOT:
-		LOG_INFO("Busy %d Segments", (int)g_segment_count);
-		if (x == '\r') { next = STATE_END; }
+	case RESPONSE_SINGLE_CONNECT:
+		// Without multiple connections the module leaves out the link id.  Only passthrough uses that mode.
+		NotifyConnectToServer(g_passthrough_link);
 		break;
 
-	case STATE_X_busy_SPACE_p_DOT_DOT_DOT:
-		LOG_INFO("Busy With Command");
-		if (x == '\r') { next = STATE_END; }
+	case RESPONSE_SINGLE_CLOSED:
+		NotifyDisconnectFromServer(g_passthrough_link);
 		break;
 
-	case STATE_X_DNS_SPACE_Fail:
-		if (x == '\r') { next = STATE_END; NotifyCommand(COMMAND_DNS_FAIL); }
+	case RESPONSE_MULTIPLE_CONNECTIONS:
+		g_is_multiple_connections = (number == 1);
 		break;
 
-	case STATE_X_ERROR:
-		if (x == '\r') { next = STATE_END; NotifyCommand(COMMAND_ERROR); }
+	case RESPONSE_STATUS:
+		// 2 has an IP, 3 also has links, and 4 had links that closed.  Anything else is not on a network.
+		g_wifi_connected = (number >= 2 && number <= 4);
+		g_wifi_has_ip = g_wifi_connected;
 		break;
 
-	case STATE_X_FAIL:
-		if (x == '\r') { next = STATE_END; NotifyCommand(COMMAND_FAIL); }
+	case RESPONSE_LINK_STATUS_TCP:
+	case RESPONSE_LINK_STATUS_UDP:
+		// Only asked for during a warm start.  Which side opened the link comes last on the line.
+		g_link_status_link = number;
+		g_is_link_status_udp = (response == RESPONSE_LINK_STATUS_UDP);
+		g_link_status_field = 0;
+		return STATE_LINK_STATUS;
+
+	case RESPONSE_WIFI_MODE:
+		g_wifi_mode = number;
 		break;
 
-	case STATE_X_no_SPACE_ip:
-		if (x == '\r') { next = STATE_END; g_wifi_has_ip = false; NotifyDisconnectFromAllServers(); }
+	case RESPONSE_NO_IP:
+		g_wifi_has_ip = false;
+		NotifyDisconnectFromAllServers();
+		NotifyCommand(COMMAND_NO_IP);
 		break;
 
-	case STATE_X_OK:
-		if (x == '\r') { next = STATE_END; NotifyCommand(COMMAND_OK); }
+	case RESPONSE_SEND_OK:
+		NotifyCommand(COMMAND_SEND_OK);
 		break;
 
-	case STATE_X_Recv_SPACE_NN:
-		if (x >= '0' && x <= '9') { next = STATE_X_Recv_SPACE_NN; }
-		if (x == ' ') { next = STATE_X_Recv_SPACE_NN_SPACE_bytes; g_expected = "bytes"; }
+	case RESPONSE_SEND_FAIL:
+		CountStat(&g_stats.send_fail_count, 1);
+		NotifyCommand(COMMAND_SEND_FAIL);
 		break;
 
-	case STATE_X_Recv_SPACE_NN_SPACE_bytes:
-		if (x == '\r') { next = STATE_END; g_segment_count++; NotifyCommand(COMMAND_BYTES_RECEIVED); }
+	case RESPONSE_BYTES_RECEIVED:
+		NotifySegmentQueued();
+		NotifyCommand(COMMAND_BYTES_RECEIVED);
 		break;
 
-	case STATE_X_S:
-		if (x == 'E') { next = STATE_X_SEND_SPACE; g_expected = "ND "; }
-		if (x == 'D') { next = STATE_X_SDK_SPACE_version_COLON_NN; g_expected = "K version:"; g_sdk_version = 0; g_number = 0; }
-		if (x == 'T') { next = STATE_END; g_expected = "ATUS:"; }
+	case RESPONSE_SEGMENT_SENT:
+		NotifySegmentDone(number);
+		NotifyCommand(COMMAND_SEGMENT_SENT);
 		break;
 
-	case STATE_X_SEND_SPACE:
-		if (x == 'O') { next = STATE_X_SEND_SPACE_OK; g_expected = "K"; }
-		if (x == 'F') { next = STATE_X_SEND_SPACE_FAIL; g_expected = "AIL"; }
+	case RESPONSE_SEGMENT_FAIL:
+		NotifySegmentDone(number);
+		CountStat(&g_stats.send_fail_count, 1);
+		NotifyCommand(COMMAND_SEND_FAIL);
 		break;
 
-	case STATE_X_SEND_SPACE_OK:
-		if (x == '\r') { next = STATE_END; NotifyCommand(COMMAND_SEND_OK); }
+	case RESPONSE_WIFI_CONNECTED:
+		g_wifi_connected = true;
+		CountStat(&g_stats.network_connect_count, 1);
+		NotifyCommand(COMMAND_WIFI_CONNECTED);
 		break;
 
-	case STATE_X_SEND_SPACE_FAIL:
-		if (x == '\r') { next = STATE_END; NotifyCommand(COMMAND_SEND_FAIL); }
+	case RESPONSE_WIFI_DISCONNECT:
+		CountStat(&g_stats.network_disconnect_count, 1);
+		g_wifi_connected = false;
+		g_wifi_has_ip = false;
+		NotifyDisconnectFromAllServers();
+		NotifyCommand(COMMAND_WIFI_DISCONNECT);
 		break;
 
-	case STATE_X_SDK_SPACE_version_COLON_NN:
-		if (x >= '0' && x <= '9') { next = STATE_X_SDK_SPACE_version_COLON_NN; g_number = 10 * g_number + x - '0'; }
-		if (x == 'v') { next = STATE_X_SDK_SPACE_version_COLON_NN; }
-		if (x == '.') { next = STATE_X_SDK_SPACE_version_COLON_NN; }
-		if (x == '(' || x == '-') { next = STATE_END; }
-		if (x == '\r') { next = STATE_END; }
-		if (x == '.' || x == '(' || x == '-' || x == '\r') { g_sdk_version = (g_sdk_version << 8) | g_number; g_number = 0; }
+	case RESPONSE_WIFI_GOT_IP:
+		g_wifi_has_ip = true;
+		NotifyCommand(COMMAND_WIFI_GOT_IP);
 		break;
 
-	case STATE_X_PLUS_IPD_COMMA_NN:
-		if (x >= '0' && x <= '9') { next = STATE_X_PLUS_IPD_COMMA_NN; g_number = 10 * g_number + x - '0'; }
-		if (x == ',') { next = STATE_X_PLUS_IPD_COMMA_NN_COMMA; }
+	case RESPONSE_JOIN_FAILED:
+		if (number == 2) NotifyCommand(COMMAND_CONNECTION_WRONG_PASSWORD);
+		else if (number == 3) NotifyCommand(COMMAND_CONNECTION_MISSING_AP);
+		else if (number == 4) NotifyCommand(COMMAND_CONNECTION_FAILED);
+		else NotifyCommand(COMMAND_CONNECTION_TIMEOUT);
 		break;
 
-	case STATE_X_PLUS_IPD_COMMA_NN_COMMA:
-		if (x >= '0' && x <= '9') { next = STATE_X_PLUS_IPD_COMMA_NN_COMMA; g_receive_length = 10 * g_receive_length + x - '0'; }
-		if (x == ':') { next = STATE_READ_DATA; }
+	case RESPONSE_LINK_CONNECT:
+		NotifyConnectToServer(number);
 		break;
 
-	case STATE_X_PLUS_C:
-		if (x == 'I') { next = STATE_END; }
-		if (x == 'W') { next = STATE_X_PLUS_CWJAP_COLON; g_expected = "JAP:"; }
+	case RESPONSE_LINK_CLOSED:
+		NotifyDisconnectFromServer(number);
 		break;
 
-	case STATE_X_PLUS_CWJAP_COLON:
-		if (x == '1') NotifyCommand(COMMAND_CONNECTION_TIMEOUT);
-		else if (x == '2') NotifyCommand(COMMAND_CONNECTION_WRONG_PASSWORD);
-		else if (x == '3') NotifyCommand(COMMAND_CONNECTION_MISSING_AP);
-		else if (x == '4') NotifyCommand(COMMAND_CONNECTION_FAILED);
-		else NotifyCommand(COMMAND_CONNECTION_TIMEOUT);
+	case RESPONSE_RECEIVE_PENDING:
+		// In passive mode the module only says how much it is holding.  RLM3_WIFI_Read asks for it.
+		if (number < RLM3_WIFI_LINK_COUNT)
+		{
+			__atomic_fetch_add(&g_receive_pending[number], g_pattern_numbers[1], __ATOMIC_RELAXED);
+			CountStat(&g_stats.links[number].segments_received, 1);
+			if (g_receive_thread[number] != NULL)
+				RLM3_GiveFromISR(g_receive_thread[number]);
+		}
+		break;
+
+	case RESPONSE_RECEIVE_PASSIVE_DATA:
+		g_number = g_receive_passive_link;
+		g_receive_length = number;
+		g_receive_passive_length = number;
+		g_receive_block_length = 0;
+		g_is_datagram = false;
+		return (g_receive_length > 0) ? STATE_READ_DATA : STATE_INITIAL;
+
+	case RESPONSE_RECEIVE_DATA:
+		g_number = number;
+		g_receive_length = g_pattern_numbers[1];
+		g_receive_block_length = 0;
+		if (number < RLM3_WIFI_LINK_COUNT)
+			CountStat(&g_stats.links[number].segments_received, 1);
+		// Each segment on a UDP link is one datagram.  Ones too big to hold still go to the receive buffer and the other callbacks.
+		g_is_datagram = (number < RLM3_WIFI_LINK_COUNT && g_is_udp[number] && g_receive_length <= RLM3_WIFI_DATAGRAM_SIZE);
+		g_datagram_length = 0;
+		if (g_receive_length == 0)
+			NotifyReceiveDatagram();
+		return (g_receive_length > 0) ? STATE_READ_DATA : STATE_INITIAL;
+	}
+	return STATE_END;
+}
+
+static State MismatchPattern(uint8_t x)
+{
+	const char* text = g_patterns[g_pattern_begin].text;
+	size_t prefix = sizeof(IGNORE_PREFIX) - 1;
+	if ((size_t)(g_pattern_text - text) < prefix || strncmp(text, IGNORE_PREFIX, prefix) != 0)
+		return STATE_INVALID;
+	return (x == '\n') ? STATE_INITIAL : STATE_END;
+}
+
+static State ParsePattern(uint8_t x)
+{
+	bool is_digit = (x >= '0' && x <= '9');
+
+	// Numbers run until the first character that is not a digit.
+	if (g_pattern_in_number)
+	{
+		if (is_digit)
+		{
+			uint32_t* number = &g_pattern_numbers[g_pattern_number_count - 1];
+			*number = 10 * *number + x - '0';
+			return STATE_MATCH;
+		}
+		g_pattern_in_number = false;
+		g_pattern_text++;
+	}
+
+	if (g_pattern_end - g_pattern_begin == 1)
+	{
+		// Once only one pattern is left this is a plain comparison.
+		uint8_t expected = *g_pattern_text;
+		if (x != expected && expected != '*')
+		{
+			if (expected != '#' || !is_digit)
+				return MismatchPattern(x);
+			g_pattern_in_number = true;
+			g_pattern_numbers[g_pattern_number_count++] = x - '0';
+			return STATE_MATCH;
+		}
+	}
+	else if (is_digit && NarrowPatterns('#'))
+	{
+		g_pattern_in_number = true;
+		g_pattern_numbers[g_pattern_number_count++] = x - '0';
+		return STATE_MATCH;
+	}
+	else if (!NarrowPatterns(x) && !NarrowPatterns('*'))
+		return MismatchPattern(x);
+
+	if (*(++g_pattern_text) != 0)
+		return STATE_MATCH;
+	return HandleResponse(g_patterns[g_pattern_begin].response);
+}
+
+static State BeginPattern(uint8_t x)
+{
+	uint8_t c = (x >= '0' && x <= '9') ? '#' : x;
+	if ((size_t)c + 1 >= sizeof(g_pattern_index))
+		return STATE_INVALID;
+	g_pattern_begin = g_pattern_index[c];
+	g_pattern_end = g_pattern_index[c + 1];
+	if (g_pattern_begin == g_pattern_end)
+		return STATE_INVALID;
+	g_pattern_text = g_patterns[g_pattern_begin].text;
+	g_pattern_in_number = false;
+	g_pattern_number_count = 0;
+	return ParsePattern(x);
+}
+
+static void ParseByte(uint8_t x)
+{
+	if (IS_LOG_TRACE() && x != '\r')
+		RLM3_DebugOutputFromISR(x);
+
+	State next = STATE_INVALID;
+	switch (g_state)
+	{
+	case STATE_INVALID:
+		// Recover once we see a '\n' or a '\r'.
+		if (x == '\r' || x == '\n') { next = STATE_INITIAL; }
+		break;
+
+	case STATE_END:
 		next = STATE_END;
+		if (x == '\n') { next = STATE_INITIAL; }
 		break;
 
-	case STATE_X_WIFI_SPACE:
-		if (x == 'C') { next = STATE_X_WIFI_SPACE_CONNECTED; g_expected = "ONNECTED"; }
-		if (x == 'D') { next = STATE_X_WIFI_SPACE_DISCONNECT; g_expected = "ISCONNECT"; }
-		if (x == 'G') { next = STATE_X_WIFI_SPACE_GOT_SPACE_IP; g_expected = "OT IP"; }
+	case STATE_IGNORE_NEXT_LINE:
+		next = STATE_IGNORE_NEXT_LINE;
+		if (x == '\n') { next = STATE_END; }
 		break;
 
-	case STATE_X_WIFI_SPACE_CONNECTED:
-		if (x == '\r') { next = STATE_END; g_wifi_connected = true; NotifyCommand(COMMAND_WIFI_CONNECTED); }
+	case STATE_READ_DATA:
+		NotifyReceiveData(g_number, x);
+		RLM3_WIFI_Receive_Callback(g_number, x);
+		g_receive_block[g_receive_block_length++] = x;
+		if (g_is_datagram)
+			g_datagram[g_datagram_length++] = x;
+		next = STATE_READ_DATA;
+		if (--g_receive_length == 0)
+			next = STATE_INITIAL;
+		if (next != STATE_READ_DATA || g_receive_block_length == RLM3_WIFI_RECEIVE_BLOCK_SIZE)
+			NotifyReceiveBlock(g_number);
+		if (next != STATE_READ_DATA)
+			NotifyReceiveDatagram();
 		break;
 
-	case STATE_X_WIFI_SPACE_DISCONNECT:
-		if (x == '\r') { next = STATE_END; g_wifi_connected = false; g_wifi_has_ip = false; NotifyDisconnectFromAllServers(); NotifyCommand(COMMAND_WIFI_DISCONNECT); }
+	case STATE_PASSTHROUGH:
+		// With no framing to go by, bytes arriving one at a time are handed on a line or a full block at a time.
+		NotifyReceiveData(g_passthrough_link, x);
+		RLM3_WIFI_Receive_Callback(g_passthrough_link, x);
+		g_receive_block[g_receive_block_length++] = x;
+		if (x == '\n' || g_receive_block_length == RLM3_WIFI_RECEIVE_BLOCK_SIZE)
+			NotifyReceiveBlock(g_passthrough_link);
+		next = STATE_PASSTHROUGH;
 		break;
 
-	case STATE_X_WIFI_SPACE_GOT_SPACE_IP:
-		if (x == '\r') { next = STATE_END; g_wifi_has_ip = true; NotifyCommand(COMMAND_WIFI_GOT_IP); }
+	case STATE_AT_VERSION:
+		next = ParseVersion(STATE_AT_VERSION, &g_at_version, x);
 		break;
 
-	case STATE_X_NN:
-		if (x >= '0' && x <= '9') { next = STATE_X_NN; g_number = 10 * g_number + x - '0'; }
-		if (x == ',') { next = STATE_X_NN_COMMA; }
+	case STATE_SDK_VERSION:
+		next = ParseVersion(STATE_SDK_VERSION, &g_sdk_version, x);
 		break;
 
-	case STATE_X_NN_COMMA:
-		if (x == 'C') { next = STATE_X_NN_COMMA_C; }
-		if (x == 'S') { next = STATE_X_NN_COMMA_SEND_SPACE_OK; g_expected = "END OK"; }
+	case STATE_DNS_ADDRESS:
+		// Dotted numbers, just like the versions.
+		next = ParseVersion(STATE_DNS_ADDRESS, &g_dns_address, x);
 		break;
 
-	case STATE_X_NN_COMMA_C:
-		if (x == 'L') { next = STATE_X_NN_COMMA_CLOSED; g_expected = "OSED"; }
-		if (x == 'O') { next = STATE_X_NN_COMMA_CONNECT; g_expected = "NNECT"; }
+	case STATE_LINK_STATUS:
+		next = ParseLinkStatus(x);
 		break;
 
-	case STATE_X_NN_COMMA_CLOSED:
-		if (x == '\r') { next = STATE_END; NotifyDisconnectFromServer(g_number); }
+	case STATE_INITIAL:
+		if (x == ' ' || x == '\r' || x == '\n' || x == 0xff || x == 0xfe) { next = STATE_INITIAL; break; }
+		next = BeginPattern(x);
 		break;
 
-	case STATE_X_NN_COMMA_CONNECT:
-		if (x == '\r') { next = STATE_END; NotifyConnectToServer(g_number); }
+	case STATE_MATCH:
+		next = ParsePattern(x);
 		break;
 
-	case STATE_X_NN_COMMA_SEND_SPACE_OK:
-		if (x == '\r') { next = STATE_END; g_segment_count--; }
+	case STATE_COUNT:
 		break;
 	}
 
@@ -778,10 +2607,125 @@ extern void RLM3_UART4_ReceiveCallback(uint8_t x)
 		g_invalid_count++;
 #endif
 
+	// Count each line given up on once, not each byte skipped.
+	if (next == STATE_INVALID && g_state != STATE_INVALID)
+		CountStat(&g_stats.resync_count, 1);
 	g_state = next;
 }
 
-extern bool RLM3_UART4_TransmitCallback(uint8_t* data_to_send)
+static void DeliverDataRun(size_t link_id, const uint8_t* data, size_t size)
+{
+	NotifyReceiveDataBlock(link_id, data, size);
+	for (size_t i = 0; i < size; i++)
+		RLM3_WIFI_Receive_Callback(link_id, data[i]);
+
+	// Pass the span straight through, but only after anything already staged so the order is preserved.
+	NotifyReceiveBlock(link_id);
+	if (link_id < RLM3_WIFI_LINK_COUNT)
+		for (size_t i = 0; i < size; i += RLM3_WIFI_RECEIVE_BLOCK_SIZE)
+			RLM3_WIFI_ReceiveBlock_Callback(link_id, data + i, (size - i < RLM3_WIFI_RECEIVE_BLOCK_SIZE) ? size - i : RLM3_WIFI_RECEIVE_BLOCK_SIZE);
+}
+
+static size_t ParseDataRun(const uint8_t* data, size_t size)
+{
+	if (size > g_receive_length)
+		size = g_receive_length;
+
+	DeliverDataRun(g_number, data, size);
+	if (g_is_datagram)
+	{
+		memcpy(&g_datagram[g_datagram_length], data, size);
+		g_datagram_length += size;
+	}
+	g_receive_length -= size;
+	if (g_receive_length == 0)
+	{
+		g_state = STATE_INITIAL;
+		NotifyReceiveDatagram();
+	}
+#ifdef TEST
+	g_last_valid_state = g_state;
+#endif
+	return size;
+}
+
+static size_t ParsePatternRun(const uint8_t* data, size_t size)
+{
+	// With a single pattern left, consume matching literal text up to its last character.  Anything else is left for ParseByte.
+	const char* text = g_pattern_text;
+	size_t count = 0;
+	while (count < size && text[count + 1] != 0 && text[count] != '#' && text[count] != '*' && data[count] == (uint8_t)text[count])
+		count++;
+	g_pattern_text += count;
+	return count;
+}
+
+static void ParseBlock(const uint8_t* data, size_t size)
+{
+	if (g_is_capture_enabled)
+		for (size_t i = 0; i < size; i++)
+			CaptureByte(0, data[i]);
+
+	// Tracing needs to see every byte, so use the slow path.
+	if (IS_LOG_TRACE())
+	{
+		for (size_t i = 0; i < size; i++)
+			ParseByte(data[i]);
+		return;
+	}
+
+	while (size > 0)
+	{
+		size_t count = 0;
+		if (g_state == STATE_MATCH && !g_pattern_in_number && g_pattern_end - g_pattern_begin == 1)
+			count = ParsePatternRun(data, size);
+		else if (g_state == STATE_READ_DATA)
+			count = ParseDataRun(data, size);
+		else if (g_state == STATE_PASSTHROUGH)
+		{
+			DeliverDataRun(g_passthrough_link, data, size);
+			count = size;
+		}
+		if (count == 0)
+		{
+			ParseByte(*data);
+			count = 1;
+		}
+		data += count;
+		size -= count;
+	}
+}
+
+extern void RLM3_WIFI_ParseBytes(const uint8_t* data, size_t size)
+{
+#ifdef RLM3_WIFI_ISR_TIMING
+	uint32_t start_time = GetIsrTime();
+	ParseBlock(data, size);
+	RecordIsrTime(ISR_TIMER_PARSE_BYTES, GetIsrTime() - start_time);
+#else
+	ParseBlock(data, size);
+#endif
+}
+
+extern void RLM3_UART4_ReceiveCallback(uint8_t x)
+{
+#ifdef RLM3_WIFI_ISR_TIMING
+	uint32_t start_time = GetIsrTime();
+	State state = g_state;
+#endif
+
+	if (g_is_capture_enabled)
+		CaptureByte(0, x);
+	ParseByte(x);
+
+#ifdef RLM3_WIFI_ISR_TIMING
+	uint32_t time = GetIsrTime() - start_time;
+	RecordIsrTime(ISR_TIMER_RECEIVE, time);
+	RecordIsrTime(ISR_TIMER_STATE_BEGIN + state, time);
+#endif
+}
+
+static bool TransmitByte(uint8_t* data_to_send)
 {
 	if (g_transmit_data == NULL)
 		return false;
@@ -791,6 +2735,8 @@ extern bool RLM3_UART4_TransmitCallback(uint8_t* data_to_send)
 	*data_to_send = x;
 	(*g_transmit_data)++;
 
+	if (g_is_capture_enabled)
+		CaptureByte(CAPTURE_TRANSMIT, x);
 	if (IS_LOG_TRACE() && x != '\r')
 		RLM3_DebugOutputFromISR(x);
 
@@ -817,13 +2763,30 @@ extern bool RLM3_UART4_TransmitCallback(uint8_t* data_to_send)
 	return true;
 }
 
+extern bool RLM3_UART4_TransmitCallback(uint8_t* data_to_send)
+{
+#ifdef RLM3_WIFI_ISR_TIMING
+	uint32_t start_time = GetIsrTime();
+	bool result = TransmitByte(data_to_send);
+	RecordIsrTime(ISR_TIMER_TRANSMIT, GetIsrTime() - start_time);
+	return result;
+#else
+	return TransmitByte(data_to_send);
+#endif
+}
+
 extern void RLM3_UART4_ErrorCallback(uint32_t status_flags)
 {
 	LOG_WARN("UART Error %x", (int)status_flags);
-	g_state = STATE_INVALID;
-#ifdef TEST
-	g_error_count++;
-#endif
+	// Deliver whatever part of the segment arrived intact before the error.
+	if (g_state == STATE_READ_DATA)
+		NotifyReceiveBlock(g_number);
+	// A datagram with a piece missing is no datagram at all.
+	g_is_datagram = false;
+	// A passthrough stream has no framing to lose, so just carry on with the next byte.
+	if (g_state != STATE_PASSTHROUGH)
+		g_state = STATE_INVALID;
+	CountStat(&g_stats.uart_error_count, 1);
 }
 
 extern __attribute__((weak)) void RLM3_WIFI_Receive_Callback(size_t link_id, uint8_t data)
@@ -831,6 +2794,16 @@ extern __attribute__((weak)) void RLM3_WIFI_Receive_Callback(size_t link_id, uin
 	// DO NOT MODIFIY THIS FUNCTION.  Override it by declaring a non-weak version in your project files.
 }
 
+extern __attribute__((weak)) void RLM3_WIFI_ReceiveBlock_Callback(size_t link_id, const uint8_t* data, size_t size)
+{
+	// DO NOT MODIFIY THIS FUNCTION.  Override it by declaring a non-weak version in your project files.
+}
+
+extern __attribute__((weak)) void RLM3_WIFI_ReceiveDatagram_Callback(size_t link_id, const uint8_t* data, size_t size)
+{
+	// DO NOT MODIFIY THIS FUNCTION.  Override it by declaring a non-weak version in your project files.
+}
+
 extern __attribute__((weak)) void RLM3_WIFI_NetworkConnect_Callback(size_t link_id, bool local_connection)
 {
 	// DO NOT MODIFIY THIS FUNCTION.  Override it by declaring a non-weak version in your project files.
@@ -841,3 +2814,14 @@ extern __attribute__((weak)) void RLM3_WIFI_NetworkDisconnect_Callback(size_t li
 	// DO NOT MODIFIY THIS FUNCTION.  Override it by declaring a non-weak version in your project files.
 }
 
+extern __attribute__((weak)) uint32_t RLM3_WIFI_GetCycleCount()
+{
+	// DO NOT MODIFIY THIS FUNCTION.  Override it by declaring a non-weak version in your project files.
+#ifdef CLOCK_MONOTONIC
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint32_t)((uint64_t)now.tv_sec * 1000000000 + now.tv_nsec);
+#else
+	return 0;
+#endif
+}
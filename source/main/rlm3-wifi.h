@@ -10,30 +10,228 @@ extern "C" {
 
 #define RLM3_WIFI_LINK_COUNT (5)
 
+// Size of the receive buffer kept for each link.  Must be a power of two.
+#ifndef RLM3_WIFI_RECEIVE_BUFFER_SIZE
+#define RLM3_WIFI_RECEIVE_BUFFER_SIZE (1024)
+#endif
+
+// Largest span passed to RLM3_WIFI_ReceiveBlock_Callback.  Longer segments are delivered in several fragments.
+#ifndef RLM3_WIFI_RECEIVE_BLOCK_SIZE
+#define RLM3_WIFI_RECEIVE_BLOCK_SIZE (128)
+#endif
+
+// Largest datagram passed whole to RLM3_WIFI_ReceiveDatagram_Callback.
+#ifndef RLM3_WIFI_DATAGRAM_SIZE
+#define RLM3_WIFI_DATAGRAM_SIZE (1472)
+#endif
+
+// Number of host names the DNS cache holds.
+#ifndef RLM3_WIFI_DNS_CACHE_SIZE
+#define RLM3_WIFI_DNS_CACHE_SIZE (4)
+#endif
+
+// Longest host name the DNS cache holds, including the terminator.
+#ifndef RLM3_WIFI_DNS_NAME_SIZE
+#define RLM3_WIFI_DNS_NAME_SIZE (48)
+#endif
+
+// Milliseconds a cached address is used before it is looked up again.
+#ifndef RLM3_WIFI_DNS_TTL
+#define RLM3_WIFI_DNS_TTL (300000)
+#endif
+
+// Longest server name and service the connection pool keeps idle links for, including the terminator.
+#ifndef RLM3_WIFI_POOL_SERVER_SIZE
+#define RLM3_WIFI_POOL_SERVER_SIZE (48)
+#endif
+#ifndef RLM3_WIFI_POOL_SERVICE_SIZE
+#define RLM3_WIFI_POOL_SERVICE_SIZE (16)
+#endif
+
+// Number of asynchronous transmits that can be waiting at once.
+#ifndef RLM3_WIFI_TRANSMIT_ASYNC_QUEUE_SIZE
+#define RLM3_WIFI_TRANSMIT_ASYNC_QUEUE_SIZE (8)
+#endif
+
+// Number of tasks woken in turn to use the driver.  Any more poll once per tick.
+#ifndef RLM3_WIFI_COMMAND_QUEUE_SIZE
+#define RLM3_WIFI_COMMAND_QUEUE_SIZE (8)
+#endif
+
+// Number of command stages that get a latency histogram.
+#ifndef RLM3_WIFI_LATENCY_STAGE_COUNT
+#define RLM3_WIFI_LATENCY_STAGE_COUNT (48)
+#endif
+
+#define RLM3_WIFI_LATENCY_BUCKET_COUNT (16)
+
+// Size of the ring that UART traffic is captured into.  Must be a power of two.
+#ifndef RLM3_WIFI_CAPTURE_BUFFER_SIZE
+#define RLM3_WIFI_CAPTURE_BUFFER_SIZE (2048)
+#endif
+
+
+typedef struct RLM3_WIFI_ServerConnectRequest
+{
+	size_t link_id;
+	const char* server;
+	const char* service;
+	bool is_connected;
+} RLM3_WIFI_ServerConnectRequest;
+
+// Which peers a UDP link accepts datagrams from.
+typedef enum RLM3_WIFI_UdpMode
+{
+	RLM3_WIFI_UDP_MODE_FIXED = 0,			// Only the peer it was opened with.
+	RLM3_WIFI_UDP_MODE_FIRST_PEER = 1,		// Switches once to whoever sends the first datagram.
+	RLM3_WIFI_UDP_MODE_ANY_PEER = 2,		// Anyone.  Replies go wherever RLM3_WIFI_TransmitDatagram says.
+} RLM3_WIFI_UdpMode;
+
+// Called from interrupt or task context once an asynchronous transmit is sent or fails.
+typedef void (*RLM3_WIFI_TransmitComplete)(void* context, bool success);
+
+typedef enum RLM3_WIFI_Operation
+{
+	RLM3_WIFI_OPERATION_INIT,
+	RLM3_WIFI_OPERATION_GET_VERSION,
+	RLM3_WIFI_OPERATION_SET_BAUD_RATE,
+	RLM3_WIFI_OPERATION_NETWORK_CONNECT,
+	RLM3_WIFI_OPERATION_NETWORK_DISCONNECT,
+	RLM3_WIFI_OPERATION_SERVER_CONNECT,
+	RLM3_WIFI_OPERATION_SERVER_DISCONNECT,
+	RLM3_WIFI_OPERATION_LOCAL_NETWORK,
+	RLM3_WIFI_OPERATION_TRANSMIT,
+	RLM3_WIFI_OPERATION_TRANSMIT_ASYNC,
+	RLM3_WIFI_OPERATION_PASSTHROUGH,
+	RLM3_WIFI_OPERATION_RECEIVE,
+	RLM3_WIFI_OPERATION_COUNT
+} RLM3_WIFI_Operation;
+
+typedef struct RLM3_WIFI_LinkStats
+{
+	uint32_t bytes_sent;
+	uint32_t bytes_received;
+	uint32_t bytes_dropped;				// Received while the link's receive buffer was full.
+	uint32_t segments_sent;
+	uint32_t segments_received;
+	uint32_t connect_count;
+	uint32_t disconnect_count;
+} RLM3_WIFI_LinkStats;
+
+// Milliseconds per command stage.  Bucket i counts times below 2^i that did not fit an earlier bucket.
+typedef struct RLM3_WIFI_LatencyHistogram
+{
+	const char* stage;
+	uint32_t count;
+	uint32_t total_time;
+	uint32_t max_time;
+	uint32_t timeout_count;				// Waits that gave up.  Their time is in the buckets too.
+	uint32_t buckets[RLM3_WIFI_LATENCY_BUCKET_COUNT];
+} RLM3_WIFI_LatencyHistogram;
+
+// Cycles spent in the UART interrupt callbacks when built with RLM3_WIFI_ISR_TIMING.
+typedef struct RLM3_WIFI_IsrTiming
+{
+	const char* name;
+	uint32_t count;
+	uint32_t min_time;
+	uint32_t mean_time;
+	uint32_t max_time;
+} RLM3_WIFI_IsrTiming;
+
+// Counters since RLM3_WIFI_Init.
+typedef struct RLM3_WIFI_Stats
+{
+	RLM3_WIFI_LinkStats links[RLM3_WIFI_LINK_COUNT];
+	uint32_t send_fail_count;
+	uint32_t busy_count;
+	uint32_t resync_count;				// Times the parser gave up on a line it did not understand.
+	uint32_t uart_error_count;
+	uint32_t network_connect_count;
+	uint32_t network_disconnect_count;
+	uint32_t dns_hit_count;				// Connects by a cached address without a lookup.
+	uint32_t dns_stale_count;			// Connects by an expired address because the lookup failed.
+	uint32_t pool_reuse_count;			// Pool acquires handed an idle link that was already connected.
+	uint32_t pool_evict_count;			// Idle links closed to make room for a different server.
+	uint32_t operation_count[RLM3_WIFI_OPERATION_COUNT];
+	uint32_t timeout_count[RLM3_WIFI_OPERATION_COUNT];
+} RLM3_WIFI_Stats;
+
 
 extern bool RLM3_WIFI_Init();
+// Keeps the network and links of a module that stayed up, or falls back to RLM3_WIFI_Init.
+extern bool RLM3_WIFI_InitWarm();
 extern void RLM3_WIFI_Deinit();
 extern bool RLM3_WIFI_IsInit();
 
 extern bool RLM3_WIFI_GetVersion(uint32_t* at_version, uint32_t* sdk_version);
+// Each counter is read atomically, but not the snapshot as a whole.
+extern void RLM3_WIFI_GetStats(RLM3_WIFI_Stats* stats);
+// Call from a task, not an interrupt.  Returns false past the last stage.
+extern bool RLM3_WIFI_GetLatencyHistogram(size_t index, RLM3_WIFI_LatencyHistogram* histogram);
+// Returns false past the last timer, or always without RLM3_WIFI_ISR_TIMING.
+extern bool RLM3_WIFI_GetIsrTiming(size_t index, RLM3_WIFI_IsrTiming* timing);
+// On failure the module is back at 115200, or the driver is deinitialized if it no longer answers.
+extern bool RLM3_WIFI_SetBaudRate(uint32_t baud_rate);
 
 extern bool RLM3_WIFI_NetworkConnect(const char* ssid, const char* password);
 extern void RLM3_WIFI_NetworkDisconnect();
 extern bool RLM3_WIFI_IsNetworkConnected();
 
 extern bool RLM3_WIFI_ServerConnect(size_t link_id, const char* server, const char* service);
+extern size_t RLM3_WIFI_ServerConnectMany(RLM3_WIFI_ServerConnectRequest* requests, size_t count, uint32_t timeout);
 extern void RLM3_WIFI_ServerDisconnect(size_t link_id);
 extern bool RLM3_WIFI_IsServerConnected(size_t link_id);
+// With use_stale, an expired address is still used when the lookup fails.  Disabled by RLM3_WIFI_Init.
+extern void RLM3_WIFI_SetDnsCache(bool enable, bool use_stale);
+// Returns a link connected to server and service, reusing an idle one if possible, or RLM3_WIFI_LINK_COUNT.
+extern size_t RLM3_WIFI_PoolAcquire(const char* server, const char* service);
+// Without keep the link is disconnected instead of kept idle.
+extern void RLM3_WIFI_PoolRelease(size_t link_id, bool keep);
+// local_service may be NULL to let the module pick a port.
+extern bool RLM3_WIFI_UdpConnect(size_t link_id, const char* server, const char* service, const char* local_service, RLM3_WIFI_UdpMode mode);
 
 extern bool RLM3_WIFI_LocalNetworkEnable(const char* ssid, const char* password, size_t max_clients, const char* ip_address, const char* service);
 extern void RLM3_WIFI_LocalNetworkDisable();
 extern bool RLM3_WIFI_IsLocalNetworkEnabled();
 
+// Needs every other link closed.  Until RLM3_WIFI_PassthroughEnd, other commands fail.
+extern bool RLM3_WIFI_PassthroughBegin(size_t link_id, const char* server, const char* service);
+// Takes a little over a second.  On failure the module needs RLM3_WIFI_Init.
+extern bool RLM3_WIFI_PassthroughEnd();
+extern bool RLM3_WIFI_IsPassthrough();
+
+// Records are 0x00 and a 32 bit little endian time, or 0x80 (sent) or 0x00 (received) plus a count of 1 to 127 and that many bytes.
+extern void RLM3_WIFI_SetCapture(bool enable);
+// Copies out as many of the newest records as fit.
+extern size_t RLM3_WIFI_GetCapture(uint8_t* buffer, size_t size);
+
 extern bool RLM3_WIFI_Transmit(size_t link_id, const uint8_t* data, size_t size);
 extern bool RLM3_WIFI_Transmit2(size_t link_id, const uint8_t* data_a, size_t size_a, const uint8_t* data_b, size_t size_b);
+extern bool RLM3_WIFI_TransmitTimeout(size_t link_id, const uint8_t* data, size_t size, uint32_t timeout);
+extern bool RLM3_WIFI_Transmit2Timeout(size_t link_id, const uint8_t* data_a, size_t size_a, const uint8_t* data_b, size_t size_b, uint32_t timeout);
+// server and service may be NULL to send to the link's peer.
+extern bool RLM3_WIFI_TransmitDatagram(size_t link_id, const uint8_t* data, size_t size, const char* server, const char* service);
+// When buffered, transmit returns once the module has queued the data.
+extern void RLM3_WIFI_SetTransmitBuffered(bool enable);
+// The data must stay valid until on_complete is called.
+extern bool RLM3_WIFI_TransmitAsync(size_t link_id, const uint8_t* data, size_t size, RLM3_WIFI_TransmitComplete on_complete, void* context);
+// Call periodically to fail a stalled asynchronous transmit, and restart the queue after one, when nothing else uses the driver.
+extern void RLM3_WIFI_CheckTransmitAsync();
+// In passive mode the module holds received data until RLM3_WIFI_Read asks for it.
+extern bool RLM3_WIFI_SetReceivePassive(bool enable);
+extern size_t RLM3_WIFI_Read(size_t link_id, uint8_t* buffer, size_t size, RLM3_Time timeout);
+// Includes data the module is holding in passive mode.
+extern size_t RLM3_WIFI_Available(size_t link_id);
+// For a DMA or idle line interrupt.  Must never run at the same time as RLM3_UART4_ReceiveCallback.
+extern void RLM3_WIFI_ParseBytes(const uint8_t* data, size_t size);
 extern void RLM3_WIFI_Receive_Callback(size_t link_id, uint8_t data);
+extern void RLM3_WIFI_ReceiveBlock_Callback(size_t link_id, const uint8_t* data, size_t size);
+extern void RLM3_WIFI_ReceiveDatagram_Callback(size_t link_id, const uint8_t* data, size_t size);
 extern void RLM3_WIFI_NetworkConnect_Callback(size_t link_id, bool local_connection);
 extern void RLM3_WIFI_NetworkDisconnect_Callback(size_t link_id, bool local_connection);
+// Clock for RLM3_WIFI_ISR_TIMING on hosts without a DWT cycle counter; defaults to the monotonic clock in nanoseconds.
+extern uint32_t RLM3_WIFI_GetCycleCount();
 
 
 #ifdef __cplusplus
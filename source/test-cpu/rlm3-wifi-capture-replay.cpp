@@ -0,0 +1,40 @@
+#include "rlm3-wifi-capture-replay.hpp"
+#include "rlm3-wifi.h"
+#include "Test.hpp"
+
+
+extern std::vector<CaptureRecord> DecodeCapture(const uint8_t* capture, size_t size)
+{
+	std::vector<CaptureRecord> result;
+	uint32_t time = 0;
+	size_t offset = 0;
+	while (offset < size)
+	{
+		uint8_t header = capture[offset++];
+		if (header == 0x00)
+		{
+			ASSERT(offset + 4 <= size);
+			time = capture[offset] | (capture[offset + 1] << 8) | (capture[offset + 2] << 16) | ((uint32_t)capture[offset + 3] << 24);
+			offset += 4;
+			continue;
+		}
+		size_t count = header & 0x7F;
+		ASSERT(count > 0 && offset + count <= size);
+		result.push_back({ (header & 0x80) != 0, time, std::string((const char*)capture + offset, count) });
+		offset += count;
+	}
+	return result;
+}
+
+extern std::string ReplayCapture(const std::vector<CaptureRecord>& records)
+{
+	std::string transmitted;
+	for (const CaptureRecord& record : records)
+	{
+		if (record.is_transmit)
+			transmitted += record.data;
+		else
+			RLM3_WIFI_ParseBytes((const uint8_t*)record.data.data(), record.data.size());
+	}
+	return transmitted;
+}
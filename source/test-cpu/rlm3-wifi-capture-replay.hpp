@@ -0,0 +1,19 @@
+#pragma once
+
+#include "rlm3-base.h"
+#include <string>
+#include <vector>
+
+
+struct CaptureRecord
+{
+	bool is_transmit;
+	uint32_t time;
+	std::string data;
+};
+
+// Splits a buffer from RLM3_WIFI_GetCapture into records.  Records before the first time record get a time of 0.
+extern std::vector<CaptureRecord> DecodeCapture(const uint8_t* capture, size_t size);
+
+// Feeds everything the module sent back through the parser, as if it had just arrived.  Returns everything that was sent to the module.
+extern std::string ReplayCapture(const std::vector<CaptureRecord>& records);
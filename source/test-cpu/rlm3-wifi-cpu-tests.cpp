@@ -4,7 +4,10 @@
 #include "rlm3-task.h"
 #include "rlm3-uart.h"
 #include "rlm3-sim.hpp"
+#include "rlm3-wifi-capture-replay.hpp"
+#include <algorithm>
 #include <cstring>
+#include <string>
 #include <vector>
 #include "logger.h"
 
@@ -15,6 +18,11 @@ volatile RLM3_Task g_client_thread = nullptr;
 volatile size_t g_recv_buffer_count = 0;
 volatile uint8_t g_recv_buffer_data[32];
 
+std::vector<std::pair<size_t, std::string>> g_recv_block_calls;
+std::vector<std::pair<size_t, std::string>> g_recv_datagram_calls;
+
+volatile uint32_t g_cycle_count = 0;
+
 volatile size_t g_network_callback_count = 0;
 std::vector<std::pair<size_t, bool>> g_network_connect_calls;
 std::vector<std::pair<size_t, bool>> g_network_disconnect_calls;
@@ -29,6 +37,16 @@ extern void RLM3_WIFI_Receive_Callback(size_t link_id, uint8_t data)
 	RLM3_GiveFromISR(g_client_thread);
 }
 
+extern void RLM3_WIFI_ReceiveBlock_Callback(size_t link_id, const uint8_t* data, size_t size)
+{
+	g_recv_block_calls.emplace_back(link_id, std::string((const char*)data, size));
+}
+
+extern void RLM3_WIFI_ReceiveDatagram_Callback(size_t link_id, const uint8_t* data, size_t size)
+{
+	g_recv_datagram_calls.emplace_back(link_id, std::string((const char*)data, size));
+}
+
 extern void RLM3_WIFI_NetworkConnect_Callback(size_t link_id, bool local_connection)
 {
 	g_network_callback_count++;
@@ -43,6 +61,13 @@ extern void RLM3_WIFI_NetworkDisconnect_Callback(size_t link_id, bool local_conn
 	RLM3_GiveFromISR(g_client_thread);
 }
 
+extern uint32_t RLM3_WIFI_GetCycleCount()
+{
+	// Every timed callback reads the clock twice, so each one appears to take 3 cycles.
+	g_cycle_count += 3;
+	return g_cycle_count;
+}
+
 TEST_CASE(RLM3_WIFI_IsInit_Uninitialized)
 {
 	ASSERT(!RLM3_WIFI_IsInit());
@@ -64,6 +89,33 @@ static void ExpectInit()
 	SIM_RLM3_UART4_Receive("OK\r\n");
 }
 
+static void ExpectNetworkConnect()
+{
+	ExpectInit();
+	SIM_RLM3_UART4_Transmit("AT+CWJAP_CUR=\"test-sid\",\"test-pwd\"\r\n");
+	SIM_RLM3_UART4_Receive("WIFI CONNECTED\r\n");
+	SIM_RLM3_UART4_Receive("WIFI GOT IP\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n");
+}
+
+static void ExpectServerConnect(size_t link_id)
+{
+	static const char* const start[] =
+	{
+		"AT+CIPSTART=0,\"TCP\",\"test-server\",test-port\r\n",
+		"AT+CIPSTART=1,\"TCP\",\"test-server\",test-port\r\n",
+		"AT+CIPSTART=2,\"TCP\",\"test-server\",test-port\r\n",
+		"AT+CIPSTART=3,\"TCP\",\"test-server\",test-port\r\n",
+		"AT+CIPSTART=4,\"TCP\",\"test-server\",test-port\r\n",
+	};
+	static const char* const connect[] = { "0,CONNECT\r\n", "1,CONNECT\r\n", "2,CONNECT\r\n", "3,CONNECT\r\n", "4,CONNECT\r\n" };
+	ASSERT(link_id < sizeof(start) / sizeof(start[0]));
+	ExpectNetworkConnect();
+	SIM_RLM3_UART4_Transmit(start[link_id]);
+	SIM_RLM3_UART4_Receive(connect[link_id]);
+	SIM_RLM3_UART4_Receive("OK\r\n");
+}
+
 TEST_CASE(RLM3_WIFI_Init_HappyCase)
 {
 	ExpectInit();
@@ -84,6 +136,17 @@ TEST_CASE(RLM3_WIFI_Init_HappyCase)
 	ASSERT(g_network_callback_count == 0);
 }
 
+TEST_CASE(RLM3_WIFI_Init_Ready)
+{
+	SIM_AddDelay(300);
+	SIM_RLM3_UART4_Receive("\r\nAi-Thinker Technology Co. Ltd.\r\n\r\nready\r\n");
+	ExpectInit();
+
+	RLM3_Time start_time = RLM3_GetCurrentTime();
+	ASSERT(RLM3_WIFI_Init());
+	ASSERT(RLM3_GetCurrentTime() - start_time < 500);
+}
+
 TEST_CASE(RLM3_WIFI_Init_PingTimeout)
 {
 	SIM_RLM3_UART4_Transmit("AT\r\n");
@@ -178,6 +241,104 @@ TEST_CASE(RLM3_WIFI_Init_ManualConnectFailure)
 	ASSERT(!RLM3_WIFI_Init());
 }
 
+static void SetModuleRunning()
+{
+	// Left enabled and out of reset by whatever ran before.
+	HAL_GPIO_WritePin(GPIOG, WIFI_ENABLE_Pin | WIFI_BOOT_MODE_Pin | WIFI_RESET_Pin, GPIO_PIN_SET);
+}
+
+TEST_CASE(RLM3_WIFI_InitWarm_HappyCase)
+{
+	SetModuleRunning();
+	SIM_RLM3_UART4_Transmit("AT\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n");
+	SIM_RLM3_UART4_Transmit("ATE0\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n");
+	SIM_RLM3_UART4_Transmit("AT+CIPMUX?\r\n");
+	SIM_RLM3_UART4_Receive("+CIPMUX:1\r\n\r\nOK\r\n");
+	SIM_RLM3_UART4_Transmit("AT+CWMODE_CUR?\r\n");
+	SIM_RLM3_UART4_Receive("+CWMODE_CUR:3\r\n\r\nOK\r\n");
+	SIM_RLM3_UART4_Transmit("AT+CWAUTOCONN=0\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n");
+	SIM_RLM3_UART4_Transmit("AT+CIPRECVMODE=0\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n");
+	SIM_RLM3_UART4_Transmit("AT+CIPSTATUS\r\n");
+	SIM_RLM3_UART4_Receive("STATUS:3\r\n+CIPSTATUS:2,\"UDP\",\"1.2.3.4\",80,4002,0\r\n+CIPSTATUS:4,\"TCP\",\"192.168.4.2\",51234,333,1\r\n\r\nOK\r\n");
+	SIM_AddDelay(10);
+	SIM_RLM3_UART4_Receive("+IPD,2,2:hi\r\n");
+	SIM_RLM3_UART4_Receive("4,CLOSED\r\n");
+
+	RLM3_Time start_time = RLM3_GetCurrentTime();
+	ASSERT(RLM3_WIFI_InitWarm());
+	ASSERT(RLM3_GetCurrentTime() - start_time < 100);
+	ASSERT(SIM_GPIO_Read(WIFI_ENABLE_GPIO_Port, WIFI_ENABLE_Pin));
+	ASSERT(SIM_GPIO_Read(WIFI_RESET_GPIO_Port, WIFI_RESET_Pin));
+	ASSERT(RLM3_WIFI_IsNetworkConnected());
+	ASSERT(RLM3_WIFI_IsLocalNetworkEnabled());
+	ASSERT(!RLM3_WIFI_IsServerConnected(0));
+	ASSERT(RLM3_WIFI_IsServerConnected(2));
+	ASSERT(RLM3_WIFI_IsServerConnected(4));
+	ASSERT(g_network_callback_count == 0);
+
+	// The UDP link still hands out datagrams, and the link a station opened to our server closes as a local connection.
+	RLM3_Delay(20);
+	ASSERT(g_recv_datagram_calls.size() == 1);
+	ASSERT(g_recv_datagram_calls[0] == std::make_pair((size_t)2, std::string("hi")));
+	ASSERT(!RLM3_WIFI_IsServerConnected(4));
+	ASSERT(g_network_disconnect_calls.size() == 1);
+	ASSERT(g_network_disconnect_calls[0] == std::make_pair((size_t)4, true));
+}
+
+TEST_CASE(RLM3_WIFI_InitWarm_AccessPointOnly)
+{
+	SetModuleRunning();
+	SIM_RLM3_UART4_Transmit("AT\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n");
+	SIM_RLM3_UART4_Transmit("ATE0\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n");
+	SIM_RLM3_UART4_Transmit("AT+CIPMUX?\r\n");
+	SIM_RLM3_UART4_Receive("+CIPMUX:1\r\n\r\nOK\r\n");
+	SIM_RLM3_UART4_Transmit("AT+CWMODE_CUR?\r\n");
+	SIM_RLM3_UART4_Receive("+CWMODE_CUR:2\r\n\r\nOK\r\n");
+	ExpectInit();
+
+	ASSERT(RLM3_WIFI_InitWarm());
+	ASSERT(!RLM3_WIFI_IsLocalNetworkEnabled());
+}
+
+TEST_CASE(RLM3_WIFI_InitWarm_NotConfigured)
+{
+	SetModuleRunning();
+	SIM_RLM3_UART4_Transmit("AT\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n");
+	SIM_RLM3_UART4_Transmit("ATE0\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n");
+	SIM_RLM3_UART4_Transmit("AT+CIPMUX?\r\n");
+	SIM_RLM3_UART4_Receive("+CIPMUX:0\r\n\r\nOK\r\n");
+	ExpectInit();
+
+	ASSERT(RLM3_WIFI_InitWarm());
+	ASSERT(!RLM3_WIFI_IsNetworkConnected());
+}
+
+TEST_CASE(RLM3_WIFI_InitWarm_NoAnswer)
+{
+	SetModuleRunning();
+	SIM_RLM3_UART4_Transmit("AT\r\n");
+	ExpectInit();
+
+	ASSERT(RLM3_WIFI_InitWarm());
+}
+
+TEST_CASE(RLM3_WIFI_InitWarm_NotRunning)
+{
+	ExpectInit();
+
+	ASSERT(RLM3_WIFI_InitWarm());
+	ASSERT(SIM_GPIO_Read(WIFI_ENABLE_GPIO_Port, WIFI_ENABLE_Pin));
+	ASSERT(SIM_GPIO_Read(WIFI_RESET_GPIO_Port, WIFI_RESET_Pin));
+}
+
 TEST_CASE(RLM3_WIFI_DeInit_HappyCase)
 {
 	ExpectInit();
@@ -235,6 +396,60 @@ TEST_CASE(RLM3_WIFI_GetVersion_Failure)
 	ASSERT(!RLM3_WIFI_GetVersion(&at_version, &sdk_version));
 }
 
+TEST_CASE(RLM3_WIFI_SetBaudRate_HappyCase)
+{
+	ExpectInit();
+	SIM_RLM3_UART4_Transmit("AT+UART_CUR=921600,8,1,0,0\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n");
+	SIM_RLM3_UART4_Transmit("AT\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n");
+
+	RLM3_WIFI_Init();
+	ASSERT(RLM3_WIFI_SetBaudRate(921600));
+	ASSERT(SIM_RLM3_UART4_GetBaudrate() == 921600);
+}
+
+TEST_CASE(RLM3_WIFI_SetBaudRate_Rejected)
+{
+	ExpectInit();
+	SIM_RLM3_UART4_Transmit("AT+UART_CUR=921600,8,1,0,0\r\n");
+	SIM_RLM3_UART4_Receive("ERROR\r\n");
+
+	RLM3_WIFI_Init();
+	ASSERT(!RLM3_WIFI_SetBaudRate(921600));
+	ASSERT(SIM_RLM3_UART4_GetBaudrate() == 115200);
+}
+
+TEST_CASE(RLM3_WIFI_SetBaudRate_Fallback)
+{
+	ExpectInit();
+	SIM_RLM3_UART4_Transmit("AT+UART_CUR=2000000,8,1,0,0\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n");
+	SIM_RLM3_UART4_Transmit("AT\r\n");
+	SIM_RLM3_UART4_Transmit("AT+UART_CUR=115200,8,1,0,0\r\n");
+	SIM_RLM3_UART4_Transmit("AT\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n");
+
+	RLM3_WIFI_Init();
+	ASSERT(!RLM3_WIFI_SetBaudRate(2000000));
+	ASSERT(SIM_RLM3_UART4_GetBaudrate() == 115200);
+	ASSERT(RLM3_WIFI_IsInit());
+}
+
+TEST_CASE(RLM3_WIFI_SetBaudRate_Lost)
+{
+	ExpectInit();
+	SIM_RLM3_UART4_Transmit("AT+UART_CUR=2000000,8,1,0,0\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n");
+	SIM_RLM3_UART4_Transmit("AT\r\n");
+	SIM_RLM3_UART4_Transmit("AT+UART_CUR=115200,8,1,0,0\r\n");
+	SIM_RLM3_UART4_Transmit("AT\r\n");
+
+	RLM3_WIFI_Init();
+	ASSERT(!RLM3_WIFI_SetBaudRate(2000000));
+	ASSERT(!RLM3_WIFI_IsInit());
+}
+
 TEST_CASE(RLM3_WIFI_NetworkConnect_HappyCase)
 {
 	ExpectInit();
@@ -267,13 +482,24 @@ TEST_CASE(RLM3_WIFI_NetworkConnect_Error)
 	ASSERT(!RLM3_WIFI_IsNetworkConnected());
 }
 
-TEST_CASE(RLM3_WIFI_NetworkDisconnect_HappyCase)
+TEST_CASE(RLM3_WIFI_NetworkConnect_UnknownResponses)
 {
 	ExpectInit();
 	SIM_RLM3_UART4_Transmit("AT+CWJAP_CUR=\"test-sid\",\"test-pwd\"\r\n");
-	SIM_RLM3_UART4_Receive("WIFI CONNECTED\r\n");
-	SIM_RLM3_UART4_Receive("WIFI GOT IP\r\n");
-	SIM_RLM3_UART4_Receive("OK\r\n");
+	SIM_AddDelay(10);
+	SIM_RLM3_UART4_Receive("WIFI CONNECTING\r\n");
+	SIM_RLM3_UART4_Receive("12,SEND LATER\r\n");
+	SIM_RLM3_UART4_Receive("+CWJAP:2\r\n");
+	SIM_RLM3_UART4_Receive("FAIL\r\n");
+
+	RLM3_WIFI_Init();
+	ASSERT(!RLM3_WIFI_NetworkConnect("test-sid", "test-pwd"));
+	ASSERT(!RLM3_WIFI_IsNetworkConnected());
+}
+
+TEST_CASE(RLM3_WIFI_NetworkDisconnect_HappyCase)
+{
+	ExpectNetworkConnect();
 	SIM_RLM3_UART4_Transmit("AT+CWQAP\r\n");
 	SIM_RLM3_UART4_Receive("WIFI DISCONNECT\r\n");
 	SIM_RLM3_UART4_Receive("OK\r\n");
@@ -286,11 +512,7 @@ TEST_CASE(RLM3_WIFI_NetworkDisconnect_HappyCase)
 
 TEST_CASE(RLM3_WIFI_NetworkDisconnect_Failure)
 {
-	ExpectInit();
-	SIM_RLM3_UART4_Transmit("AT+CWJAP_CUR=\"test-sid\",\"test-pwd\"\r\n");
-	SIM_RLM3_UART4_Receive("WIFI CONNECTED\r\n");
-	SIM_RLM3_UART4_Receive("WIFI GOT IP\r\n");
-	SIM_RLM3_UART4_Receive("OK\r\n");
+	ExpectNetworkConnect();
 	SIM_RLM3_UART4_Transmit("AT+CWQAP\r\n");
 	SIM_RLM3_UART4_Receive("WIFI DISCONNECT\r\n");
 	SIM_RLM3_UART4_Receive("FAIL\r\n");
@@ -312,14 +534,7 @@ TEST_CASE(RLM3_WIFI_NetworkDisconnect_NotConnected)
 
 TEST_CASE(RLM3_WIFI_ServerConnect_HappyCase)
 {
-	ExpectInit();
-	SIM_RLM3_UART4_Transmit("AT+CWJAP_CUR=\"test-sid\",\"test-pwd\"\r\n");
-	SIM_RLM3_UART4_Receive("WIFI CONNECTED\r\n");
-	SIM_RLM3_UART4_Receive("WIFI GOT IP\r\n");
-	SIM_RLM3_UART4_Receive("OK\r\n");
-	SIM_RLM3_UART4_Transmit("AT+CIPSTART=2,\"TCP\",\"test-server\",test-port\r\n");
-	SIM_RLM3_UART4_Receive("2,CONNECT\r\n");
-	SIM_RLM3_UART4_Receive("OK\r\n");
+	ExpectServerConnect(2);
 
 	RLM3_WIFI_Init();
 	RLM3_WIFI_NetworkConnect("test-sid", "test-pwd");
@@ -330,13 +545,32 @@ TEST_CASE(RLM3_WIFI_ServerConnect_HappyCase)
 	ASSERT(g_network_connect_calls.front() == std::make_pair((size_t)2, false));
 }
 
-TEST_CASE(RLM3_WIFI_ServerConnect_Fail)
+TEST_CASE(RLM3_WIFI_ServerConnect_NetworkLost)
 {
-	ExpectInit();
-	SIM_RLM3_UART4_Transmit("AT+CWJAP_CUR=\"test-sid\",\"test-pwd\"\r\n");
-	SIM_RLM3_UART4_Receive("WIFI CONNECTED\r\n");
-	SIM_RLM3_UART4_Receive("WIFI GOT IP\r\n");
+	ExpectServerConnect(2);
+	SIM_RLM3_UART4_Transmit("AT+CIPSTART=4,\"TCP\",\"test-server\",test-port\r\n");
+	SIM_RLM3_UART4_Receive("4,CONNECT\r\n");
 	SIM_RLM3_UART4_Receive("OK\r\n");
+	SIM_AddDelay(10);
+	SIM_RLM3_UART4_Receive("WIFI DISCONNECT\r\n");
+
+	// The module does not always report each link closing before the network goes.
+	RLM3_WIFI_Init();
+	RLM3_WIFI_NetworkConnect("test-sid", "test-pwd");
+	ASSERT(RLM3_WIFI_ServerConnect(2, "test-server", "test-port"));
+	ASSERT(RLM3_WIFI_ServerConnect(4, "test-server", "test-port"));
+	RLM3_Delay(20);
+	ASSERT(!RLM3_WIFI_IsNetworkConnected());
+	ASSERT(!RLM3_WIFI_IsServerConnected(2));
+	ASSERT(!RLM3_WIFI_IsServerConnected(4));
+	ASSERT(g_network_disconnect_calls.size() == 2);
+	ASSERT(g_network_disconnect_calls[0] == std::make_pair((size_t)2, false));
+	ASSERT(g_network_disconnect_calls[1] == std::make_pair((size_t)4, false));
+}
+
+TEST_CASE(RLM3_WIFI_ServerConnect_Fail)
+{
+	ExpectNetworkConnect();
 	SIM_RLM3_UART4_Transmit("AT+CIPSTART=2,\"TCP\",\"test-server\",test-port\r\n");
 	SIM_RLM3_UART4_Receive("FAIL\r\n");
 
@@ -347,122 +581,580 @@ TEST_CASE(RLM3_WIFI_ServerConnect_Fail)
 	ASSERT(g_network_callback_count == 0);
 }
 
-TEST_CASE(RLM3_WIFI_ServerDisconnect_HappyCase)
+TEST_CASE(RLM3_WIFI_DnsCache_HappyCase)
 {
-	ExpectInit();
-	SIM_RLM3_UART4_Transmit("AT+CWJAP_CUR=\"test-sid\",\"test-pwd\"\r\n");
-	SIM_RLM3_UART4_Receive("WIFI CONNECTED\r\n");
-	SIM_RLM3_UART4_Receive("WIFI GOT IP\r\n");
-	SIM_RLM3_UART4_Receive("OK\r\n");
-	SIM_RLM3_UART4_Transmit("AT+CIPSTART=2,\"TCP\",\"test-server\",test-port\r\n");
+	ExpectNetworkConnect();
+	SIM_RLM3_UART4_Transmit("AT+CIPDOMAIN=\"test-server\"\r\n");
+	SIM_RLM3_UART4_Receive("+CIPDOMAIN:93.184.216.34\r\n");
+	SIM_RLM3_UART4_Receive("\r\nOK\r\n");
+	SIM_RLM3_UART4_Transmit("AT+CIPSTART=2,\"TCP\",\"93.184.216.34\",test-port\r\n");
 	SIM_RLM3_UART4_Receive("2,CONNECT\r\n");
 	SIM_RLM3_UART4_Receive("OK\r\n");
-	SIM_RLM3_UART4_Transmit("AT+CIPCLOSE=2\r\n");
-	SIM_RLM3_UART4_Receive("2,CLOSED\r\n");
+	SIM_RLM3_UART4_Transmit("AT+CIPSTART=3,\"TCP\",\"93.184.216.34\",other-port\r\n");
+	SIM_RLM3_UART4_Receive("3,CONNECT\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n");
+	SIM_RLM3_UART4_Transmit("AT+CIPSTART=4,\"TCP\",\"1.2.3.4\",test-port\r\n");
+	SIM_RLM3_UART4_Receive("4,CONNECT\r\n");
 	SIM_RLM3_UART4_Receive("OK\r\n");
 
 	RLM3_WIFI_Init();
 	RLM3_WIFI_NetworkConnect("test-sid", "test-pwd");
-	RLM3_WIFI_ServerConnect(2, "test-server", "test-port");
-	RLM3_WIFI_ServerDisconnect(2);
-	ASSERT(!RLM3_WIFI_IsServerConnected(2));
-	ASSERT(g_recv_buffer_count == 0);
-	ASSERT(g_network_callback_count == 2);
-	ASSERT(g_network_disconnect_calls.size() == 1);
-	ASSERT(g_network_disconnect_calls.front() == std::make_pair((size_t)2, false));
+	RLM3_WIFI_SetDnsCache(true, false);
+	ASSERT(RLM3_WIFI_ServerConnect(2, "test-server", "test-port"));
+	ASSERT(RLM3_WIFI_ServerConnect(3, "test-server", "other-port"));
+	ASSERT(RLM3_WIFI_ServerConnect(4, "1.2.3.4", "test-port"));
+	RLM3_WIFI_Stats stats;
+	RLM3_WIFI_GetStats(&stats);
+	ASSERT(stats.dns_hit_count == 1);
+	ASSERT(stats.dns_stale_count == 0);
 }
 
-TEST_CASE(RLM3_WIFI_ServerDisconnect_Fail)
+TEST_CASE(RLM3_WIFI_DnsCache_Stale)
 {
-	ExpectInit();
-	SIM_RLM3_UART4_Transmit("AT+CWJAP_CUR=\"test-sid\",\"test-pwd\"\r\n");
-	SIM_RLM3_UART4_Receive("WIFI CONNECTED\r\n");
-	SIM_RLM3_UART4_Receive("WIFI GOT IP\r\n");
-	SIM_RLM3_UART4_Receive("OK\r\n");
-	SIM_RLM3_UART4_Transmit("AT+CIPSTART=2,\"TCP\",\"test-server\",test-port\r\n");
+	ExpectNetworkConnect();
+	SIM_RLM3_UART4_Transmit("AT+CIPDOMAIN=\"test-server\"\r\n");
+	SIM_RLM3_UART4_Receive("+CIPDOMAIN:10.0.0.1\r\n");
+	SIM_RLM3_UART4_Receive("\r\nOK\r\n");
+	SIM_RLM3_UART4_Transmit("AT+CIPSTART=2,\"TCP\",\"10.0.0.1\",test-port\r\n");
 	SIM_RLM3_UART4_Receive("2,CONNECT\r\n");
 	SIM_RLM3_UART4_Receive("OK\r\n");
-	SIM_RLM3_UART4_Transmit("AT+CIPCLOSE=2\r\n");
-	SIM_RLM3_UART4_Receive("FAIL\r\n");
+	SIM_AddDelay(RLM3_WIFI_DNS_TTL);
+	SIM_RLM3_UART4_Transmit("AT+CIPDOMAIN=\"test-server\"\r\n");
+	SIM_RLM3_UART4_Receive("DNS Fail\r\n");
+	SIM_RLM3_UART4_Receive("\r\nERROR\r\n");
+	SIM_RLM3_UART4_Transmit("AT+CIPDOMAIN=\"test-server\"\r\n");
+	SIM_RLM3_UART4_Receive("DNS Fail\r\n");
+	SIM_RLM3_UART4_Receive("\r\nERROR\r\n");
+	SIM_RLM3_UART4_Transmit("AT+CIPSTART=3,\"TCP\",\"10.0.0.1\",test-port\r\n");
+	SIM_RLM3_UART4_Receive("3,CONNECT\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n");
 
 	RLM3_WIFI_Init();
 	RLM3_WIFI_NetworkConnect("test-sid", "test-pwd");
-	RLM3_WIFI_ServerConnect(2,"test-server", "test-port");
-	RLM3_WIFI_ServerDisconnect(2);
-	ASSERT(RLM3_WIFI_IsServerConnected(2));
-	ASSERT(g_recv_buffer_count == 0);
-	ASSERT(g_network_callback_count == 1);
-	ASSERT(g_network_disconnect_calls.empty());
+	RLM3_WIFI_SetDnsCache(true, false);
+	ASSERT(RLM3_WIFI_ServerConnect(2, "test-server", "test-port"));
+	RLM3_Delay(RLM3_WIFI_DNS_TTL);
+	ASSERT(!RLM3_WIFI_ServerConnect(3, "test-server", "test-port"));
+	RLM3_WIFI_SetDnsCache(true, true);
+	ASSERT(RLM3_WIFI_ServerConnect(3, "test-server", "test-port"));
+	RLM3_WIFI_Stats stats;
+	RLM3_WIFI_GetStats(&stats);
+	ASSERT(stats.dns_hit_count == 0);
+	ASSERT(stats.dns_stale_count == 1);
 }
 
-TEST_CASE(RLM3_WIFI_Transmit_HappyCase)
+TEST_CASE(RLM3_WIFI_Pool_HappyCase)
 {
-	uint8_t buffer[] = { 'a', 'b', 'c', 'd', 'c', 'b', 'a' };
-
-	ExpectInit();
-	SIM_RLM3_UART4_Transmit("AT+CWJAP_CUR=\"test-sid\",\"test-pwd\"\r\n");
-	SIM_RLM3_UART4_Receive("WIFI CONNECTED\r\n");
-	SIM_RLM3_UART4_Receive("WIFI GOT IP\r\n");
-	SIM_RLM3_UART4_Receive("OK\r\n");
-	SIM_RLM3_UART4_Transmit("AT+CIPSTART=2,\"TCP\",\"test-server\",test-port\r\n");
-	SIM_RLM3_UART4_Receive("2,CONNECT\r\n");
+	ExpectServerConnect(0);
+	SIM_RLM3_UART4_Transmit("AT+CIPSTART=1,\"TCP\",\"test-server\",other-port\r\n");
+	SIM_RLM3_UART4_Receive("1,CONNECT\r\n");
 	SIM_RLM3_UART4_Receive("OK\r\n");
-	SIM_RLM3_UART4_Transmit("AT+CIPSEND=2,7\r\n");
+	SIM_RLM3_UART4_Transmit("AT+CIPCLOSE=1\r\n");
+	SIM_RLM3_UART4_Receive("1,CLOSED\r\n");
 	SIM_RLM3_UART4_Receive("OK\r\n");
-	SIM_RLM3_UART4_Receive("> \r\n");
-	SIM_RLM3_UART4_Transmit("abcdcba");
-	SIM_RLM3_UART4_Receive("Recv 7 bytes\r\n");
-	SIM_RLM3_UART4_Receive("SEND OK\r\n");
 
 	RLM3_WIFI_Init();
 	RLM3_WIFI_NetworkConnect("test-sid", "test-pwd");
-	RLM3_WIFI_ServerConnect(2, "test-server", "test-port");
-	ASSERT(RLM3_WIFI_Transmit(2, buffer, sizeof(buffer)));
-	ASSERT(g_recv_buffer_count == 0);
-	ASSERT(g_network_callback_count == 1);
+	ASSERT(RLM3_WIFI_PoolAcquire("test-server", "test-port") == 0);
+	RLM3_WIFI_PoolRelease(0, true);
+	ASSERT(RLM3_WIFI_PoolAcquire("test-server", "test-port") == 0);
+	ASSERT(RLM3_WIFI_PoolAcquire("test-server", "other-port") == 1);
+	RLM3_WIFI_PoolRelease(1, false);
+	RLM3_WIFI_PoolRelease(0, true);
+	ASSERT(!RLM3_WIFI_IsServerConnected(1));
+	ASSERT(RLM3_WIFI_IsServerConnected(0));
+	RLM3_WIFI_Stats stats;
+	RLM3_WIFI_GetStats(&stats);
+	ASSERT(stats.pool_reuse_count == 1);
+	ASSERT(stats.pool_evict_count == 0);
 }
 
-TEST_CASE(RLM3_WIFI_Transmit2_HappyCase)
+TEST_CASE(RLM3_WIFI_Pool_IdleClosed)
 {
-	uint8_t bufferA[] = { 'a', 'b', 'c' };
-	uint8_t bufferB[] = { 'd', 'c', 'b', 'a' };
-
-	ExpectInit();
-	SIM_RLM3_UART4_Transmit("AT+CWJAP_CUR=\"test-sid\",\"test-pwd\"\r\n");
-	SIM_RLM3_UART4_Receive("WIFI CONNECTED\r\n");
-	SIM_RLM3_UART4_Receive("WIFI GOT IP\r\n");
-	SIM_RLM3_UART4_Receive("OK\r\n");
-	SIM_RLM3_UART4_Transmit("AT+CIPSTART=2,\"TCP\",\"test-server\",test-port\r\n");
-	SIM_RLM3_UART4_Receive("2,CONNECT\r\n");
-	SIM_RLM3_UART4_Receive("OK\r\n");
-	SIM_RLM3_UART4_Transmit("AT+CIPSEND=2,7\r\n");
+	ExpectServerConnect(0);
+	SIM_AddDelay(10);
+	SIM_RLM3_UART4_Receive("0,CLOSED\r\n");
+	SIM_RLM3_UART4_Transmit("AT+CIPSTART=0,\"TCP\",\"test-server\",test-port\r\n");
+	SIM_RLM3_UART4_Receive("0,CONNECT\r\n");
 	SIM_RLM3_UART4_Receive("OK\r\n");
-	SIM_RLM3_UART4_Receive("> \r\n");
-	SIM_RLM3_UART4_Transmit("abc");
-	SIM_RLM3_UART4_Transmit("dcba");
-	SIM_RLM3_UART4_Receive("Recv 7 bytes\r\n");
-	SIM_RLM3_UART4_Receive("SEND OK\r\n");
 
 	RLM3_WIFI_Init();
 	RLM3_WIFI_NetworkConnect("test-sid", "test-pwd");
-	RLM3_WIFI_ServerConnect(2, "test-server", "test-port");
-	ASSERT(RLM3_WIFI_Transmit2(2, bufferA, sizeof(bufferA), bufferB, sizeof(bufferB)));
-	ASSERT(g_recv_buffer_count == 0);
-	ASSERT(g_network_callback_count == 1);
+	ASSERT(RLM3_WIFI_PoolAcquire("test-server", "test-port") == 0);
+	RLM3_WIFI_PoolRelease(0, true);
+	RLM3_Delay(20);
+	ASSERT(RLM3_WIFI_PoolAcquire("test-server", "test-port") == 0);
+	RLM3_WIFI_Stats stats;
+	RLM3_WIFI_GetStats(&stats);
+	ASSERT(stats.pool_reuse_count == 0);
 }
 
-TEST_CASE(RLM3_WIFI_Transmit_Empty)
+TEST_CASE(RLM3_WIFI_UdpConnect_HappyCase)
 {
-	uint8_t buffer[] = { 'a', 'b', 'c', 'd', 'c', 'b', 'a' };
-
-	ExpectInit();
-	SIM_RLM3_UART4_Transmit("AT+CWJAP_CUR=\"test-sid\",\"test-pwd\"\r\n");
-	SIM_RLM3_UART4_Receive("WIFI CONNECTED\r\n");
-	SIM_RLM3_UART4_Receive("WIFI GOT IP\r\n");
-	SIM_RLM3_UART4_Receive("OK\r\n");
-	SIM_RLM3_UART4_Transmit("AT+CIPSTART=2,\"TCP\",\"test-server\",test-port\r\n");
+	ExpectNetworkConnect();
+	SIM_RLM3_UART4_Transmit("AT+CIPSTART=2,\"UDP\",\"test-server\",test-port,test-local-port,2\r\n");
 	SIM_RLM3_UART4_Receive("2,CONNECT\r\n");
 	SIM_RLM3_UART4_Receive("OK\r\n");
+	SIM_RLM3_UART4_Transmit("AT+CIPSTART=3,\"UDP\",\"test-server\",test-port\r\n");
+	SIM_RLM3_UART4_Receive("3,CONNECT\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n");
+
+	RLM3_WIFI_Init();
+	RLM3_WIFI_NetworkConnect("test-sid", "test-pwd");
+	ASSERT(RLM3_WIFI_UdpConnect(2, "test-server", "test-port", "test-local-port", RLM3_WIFI_UDP_MODE_ANY_PEER));
+	ASSERT(RLM3_WIFI_UdpConnect(3, "test-server", "test-port", NULL, RLM3_WIFI_UDP_MODE_FIXED));
+	ASSERT(RLM3_WIFI_IsServerConnected(2));
+	ASSERT(RLM3_WIFI_IsServerConnected(3));
+	ASSERT(g_network_connect_calls.size() == 2);
+	ASSERT(g_network_connect_calls.front() == std::make_pair((size_t)2, false));
+}
+
+TEST_CASE(RLM3_WIFI_UdpTransmitReceive)
+{
+	ExpectNetworkConnect();
+	SIM_RLM3_UART4_Transmit("AT+CIPSTART=2,\"UDP\",\"test-server\",test-port,test-local-port,2\r\n");
+	SIM_RLM3_UART4_Receive("2,CONNECT\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n");
+	SIM_RLM3_UART4_Transmit("AT+CIPSEND=2,4,\"1.2.3.4\",5678\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n");
+	SIM_RLM3_UART4_Receive(">");
+	SIM_RLM3_UART4_Transmit("abcd");
+	SIM_RLM3_UART4_Receive("Recv 4 bytes\r\n");
+	SIM_RLM3_UART4_Receive("SEND OK\r\n");
+	SIM_RLM3_UART4_Receive("+IPD,2,3:efg\r\n+IPD,2,2:hi\r\n");
+	SIM_RLM3_UART4_Transmit("AT+CIPSEND=2,3\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n");
+	SIM_RLM3_UART4_Receive(">");
+	SIM_RLM3_UART4_Transmit("jkl");
+	SIM_RLM3_UART4_Receive("Recv 3 bytes\r\n");
+	SIM_RLM3_UART4_Receive("SEND OK\r\n");
+
+	RLM3_WIFI_Init();
+	RLM3_WIFI_NetworkConnect("test-sid", "test-pwd");
+	ASSERT(RLM3_WIFI_UdpConnect(2, "test-server", "test-port", "test-local-port", RLM3_WIFI_UDP_MODE_ANY_PEER));
+	ASSERT(RLM3_WIFI_TransmitDatagram(2, (const uint8_t*)"abcd", 4, "1.2.3.4", "5678"));
+	RLM3_WIFI_SetTransmitBuffered(true);
+	ASSERT(RLM3_WIFI_Transmit(2, (const uint8_t*)"jkl", 3));
+	ASSERT(g_recv_datagram_calls.size() == 2);
+	ASSERT(g_recv_datagram_calls[0] == std::make_pair((size_t)2, std::string("efg")));
+	ASSERT(g_recv_datagram_calls[1] == std::make_pair((size_t)2, std::string("hi")));
+	ASSERT(g_recv_buffer_count == 5);
+}
+
+TEST_CASE(RLM3_WIFI_ServerConnectMany_HappyCase)
+{
+	ExpectNetworkConnect();
+	SIM_RLM3_UART4_Transmit("AT+CIPSTART=1,\"TCP\",\"server-a\",1000\r\n");
+	SIM_RLM3_UART4_Receive("1,CONNECT\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n");
+	SIM_RLM3_UART4_Transmit("AT+CIPSTART=3,\"TCP\",\"server-b\",2000\r\n");
+	SIM_RLM3_UART4_Receive("DNS Fail\r\n");
+	SIM_RLM3_UART4_Receive("ERROR\r\n");
+	SIM_RLM3_UART4_Transmit("AT+CIPSTART=4,\"TCP\",\"server-c\",3000\r\n");
+	SIM_RLM3_UART4_Receive("4,CONNECT\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n");
+
+	RLM3_WIFI_Init();
+	RLM3_WIFI_NetworkConnect("test-sid", "test-pwd");
+	RLM3_WIFI_ServerConnectRequest requests[] =
+	{
+		{ 1, "server-a", "1000", false },
+		{ 3, "server-b", "2000", false },
+		{ 4, "server-c", "3000", false },
+	};
+	ASSERT(RLM3_WIFI_ServerConnectMany(requests, 3, 30000) == 2);
+	ASSERT(requests[0].is_connected);
+	ASSERT(!requests[1].is_connected);
+	ASSERT(requests[2].is_connected);
+	ASSERT(RLM3_WIFI_IsServerConnected(1));
+	ASSERT(!RLM3_WIFI_IsServerConnected(3));
+	ASSERT(RLM3_WIFI_IsServerConnected(4));
+	ASSERT(g_network_connect_calls.size() == 2);
+}
+
+TEST_CASE(RLM3_WIFI_ServerConnectMany_Deadline)
+{
+	ExpectNetworkConnect();
+	SIM_RLM3_UART4_Transmit("AT+CIPSTART=1,\"TCP\",\"server-a\",1000\r\n");
+	SIM_AddDelay(300);
+	SIM_RLM3_UART4_Receive("1,CONNECT\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n");
+	SIM_RLM3_UART4_Transmit("AT+CIPSTART=3,\"TCP\",\"server-b\",2000\r\n");
+
+	RLM3_WIFI_Init();
+	RLM3_WIFI_NetworkConnect("test-sid", "test-pwd");
+	RLM3_WIFI_ServerConnectRequest requests[] =
+	{
+		{ 1, "server-a", "1000", false },
+		{ 3, "server-b", "2000", false },
+		{ 4, "server-c", "3000", false },
+	};
+
+	// The second connect uses up the time that is left, and the third is never sent.
+	RLM3_Time start_time = RLM3_GetCurrentTime();
+	ASSERT(RLM3_WIFI_ServerConnectMany(requests, 3, 400) == 1);
+	ASSERT(RLM3_GetCurrentTime() - start_time <= 400);
+	ASSERT(requests[0].is_connected);
+	ASSERT(!requests[1].is_connected);
+	ASSERT(!requests[2].is_connected);
+}
+
+TEST_CASE(RLM3_WIFI_ServerDisconnect_HappyCase)
+{
+	ExpectServerConnect(2);
+	SIM_RLM3_UART4_Transmit("AT+CIPCLOSE=2\r\n");
+	SIM_RLM3_UART4_Receive("2,CLOSED\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n");
+
+	RLM3_WIFI_Init();
+	RLM3_WIFI_NetworkConnect("test-sid", "test-pwd");
+	RLM3_WIFI_ServerConnect(2, "test-server", "test-port");
+	RLM3_WIFI_ServerDisconnect(2);
+	ASSERT(!RLM3_WIFI_IsServerConnected(2));
+	ASSERT(g_recv_buffer_count == 0);
+	ASSERT(g_network_callback_count == 2);
+	ASSERT(g_network_disconnect_calls.size() == 1);
+	ASSERT(g_network_disconnect_calls.front() == std::make_pair((size_t)2, false));
+}
+
+TEST_CASE(RLM3_WIFI_ServerDisconnect_Fail)
+{
+	ExpectServerConnect(2);
+	SIM_RLM3_UART4_Transmit("AT+CIPCLOSE=2\r\n");
+	SIM_RLM3_UART4_Receive("FAIL\r\n");
+
+	RLM3_WIFI_Init();
+	RLM3_WIFI_NetworkConnect("test-sid", "test-pwd");
+	RLM3_WIFI_ServerConnect(2,"test-server", "test-port");
+	RLM3_WIFI_ServerDisconnect(2);
+	ASSERT(RLM3_WIFI_IsServerConnected(2));
+	ASSERT(g_recv_buffer_count == 0);
+	ASSERT(g_network_callback_count == 1);
+	ASSERT(g_network_disconnect_calls.empty());
+}
+
+TEST_CASE(RLM3_WIFI_Transmit_HappyCase)
+{
+	uint8_t buffer[] = { 'a', 'b', 'c', 'd', 'c', 'b', 'a' };
+
+	ExpectServerConnect(2);
+	SIM_RLM3_UART4_Transmit("AT+CIPSEND=2,7\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n");
+	SIM_RLM3_UART4_Receive("> \r\n");
+	SIM_RLM3_UART4_Transmit("abcdcba");
+	SIM_RLM3_UART4_Receive("Recv 7 bytes\r\n");
+	SIM_RLM3_UART4_Receive("SEND OK\r\n");
+
+	RLM3_WIFI_Init();
+	RLM3_WIFI_NetworkConnect("test-sid", "test-pwd");
+	RLM3_WIFI_ServerConnect(2, "test-server", "test-port");
+	ASSERT(RLM3_WIFI_Transmit(2, buffer, sizeof(buffer)));
+	ASSERT(g_recv_buffer_count == 0);
+	ASSERT(g_network_callback_count == 1);
+}
+
+TEST_CASE(RLM3_WIFI_Transmit2_HappyCase)
+{
+	uint8_t bufferA[] = { 'a', 'b', 'c' };
+	uint8_t bufferB[] = { 'd', 'c', 'b', 'a' };
+
+	ExpectServerConnect(2);
+	SIM_RLM3_UART4_Transmit("AT+CIPSEND=2,7\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n");
+	SIM_RLM3_UART4_Receive("> \r\n");
+	SIM_RLM3_UART4_Transmit("abc");
+	SIM_RLM3_UART4_Transmit("dcba");
+	SIM_RLM3_UART4_Receive("Recv 7 bytes\r\n");
+	SIM_RLM3_UART4_Receive("SEND OK\r\n");
+
+	RLM3_WIFI_Init();
+	RLM3_WIFI_NetworkConnect("test-sid", "test-pwd");
+	RLM3_WIFI_ServerConnect(2, "test-server", "test-port");
+	ASSERT(RLM3_WIFI_Transmit2(2, bufferA, sizeof(bufferA), bufferB, sizeof(bufferB)));
+	ASSERT(g_recv_buffer_count == 0);
+	ASSERT(g_network_callback_count == 1);
+}
+
+TEST_CASE(RLM3_WIFI_Transmit_Buffered)
+{
+	std::string data(3000, 'a');
+
+	ExpectServerConnect(2);
+	SIM_RLM3_UART4_Transmit("AT+CIPSENDBUF=2,2048\r\n");
+	SIM_RLM3_UART4_Receive("1,0\r\n\r\nOK\r\n> ");
+	SIM_RLM3_UART4_Transmit(data.substr(0, 2048).c_str());
+	SIM_RLM3_UART4_Receive("Recv 2048 bytes\r\n");
+	SIM_RLM3_UART4_Transmit("AT+CIPSENDBUF=2,952\r\n");
+	SIM_RLM3_UART4_Receive("2,0\r\n\r\nOK\r\n> ");
+	SIM_RLM3_UART4_Transmit(data.substr(2048).c_str());
+	SIM_RLM3_UART4_Receive("Recv 952 bytes\r\n");
+
+	RLM3_WIFI_Init();
+	RLM3_WIFI_NetworkConnect("test-sid", "test-pwd");
+	RLM3_WIFI_ServerConnect(2, "test-server", "test-port");
+	RLM3_WIFI_SetTransmitBuffered(true);
+	ASSERT(RLM3_WIFI_Transmit(2, (const uint8_t*)data.data(), data.size()));
+}
+
+TEST_CASE(RLM3_WIFI_Transmit_BufferedBusy)
+{
+	ExpectServerConnect(2);
+	SIM_RLM3_UART4_Transmit("AT+CIPSENDBUF=2,3\r\n");
+	SIM_RLM3_UART4_Receive("1,0\r\n\r\nOK\r\n> ");
+	SIM_RLM3_UART4_Transmit("abc");
+	SIM_RLM3_UART4_Receive("Recv 3 bytes\r\n");
+	SIM_RLM3_UART4_Transmit("AT+CIPSENDBUF=2,3\r\n");
+	SIM_RLM3_UART4_Receive("busy s...\r\n");
+	SIM_AddDelay(100);
+	SIM_RLM3_UART4_Receive("2,1,SEND OK\r\n");
+	SIM_RLM3_UART4_Transmit("AT+CIPSENDBUF=2,3\r\n");
+	SIM_RLM3_UART4_Receive("2,1\r\n\r\nOK\r\n> ");
+	SIM_RLM3_UART4_Transmit("def");
+	SIM_RLM3_UART4_Receive("Recv 3 bytes\r\n");
+
+	RLM3_WIFI_Init();
+	RLM3_WIFI_NetworkConnect("test-sid", "test-pwd");
+	RLM3_WIFI_ServerConnect(2, "test-server", "test-port");
+	RLM3_WIFI_SetTransmitBuffered(true);
+	ASSERT(RLM3_WIFI_Transmit(2, (const uint8_t*)"abc", 3));
+	ASSERT(RLM3_WIFI_Transmit(2, (const uint8_t*)"def", 3));
+}
+
+TEST_CASE(RLM3_WIFI_Transmit_BufferedSendFail)
+{
+	ExpectServerConnect(2);
+	SIM_RLM3_UART4_Transmit("AT+CIPSENDBUF=2,3\r\n");
+	SIM_RLM3_UART4_Receive("2,1,SEND FAIL\r\n");
+
+	RLM3_WIFI_Init();
+	RLM3_WIFI_NetworkConnect("test-sid", "test-pwd");
+	RLM3_WIFI_ServerConnect(2, "test-server", "test-port");
+	RLM3_WIFI_SetTransmitBuffered(true);
+	ASSERT(!RLM3_WIFI_Transmit(2, (const uint8_t*)"abc", 3));
+}
+
+TEST_CASE(RLM3_WIFI_Transmit_BufferedErrorAfterPlain)
+{
+	ExpectServerConnect(2);
+	SIM_RLM3_UART4_Transmit("AT+CIPSEND=2,3\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n> ");
+	SIM_RLM3_UART4_Transmit("abc");
+	SIM_RLM3_UART4_Receive("Recv 3 bytes\r\n\r\nSEND OK\r\n");
+	SIM_RLM3_UART4_Transmit("AT+CIPSENDBUF=2,3\r\n");
+	SIM_RLM3_UART4_Receive("ERROR\r\n");
+
+	RLM3_WIFI_Init();
+	RLM3_WIFI_NetworkConnect("test-sid", "test-pwd");
+	RLM3_WIFI_ServerConnect(2, "test-server", "test-port");
+	ASSERT(RLM3_WIFI_Transmit(2, (const uint8_t*)"abc", 3));
+
+	// Nothing CIPSENDBUF queued is still waiting, so the error is not a full buffer.
+	RLM3_WIFI_SetTransmitBuffered(true);
+	RLM3_Time start_time = RLM3_GetCurrentTime();
+	ASSERT(!RLM3_WIFI_Transmit(2, (const uint8_t*)"def", 3));
+	ASSERT(RLM3_GetCurrentTime() - start_time < 100);
+}
+
+static void TransmitAsyncComplete(void* context, bool success)
+{
+	std::vector<bool>* results = (std::vector<bool>*)context;
+	results->push_back(success);
+	RLM3_GiveFromISR(g_client_thread);
+}
+
+TEST_CASE(RLM3_WIFI_TransmitAsync_HappyCase)
+{
+	ExpectServerConnect(2);
+	SIM_RLM3_UART4_Transmit("AT+CIPSEND=2,3\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n> ");
+	SIM_RLM3_UART4_Transmit("abc");
+	SIM_RLM3_UART4_Receive("Recv 3 bytes\r\n\r\nSEND OK\r\n");
+	SIM_RLM3_UART4_Transmit("AT+CIPSEND=2,4\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n> ");
+	SIM_RLM3_UART4_Transmit("dcba");
+	SIM_RLM3_UART4_Receive("Recv 4 bytes\r\n\r\nSEND FAIL\r\n");
+
+	RLM3_WIFI_Init();
+	RLM3_WIFI_NetworkConnect("test-sid", "test-pwd");
+	RLM3_WIFI_ServerConnect(2, "test-server", "test-port");
+
+	std::vector<bool> results;
+	ASSERT(RLM3_WIFI_TransmitAsync(2, (const uint8_t*)"abc", 3, TransmitAsyncComplete, &results));
+	ASSERT(RLM3_WIFI_TransmitAsync(2, (const uint8_t*)"dcba", 4, TransmitAsyncComplete, &results));
+	while (results.size() < 2)
+		RLM3_Take();
+	ASSERT(results[0]);
+	ASSERT(!results[1]);
+}
+
+TEST_CASE(RLM3_WIFI_TransmitAsync_ThenCommand)
+{
+	ExpectServerConnect(2);
+	SIM_RLM3_UART4_Transmit("AT+CIPSEND=2,3\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n> ");
+	SIM_RLM3_UART4_Transmit("abc");
+	SIM_RLM3_UART4_Receive("Recv 3 bytes\r\n\r\nSEND OK\r\n");
+	SIM_RLM3_UART4_Transmit("AT+CIPCLOSE=2\r\n");
+	SIM_RLM3_UART4_Receive("2,CLOSED\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n");
+
+	RLM3_WIFI_Init();
+	RLM3_WIFI_NetworkConnect("test-sid", "test-pwd");
+	RLM3_WIFI_ServerConnect(2, "test-server", "test-port");
+
+	std::vector<bool> results;
+	ASSERT(RLM3_WIFI_TransmitAsync(2, (const uint8_t*)"abc", 3, TransmitAsyncComplete, &results));
+	RLM3_WIFI_ServerDisconnect(2);
+	ASSERT(results.size() == 1);
+	ASSERT(results[0]);
+	ASSERT(!RLM3_WIFI_IsServerConnected(2));
+}
+
+TEST_CASE(RLM3_WIFI_TransmitAsync_Timeout)
+{
+	ExpectServerConnect(2);
+	SIM_RLM3_UART4_Transmit("AT+CIPSEND=2,3\r\n");
+	SIM_RLM3_UART4_Transmit("AT+GMR\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n");
+
+	RLM3_WIFI_Init();
+	RLM3_WIFI_NetworkConnect("test-sid", "test-pwd");
+	RLM3_WIFI_ServerConnect(2, "test-server", "test-port");
+
+	std::vector<bool> results;
+	ASSERT(RLM3_WIFI_TransmitAsync(2, (const uint8_t*)"abc", 3, TransmitAsyncComplete, &results));
+	uint32_t at_version = 0;
+	uint32_t sdk_version = 0;
+	ASSERT(RLM3_WIFI_GetVersion(&at_version, &sdk_version));
+	ASSERT(results.size() == 1);
+	ASSERT(!results[0]);
+}
+
+TEST_CASE(RLM3_WIFI_TransmitAsync_TimeoutWithoutCommand)
+{
+	ExpectServerConnect(2);
+	SIM_RLM3_UART4_Transmit("AT+CIPSEND=2,3\r\n");
+	SIM_AddDelay(20000);
+	SIM_RLM3_UART4_Transmit("AT+CIPSEND=2,4\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n> ");
+	SIM_RLM3_UART4_Transmit("dcba");
+	SIM_RLM3_UART4_Receive("Recv 4 bytes\r\n\r\nSEND OK\r\n");
+
+	RLM3_WIFI_Init();
+	RLM3_WIFI_NetworkConnect("test-sid", "test-pwd");
+	RLM3_WIFI_ServerConnect(2, "test-server", "test-port");
+
+	// Nothing but asynchronous transmits, so nothing waits for the UART.
+	std::vector<bool> results;
+	ASSERT(RLM3_WIFI_TransmitAsync(2, (const uint8_t*)"abc", 3, TransmitAsyncComplete, &results));
+	RLM3_Delay(5000);
+	RLM3_WIFI_CheckTransmitAsync();
+	ASSERT(results.empty());
+	RLM3_Delay(5000);
+	RLM3_WIFI_CheckTransmitAsync();
+	ASSERT(results.size() == 1);
+	ASSERT(!results[0]);
+	RLM3_Delay(10000);
+	ASSERT(RLM3_WIFI_TransmitAsync(2, (const uint8_t*)"dcba", 4, TransmitAsyncComplete, &results));
+	while (results.size() < 2)
+		RLM3_Take();
+	ASSERT(results[1]);
+}
+
+TEST_CASE(RLM3_WIFI_TransmitAsync_ClosedDuringData)
+{
+	ExpectServerConnect(2);
+	SIM_RLM3_UART4_Transmit("AT+CIPSTART=3,\"TCP\",\"test-server\",test-port\r\n");
+	SIM_RLM3_UART4_Receive("3,CONNECT\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n");
+	SIM_RLM3_UART4_Transmit("AT+CIPSEND=2,3\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n> ");
+	SIM_RLM3_UART4_Receive("2,CLOSED\r\n");
+	SIM_AddDelay(1000);
+	SIM_RLM3_UART4_Receive("ERROR\r\n");
+	SIM_RLM3_UART4_Transmit("AT+CIPSEND=3,4\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n> ");
+	SIM_RLM3_UART4_Transmit("dcba");
+	SIM_RLM3_UART4_Receive("Recv 4 bytes\r\n\r\nSEND OK\r\n");
+
+	RLM3_WIFI_Init();
+	RLM3_WIFI_NetworkConnect("test-sid", "test-pwd");
+	RLM3_WIFI_ServerConnect(2, "test-server", "test-port");
+	RLM3_WIFI_ServerConnect(3, "test-server", "test-port");
+
+	// The next transmit waits for the module to finish with the failed one.
+	std::vector<bool> results;
+	ASSERT(RLM3_WIFI_TransmitAsync(2, (const uint8_t*)"abc", 3, TransmitAsyncComplete, &results));
+	ASSERT(RLM3_WIFI_TransmitAsync(3, (const uint8_t*)"dcba", 4, TransmitAsyncComplete, &results));
+	while (results.size() < 2)
+		RLM3_Take();
+	ASSERT(!results[0]);
+	ASSERT(results[1]);
+}
+
+TEST_CASE(RLM3_WIFI_Transmit_ClosedDuringSend)
+{
+	ExpectServerConnect(2);
+	SIM_RLM3_UART4_Transmit("AT+CIPSEND=2,3\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n");
+	SIM_AddDelay(10);
+	SIM_RLM3_UART4_Receive("2,CLOSED\r\n");
+
+	RLM3_WIFI_Init();
+	RLM3_WIFI_NetworkConnect("test-sid", "test-pwd");
+	RLM3_WIFI_ServerConnect(2, "test-server", "test-port");
+	RLM3_Time start_time = RLM3_GetCurrentTime();
+	ASSERT(!RLM3_WIFI_Transmit(2, (const uint8_t*)"abc", 3));
+	ASSERT(RLM3_GetCurrentTime() - start_time < 1000);
+}
+
+TEST_CASE(RLM3_WIFI_Transmit_NoIpDuringSend)
+{
+	ExpectServerConnect(2);
+	SIM_RLM3_UART4_Transmit("AT+CIPSEND=2,3\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n> ");
+	SIM_RLM3_UART4_Transmit("abc");
+	SIM_AddDelay(10);
+	SIM_RLM3_UART4_Receive("no ip\r\n");
+
+	RLM3_WIFI_Init();
+	RLM3_WIFI_NetworkConnect("test-sid", "test-pwd");
+	RLM3_WIFI_ServerConnect(2, "test-server", "test-port");
+	RLM3_Time start_time = RLM3_GetCurrentTime();
+	ASSERT(!RLM3_WIFI_Transmit(2, (const uint8_t*)"abc", 3));
+	ASSERT(RLM3_GetCurrentTime() - start_time < 1000);
+	ASSERT(!RLM3_WIFI_IsNetworkConnected());
+}
+
+TEST_CASE(RLM3_WIFI_Transmit_NotConnected)
+{
+	ExpectInit();
+
+	RLM3_WIFI_Init();
+	ASSERT(!RLM3_WIFI_Transmit(2, (const uint8_t*)"abc", 3));
+}
+
+TEST_CASE(RLM3_WIFI_TransmitTimeout_Deadline)
+{
+	ExpectServerConnect(2);
+	SIM_RLM3_UART4_Transmit("AT+CIPSEND=2,3\r\n");
+	SIM_AddDelay(200);
+	SIM_RLM3_UART4_Receive("OK\r\n> ");
+	SIM_RLM3_UART4_Transmit("abc");
+
+	RLM3_WIFI_Init();
+	RLM3_WIFI_NetworkConnect("test-sid", "test-pwd");
+	RLM3_WIFI_ServerConnect(2, "test-server", "test-port");
+	RLM3_Time start_time = RLM3_GetCurrentTime();
+	ASSERT(!RLM3_WIFI_TransmitTimeout(2, (const uint8_t*)"abc", 3, 500));
+	ASSERT(RLM3_GetCurrentTime() - start_time <= 500);
+}
+
+TEST_CASE(RLM3_WIFI_Transmit_Empty)
+{
+	uint8_t buffer[] = { 'a', 'b', 'c', 'd', 'c', 'b', 'a' };
+
+	ExpectServerConnect(2);
 
 	RLM3_WIFI_Init();
 	RLM3_WIFI_NetworkConnect("test-sid", "test-pwd");
@@ -472,24 +1164,17 @@ TEST_CASE(RLM3_WIFI_Transmit_Empty)
 
 TEST_CASE(RLM3_WIFI_Transmit_MaxSize)
 {
-	constexpr size_t BUFFER_SIZE = 1024;
+	constexpr size_t BUFFER_SIZE = 2048;
 	uint8_t buffer[BUFFER_SIZE + 1] = { 0 };
 	for (size_t i = 0; i < BUFFER_SIZE; i++)
 		buffer[i] = 'a';
 
-	ExpectInit();
-	SIM_RLM3_UART4_Transmit("AT+CWJAP_CUR=\"test-sid\",\"test-pwd\"\r\n");
-	SIM_RLM3_UART4_Receive("WIFI CONNECTED\r\n");
-	SIM_RLM3_UART4_Receive("WIFI GOT IP\r\n");
-	SIM_RLM3_UART4_Receive("OK\r\n");
-	SIM_RLM3_UART4_Transmit("AT+CIPSTART=2,\"TCP\",\"test-server\",test-port\r\n");
-	SIM_RLM3_UART4_Receive("2,CONNECT\r\n");
-	SIM_RLM3_UART4_Receive("OK\r\n");
-	SIM_RLM3_UART4_Transmit("AT+CIPSEND=2,1024\r\n");
+	ExpectServerConnect(2);
+	SIM_RLM3_UART4_Transmit("AT+CIPSEND=2,2048\r\n");
 	SIM_RLM3_UART4_Receive("OK\r\n");
 	SIM_RLM3_UART4_Receive("> \r\n");
 	SIM_RLM3_UART4_Transmit((const char*)buffer);
-	SIM_RLM3_UART4_Receive("Recv 1024 bytes\r\n");
+	SIM_RLM3_UART4_Receive("Recv 2048 bytes\r\n");
 	SIM_RLM3_UART4_Receive("SEND OK\r\n");
 
 	RLM3_WIFI_Init();
@@ -500,36 +1185,89 @@ TEST_CASE(RLM3_WIFI_Transmit_MaxSize)
 
 TEST_CASE(RLM3_WIFI_Transmit_OverSize)
 {
-	constexpr size_t BUFFER_SIZE = 1025;
+	constexpr size_t BUFFER_SIZE = 2049;
 	uint8_t buffer[BUFFER_SIZE + 1] = { 0 };
 	for (size_t i = 0; i < BUFFER_SIZE; i++)
-		buffer[i] = 'a';
+		buffer[i] = 'a' + (i % 26);
+	std::string segment_a((const char*)buffer, 2048);
+	std::string segment_b((const char*)buffer + 2048, 1);
 
-	ExpectInit();
-	SIM_RLM3_UART4_Transmit("AT+CWJAP_CUR=\"test-sid\",\"test-pwd\"\r\n");
-	SIM_RLM3_UART4_Receive("WIFI CONNECTED\r\n");
-	SIM_RLM3_UART4_Receive("WIFI GOT IP\r\n");
+	ExpectServerConnect(2);
+	SIM_RLM3_UART4_Transmit("AT+CIPSEND=2,2048\r\n");
 	SIM_RLM3_UART4_Receive("OK\r\n");
-	SIM_RLM3_UART4_Transmit("AT+CIPSTART=2,\"TCP\",\"test-server\",test-port\r\n");
-	SIM_RLM3_UART4_Receive("2,CONNECT\r\n");
+	SIM_RLM3_UART4_Receive("> \r\n");
+	SIM_RLM3_UART4_Transmit(segment_a.c_str());
+	SIM_RLM3_UART4_Receive("Recv 2048 bytes\r\n");
+	SIM_RLM3_UART4_Receive("SEND OK\r\n");
+	SIM_RLM3_UART4_Transmit("AT+CIPSEND=2,1\r\n");
 	SIM_RLM3_UART4_Receive("OK\r\n");
+	SIM_RLM3_UART4_Receive("> \r\n");
+	SIM_RLM3_UART4_Transmit(segment_b.c_str());
+	SIM_RLM3_UART4_Receive("Recv 1 bytes\r\n");
+	SIM_RLM3_UART4_Receive("SEND OK\r\n");
 
 	RLM3_WIFI_Init();
 	RLM3_WIFI_NetworkConnect("test-sid", "test-pwd");
 	RLM3_WIFI_ServerConnect(2,"test-server", "test-port");
-	ASSERT(!RLM3_WIFI_Transmit(2,buffer, sizeof(buffer)));
+	ASSERT(RLM3_WIFI_Transmit(2, buffer, BUFFER_SIZE));
 }
 
-TEST_CASE(RLM3_WIFI_Receive_HappyCase)
+TEST_CASE(RLM3_WIFI_Transmit_ClosedBetweenSegments)
 {
-	ExpectInit();
-	SIM_RLM3_UART4_Transmit("AT+CWJAP_CUR=\"test-sid\",\"test-pwd\"\r\n");
-	SIM_RLM3_UART4_Receive("WIFI CONNECTED\r\n");
-	SIM_RLM3_UART4_Receive("WIFI GOT IP\r\n");
+	std::string data(2049, 'a');
+
+	ExpectServerConnect(2);
+	SIM_RLM3_UART4_Transmit("AT+CIPSEND=2,2048\r\n");
 	SIM_RLM3_UART4_Receive("OK\r\n");
-	SIM_RLM3_UART4_Transmit("AT+CIPSTART=2,\"TCP\",\"test-server\",test-port\r\n");
-	SIM_RLM3_UART4_Receive("2,CONNECT\r\n");
+	SIM_RLM3_UART4_Receive("> \r\n");
+	SIM_RLM3_UART4_Transmit(data.substr(0, 2048).c_str());
+	SIM_RLM3_UART4_Receive("Recv 2048 bytes\r\n");
+	SIM_RLM3_UART4_Receive("SEND OK\r\n2,CLOSED\r\n");
+
+	RLM3_WIFI_Init();
+	RLM3_WIFI_NetworkConnect("test-sid", "test-pwd");
+	RLM3_WIFI_ServerConnect(2, "test-server", "test-port");
+	RLM3_Time start_time = RLM3_GetCurrentTime();
+	ASSERT(!RLM3_WIFI_Transmit(2, (const uint8_t*)data.data(), data.size()));
+	ASSERT(RLM3_GetCurrentTime() - start_time < 100);
+	ASSERT(!RLM3_WIFI_IsServerConnected(2));
+}
+
+TEST_CASE(RLM3_WIFI_Transmit2_OverSize)
+{
+	std::string data_a(3000, 'a');
+	std::string data_b(2000, 'b');
+
+	ExpectServerConnect(2);
+	SIM_RLM3_UART4_Transmit("AT+CIPSEND=2,2048\r\n");
 	SIM_RLM3_UART4_Receive("OK\r\n");
+	SIM_RLM3_UART4_Receive("> \r\n");
+	SIM_RLM3_UART4_Transmit(data_a.substr(0, 2048).c_str());
+	SIM_RLM3_UART4_Receive("Recv 2048 bytes\r\n");
+	SIM_RLM3_UART4_Receive("SEND OK\r\n");
+	SIM_RLM3_UART4_Transmit("AT+CIPSEND=2,2048\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n");
+	SIM_RLM3_UART4_Receive("> \r\n");
+	SIM_RLM3_UART4_Transmit(data_a.substr(2048).c_str());
+	SIM_RLM3_UART4_Transmit(data_b.substr(0, 2048 - 952).c_str());
+	SIM_RLM3_UART4_Receive("Recv 2048 bytes\r\n");
+	SIM_RLM3_UART4_Receive("SEND OK\r\n");
+	SIM_RLM3_UART4_Transmit("AT+CIPSEND=2,904\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n");
+	SIM_RLM3_UART4_Receive("> \r\n");
+	SIM_RLM3_UART4_Transmit(data_b.substr(2048 - 952).c_str());
+	SIM_RLM3_UART4_Receive("Recv 904 bytes\r\n");
+	SIM_RLM3_UART4_Receive("SEND OK\r\n");
+
+	RLM3_WIFI_Init();
+	RLM3_WIFI_NetworkConnect("test-sid", "test-pwd");
+	RLM3_WIFI_ServerConnect(2,"test-server", "test-port");
+	ASSERT(RLM3_WIFI_Transmit2(2, (const uint8_t*)data_a.data(), data_a.size(), (const uint8_t*)data_b.data(), data_b.size()));
+}
+
+TEST_CASE(RLM3_WIFI_Receive_HappyCase)
+{
+	ExpectServerConnect(2);
 	SIM_AddDelay(100);
 	SIM_RLM3_UART4_Receive("+IPD,2,5:abcde\r\n");
 
@@ -542,6 +1280,201 @@ TEST_CASE(RLM3_WIFI_Receive_HappyCase)
 	ASSERT(std::strncmp((const char*)g_recv_buffer_data, "abcde", 5) == 0);
 }
 
+TEST_CASE(RLM3_WIFI_ReceiveBlock_HappyCase)
+{
+	ExpectServerConnect(2);
+	SIM_AddDelay(100);
+	SIM_RLM3_UART4_Receive("+IPD,2,5:abcde\r\n+IPD,2,3:fgh\r\n");
+
+	RLM3_WIFI_Init();
+	RLM3_WIFI_NetworkConnect("test-sid", "test-pwd");
+	RLM3_WIFI_ServerConnect(2, "test-server", "test-port");
+	while (g_recv_buffer_count < 8)
+		RLM3_Take();
+	ASSERT(g_recv_block_calls.size() == 2);
+	ASSERT(g_recv_block_calls[0] == std::make_pair((size_t)2, std::string("abcde")));
+	ASSERT(g_recv_block_calls[1] == std::make_pair((size_t)2, std::string("fgh")));
+}
+
+TEST_CASE(RLM3_WIFI_ReceiveBlock_Fragmented)
+{
+	std::string payload(RLM3_WIFI_RECEIVE_BLOCK_SIZE + 10, 'x');
+	std::string message = "+IPD,2," + std::to_string(payload.size()) + ":" + payload + "\r\n";
+
+	ExpectServerConnect(2);
+	SIM_AddDelay(100);
+	SIM_RLM3_UART4_Receive(message.c_str());
+
+	RLM3_WIFI_Init();
+	RLM3_WIFI_NetworkConnect("test-sid", "test-pwd");
+	RLM3_WIFI_ServerConnect(2, "test-server", "test-port");
+	while (g_recv_buffer_count < payload.size())
+		RLM3_Take();
+	ASSERT(g_recv_block_calls.size() == 2);
+	ASSERT(g_recv_block_calls[0].second == payload.substr(0, RLM3_WIFI_RECEIVE_BLOCK_SIZE));
+	ASSERT(g_recv_block_calls[1].second == payload.substr(RLM3_WIFI_RECEIVE_BLOCK_SIZE));
+}
+
+TEST_CASE(RLM3_WIFI_ParseBytes_Chunked)
+{
+	const char* transcript = "WIFI CONNECTED\r\nWIFI GOT IP\r\n2,CONNECT\r\n+IPD,2,5:abcde\r\n+IPD,2,12:fghijklmnopq\r\n2,CLOSED\r\n";
+
+	for (size_t chunk = 1; chunk <= 16; chunk++)
+	{
+		ExpectInit();
+		RLM3_WIFI_Init();
+		g_recv_buffer_count = 0;
+		g_recv_block_calls.clear();
+		g_network_connect_calls.clear();
+		g_network_disconnect_calls.clear();
+
+		size_t size = std::strlen(transcript);
+		for (size_t i = 0; i < size; i += chunk)
+			RLM3_WIFI_ParseBytes((const uint8_t*)transcript + i, std::min(chunk, size - i));
+
+		ASSERT(RLM3_WIFI_IsNetworkConnected());
+		ASSERT(g_network_connect_calls.size() == 1);
+		ASSERT(g_network_disconnect_calls.size() == 1);
+		ASSERT(g_recv_buffer_count == 17);
+		ASSERT(std::strncmp((const char*)g_recv_buffer_data, "abcdefghijklmnopq", 17) == 0);
+		std::string blocks;
+		for (auto& call : g_recv_block_calls)
+			blocks += call.second;
+		ASSERT(blocks == "abcdefghijklmnopq");
+		uint8_t buffer[32];
+		ASSERT(RLM3_WIFI_Read(2, buffer, sizeof(buffer), 0) == 17);
+		ASSERT(std::strncmp((const char*)buffer, "abcdefghijklmnopq", 17) == 0);
+	}
+}
+
+TEST_CASE(RLM3_WIFI_Read_HappyCase)
+{
+	ExpectServerConnect(2);
+	SIM_AddDelay(100);
+	SIM_RLM3_UART4_Receive("+IPD,2,5:abcde\r\n");
+	SIM_AddDelay(100);
+	SIM_RLM3_UART4_Receive("+IPD,2,3:fgh\r\n");
+
+	RLM3_WIFI_Init();
+	RLM3_WIFI_NetworkConnect("test-sid", "test-pwd");
+	RLM3_WIFI_ServerConnect(2, "test-server", "test-port");
+	ASSERT(RLM3_WIFI_Available(2) == 0);
+
+	uint8_t buffer[32];
+	ASSERT(RLM3_WIFI_Read(2, buffer, 3, 1000) == 3);
+	ASSERT(std::strncmp((const char*)buffer, "abc", 3) == 0);
+	ASSERT(RLM3_WIFI_Available(2) == 2);
+	ASSERT(RLM3_WIFI_Read(2, buffer, sizeof(buffer), 1000) == 2);
+	ASSERT(std::strncmp((const char*)buffer, "de", 2) == 0);
+	ASSERT(RLM3_WIFI_Read(2, buffer, sizeof(buffer), 1000) == 3);
+	ASSERT(std::strncmp((const char*)buffer, "fgh", 3) == 0);
+	ASSERT(RLM3_WIFI_Available(2) == 0);
+}
+
+TEST_CASE(RLM3_WIFI_Read_Reconnected)
+{
+	ExpectServerConnect(2);
+	SIM_AddDelay(100);
+	SIM_RLM3_UART4_Receive("+IPD,2,5:abcde\r\n");
+	SIM_RLM3_UART4_Receive("2,CLOSED\r\n");
+	SIM_RLM3_UART4_Receive("2,CONNECT\r\n");
+	SIM_RLM3_UART4_Receive("+IPD,2,2:xy\r\n");
+
+	RLM3_WIFI_Init();
+	RLM3_WIFI_NetworkConnect("test-sid", "test-pwd");
+	RLM3_WIFI_ServerConnect(2, "test-server", "test-port");
+	RLM3_Delay(200);
+
+	// Nothing from the earlier connection is left unread on the link.
+	uint8_t buffer[32];
+	ASSERT(RLM3_WIFI_Available(2) == 2);
+	ASSERT(RLM3_WIFI_Read(2, buffer, sizeof(buffer), 1000) == 2);
+	ASSERT(std::strncmp((const char*)buffer, "xy", 2) == 0);
+	ASSERT(RLM3_WIFI_Available(2) == 0);
+}
+
+TEST_CASE(RLM3_WIFI_Read_Timeout)
+{
+	ExpectServerConnect(2);
+
+	RLM3_WIFI_Init();
+	RLM3_WIFI_NetworkConnect("test-sid", "test-pwd");
+	RLM3_WIFI_ServerConnect(2, "test-server", "test-port");
+
+	uint8_t buffer[32];
+	ASSERT(RLM3_WIFI_Read(2, buffer, sizeof(buffer), 100) == 0);
+}
+
+TEST_CASE(RLM3_WIFI_Read_Closed)
+{
+	ExpectServerConnect(2);
+	SIM_AddDelay(100);
+	SIM_RLM3_UART4_Receive("+IPD,2,5:abcde\r\n2,CLOSED\r\n");
+
+	RLM3_WIFI_Init();
+	RLM3_WIFI_NetworkConnect("test-sid", "test-pwd");
+	RLM3_WIFI_ServerConnect(2, "test-server", "test-port");
+
+	uint8_t buffer[32];
+	while (RLM3_WIFI_IsServerConnected(2))
+		RLM3_Take();
+	ASSERT(RLM3_WIFI_Read(2, buffer, sizeof(buffer), 10000) == 5);
+	ASSERT(std::strncmp((const char*)buffer, "abcde", 5) == 0);
+	ASSERT(RLM3_WIFI_Read(2, buffer, sizeof(buffer), 10000) == 0);
+}
+
+TEST_CASE(RLM3_WIFI_ReceivePassive_HappyCase)
+{
+	ExpectServerConnect(2);
+	SIM_RLM3_UART4_Transmit("AT+CIPRECVMODE=1\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n");
+	SIM_AddDelay(100);
+	SIM_RLM3_UART4_Receive("+IPD,2,5\r\n");
+	SIM_RLM3_UART4_Receive("+IPD,2,3\r\n");
+	SIM_RLM3_UART4_Transmit("AT+CIPRECVDATA=2,8\r\n");
+	SIM_RLM3_UART4_Receive("+CIPRECVDATA,8:abcdefgh\r\nOK\r\n");
+
+	RLM3_WIFI_Init();
+	RLM3_WIFI_NetworkConnect("test-sid", "test-pwd");
+	RLM3_WIFI_ServerConnect(2, "test-server", "test-port");
+	ASSERT(RLM3_WIFI_SetReceivePassive(true));
+	RLM3_Delay(200);
+	ASSERT(RLM3_WIFI_Available(2) == 8);
+	ASSERT(g_recv_buffer_count == 0);
+
+	uint8_t buffer[32];
+	ASSERT(RLM3_WIFI_Read(2, buffer, 3, 1000) == 3);
+	ASSERT(std::strncmp((const char*)buffer, "abc", 3) == 0);
+	ASSERT(g_recv_buffer_count == 8);
+	ASSERT(RLM3_WIFI_Available(2) == 5);
+	ASSERT(RLM3_WIFI_Read(2, buffer, sizeof(buffer), 1000) == 5);
+	ASSERT(std::strncmp((const char*)buffer, "defgh", 5) == 0);
+	ASSERT(RLM3_WIFI_Available(2) == 0);
+}
+
+TEST_CASE(RLM3_WIFI_ReceivePassive_Short)
+{
+	ExpectServerConnect(2);
+	SIM_RLM3_UART4_Transmit("AT+CIPRECVMODE=1\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n");
+	SIM_AddDelay(100);
+	SIM_RLM3_UART4_Receive("+IPD,2,5\r\n");
+	SIM_RLM3_UART4_Transmit("AT+CIPRECVDATA=2,5\r\n");
+	SIM_RLM3_UART4_Receive("+CIPRECVDATA,2:ab\r\nOK\r\n");
+
+	RLM3_WIFI_Init();
+	RLM3_WIFI_NetworkConnect("test-sid", "test-pwd");
+	RLM3_WIFI_ServerConnect(2, "test-server", "test-port");
+	ASSERT(RLM3_WIFI_SetReceivePassive(true));
+
+	// The module had less than it said, so there is nothing more to ask for.
+	uint8_t buffer[32];
+	ASSERT(RLM3_WIFI_Read(2, buffer, sizeof(buffer), 1000) == 2);
+	ASSERT(std::strncmp((const char*)buffer, "ab", 2) == 0);
+	ASSERT(RLM3_WIFI_Available(2) == 0);
+	ASSERT(RLM3_WIFI_Read(2, buffer, sizeof(buffer), 1000) == 0);
+}
+
 TEST_CASE(RLM3_WIFI_LocalNetworkEnable_HappyCase)
 {
 	ExpectInit();
@@ -614,10 +1547,338 @@ TEST_CASE(RLM3_WIFI_LocalNetworkEnable_Closed)
 	ASSERT(g_network_disconnect_calls.front() == std::make_pair((size_t)0, true));
 }
 
+static void ExpectPassthroughBegin()
+{
+	SIM_RLM3_UART4_Transmit("AT+CIPMUX=0\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n");
+	SIM_RLM3_UART4_Transmit("AT+CIPMODE=1\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n");
+	SIM_RLM3_UART4_Transmit("AT+CIPSTART=\"TCP\",\"test-server\",test-port\r\n");
+	SIM_RLM3_UART4_Receive("CONNECT\r\n");
+	SIM_RLM3_UART4_Receive("\r\nOK\r\n");
+	SIM_RLM3_UART4_Transmit("AT+CIPSEND\r\n");
+	SIM_RLM3_UART4_Receive("\r\nOK\r\n\r\n>");
+}
+
+TEST_CASE(RLM3_WIFI_Passthrough_HappyCase)
+{
+	ExpectInit();
+	ExpectPassthroughBegin();
+	SIM_AddDelay(10);
+	SIM_RLM3_UART4_Receive("+IPD,2,3:OK\r\n");
+	SIM_RLM3_UART4_Transmit("abcde");
+	SIM_RLM3_UART4_Transmit("+++");
+	SIM_RLM3_UART4_Transmit("AT+CIPMODE=0\r\n");
+	SIM_RLM3_UART4_Receive("\r\nOK\r\n");
+	SIM_RLM3_UART4_Transmit("AT+CIPCLOSE\r\n");
+	SIM_RLM3_UART4_Receive("CLOSED\r\n\r\nOK\r\n");
+	SIM_RLM3_UART4_Transmit("AT+CIPMUX=1\r\n");
+	SIM_RLM3_UART4_Receive("\r\nOK\r\n");
+
+	RLM3_WIFI_Init();
+	ASSERT(RLM3_WIFI_PassthroughBegin(2, "test-server", "test-port"));
+	ASSERT(RLM3_WIFI_IsPassthrough());
+	ASSERT(RLM3_WIFI_IsServerConnected(2));
+	ASSERT(g_network_connect_calls.size() == 1);
+	ASSERT(g_network_connect_calls.front() == std::make_pair((size_t)2, false));
+
+	// Nothing the server sends is framing any more.
+	RLM3_Delay(100);
+	uint8_t buffer[32];
+	size_t count = RLM3_WIFI_Read(2, buffer, sizeof(buffer), 1000);
+	ASSERT(std::string((const char*)buffer, count) == "+IPD,2,3:OK\r\n");
+	ASSERT(g_recv_buffer_count == 13);
+	ASSERT(g_recv_block_calls.size() == 1);
+	ASSERT(g_recv_block_calls[0] == std::make_pair((size_t)2, std::string("+IPD,2,3:OK\r\n")));
+
+	// Commands would reach the server as data.
+	uint32_t at_version = 0;
+	uint32_t sdk_version = 0;
+	ASSERT(!RLM3_WIFI_GetVersion(&at_version, &sdk_version));
+
+	ASSERT(!RLM3_WIFI_Transmit(1, (const uint8_t*)"abcde", 5));
+	ASSERT(!RLM3_WIFI_TransmitAsync(2, (const uint8_t*)"abcde", 5, nullptr, nullptr));
+	ASSERT(RLM3_WIFI_Transmit(2, (const uint8_t*)"abcde", 5));
+
+	ASSERT(RLM3_WIFI_PassthroughEnd());
+	ASSERT(!RLM3_WIFI_IsPassthrough());
+	ASSERT(!RLM3_WIFI_IsServerConnected(2));
+	ASSERT(g_network_disconnect_calls.size() == 1);
+	ASSERT(g_network_disconnect_calls.front() == std::make_pair((size_t)2, false));
+
+	RLM3_WIFI_Stats stats;
+	RLM3_WIFI_GetStats(&stats);
+	ASSERT(stats.links[2].bytes_sent == 5);
+	ASSERT(stats.links[2].bytes_received == 13);
+	ASSERT(stats.operation_count[RLM3_WIFI_OPERATION_PASSTHROUGH] == 2);
+}
+
+TEST_CASE(RLM3_WIFI_Passthrough_LinkOpen)
+{
+	ExpectServerConnect(1);
+
+	RLM3_WIFI_Init();
+	RLM3_WIFI_NetworkConnect("test-sid", "test-pwd");
+	ASSERT(RLM3_WIFI_ServerConnect(1, "test-server", "test-port"));
+	ASSERT(!RLM3_WIFI_PassthroughBegin(2, "test-server", "test-port"));
+	ASSERT(!RLM3_WIFI_IsPassthrough());
+	ASSERT(!RLM3_WIFI_PassthroughEnd());
+}
+
+TEST_CASE(RLM3_WIFI_Passthrough_ConnectFail)
+{
+	ExpectInit();
+	SIM_RLM3_UART4_Transmit("AT+CIPMUX=0\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n");
+	SIM_RLM3_UART4_Transmit("AT+CIPMODE=1\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n");
+	SIM_RLM3_UART4_Transmit("AT+CIPSTART=\"TCP\",\"test-server\",test-port\r\n");
+	SIM_RLM3_UART4_Receive("DNS Fail\r\n\r\nERROR\r\n");
+	SIM_RLM3_UART4_Transmit("AT+CIPMODE=0\r\n");
+	SIM_RLM3_UART4_Receive("\r\nOK\r\n");
+	SIM_RLM3_UART4_Transmit("AT+CIPMUX=1\r\n");
+	SIM_RLM3_UART4_Receive("\r\nOK\r\n");
+
+	RLM3_WIFI_Init();
+	ASSERT(!RLM3_WIFI_PassthroughBegin(2, "test-server", "test-port"));
+	ASSERT(!RLM3_WIFI_IsPassthrough());
+	ASSERT(!RLM3_WIFI_IsServerConnected(2));
+	ASSERT(g_network_callback_count == 0);
+}
+
+TEST_CASE(RLM3_WIFI_GetStats_TransmitReceive)
+{
+	ExpectServerConnect(2);
+	SIM_RLM3_UART4_Transmit("AT+CIPSEND=2,7\r\n");
+	SIM_RLM3_UART4_Receive("OK\r\n");
+	SIM_RLM3_UART4_Receive("> \r\n");
+	SIM_RLM3_UART4_Transmit("abcdcba");
+	SIM_RLM3_UART4_Receive("Recv 7 bytes\r\n");
+	SIM_RLM3_UART4_Receive("SEND OK\r\n");
+	SIM_AddDelay(100);
+	SIM_RLM3_UART4_Receive("+IPD,2,5:abcde\r\n");
+
+	RLM3_WIFI_Init();
+	RLM3_WIFI_NetworkConnect("test-sid", "test-pwd");
+	RLM3_WIFI_ServerConnect(2, "test-server", "test-port");
+	ASSERT(RLM3_WIFI_Transmit(2, (const uint8_t*)"abcdcba", 7));
+	while (g_recv_buffer_count < 5)
+		RLM3_Take();
+
+	RLM3_WIFI_Stats stats;
+	RLM3_WIFI_GetStats(&stats);
+	ASSERT(stats.links[2].bytes_sent == 7);
+	ASSERT(stats.links[2].segments_sent == 1);
+	ASSERT(stats.links[2].bytes_received == 5);
+	ASSERT(stats.links[2].segments_received == 1);
+	ASSERT(stats.links[2].connect_count == 1);
+	ASSERT(stats.links[0].bytes_sent == 0);
+	ASSERT(stats.network_connect_count == 1);
+	ASSERT(stats.operation_count[RLM3_WIFI_OPERATION_INIT] == 1);
+	ASSERT(stats.operation_count[RLM3_WIFI_OPERATION_NETWORK_CONNECT] == 1);
+	ASSERT(stats.operation_count[RLM3_WIFI_OPERATION_SERVER_CONNECT] == 1);
+	ASSERT(stats.operation_count[RLM3_WIFI_OPERATION_TRANSMIT] == 1);
+	ASSERT(stats.resync_count == 0);
+}
+
+TEST_CASE(RLM3_WIFI_GetStats_UnknownReplies)
+{
+	ExpectInit();
+	SIM_RLM3_UART4_Transmit("AT+GMR\r\n");
+	SIM_RLM3_UART4_Receive("+CIFSR:STAIP,\"1.2.3.4\"\r\n+CIPSTA:ip:\"1.2.3.4\"\r\n+CIPSTAMAC:\"aa:bb\"\r\n+CIPSNTPTIME:Thu Jan 01\r\n+CIPMODE:0\n+CIPAP:ip\r\nOK\r\n");
+
+	RLM3_WIFI_Init();
+	uint32_t at_version = 0;
+	uint32_t sdk_version = 0;
+	ASSERT(RLM3_WIFI_GetVersion(&at_version, &sdk_version));
+
+	RLM3_WIFI_Stats stats;
+	RLM3_WIFI_GetStats(&stats);
+	ASSERT(stats.resync_count == 0);
+}
+
+TEST_CASE(RLM3_WIFI_GetStats_Errors)
+{
+	ExpectInit();
+	SIM_RLM3_UART4_Transmit("AT+GMR\r\n");
+	SIM_RLM3_UART4_Receive("WIFI CONNECTING\r\nbusy p...\r\n");
+
+	RLM3_WIFI_Init();
+	uint32_t at_version = 0;
+	uint32_t sdk_version = 0;
+	ASSERT(!RLM3_WIFI_GetVersion(&at_version, &sdk_version));
+	RLM3_UART4_ErrorCallback(0);
+
+	RLM3_WIFI_Stats stats;
+	RLM3_WIFI_GetStats(&stats);
+	ASSERT(stats.resync_count == 1);
+	ASSERT(stats.busy_count == 1);
+	ASSERT(stats.uart_error_count == 1);
+	ASSERT(stats.operation_count[RLM3_WIFI_OPERATION_GET_VERSION] == 1);
+	ASSERT(stats.timeout_count[RLM3_WIFI_OPERATION_GET_VERSION] == 1);
+	ASSERT(stats.timeout_count[RLM3_WIFI_OPERATION_INIT] == 0);
+}
+
+static bool FindLatencyHistogram(const char* stage, RLM3_WIFI_LatencyHistogram* histogram)
+{
+	for (size_t i = 0; RLM3_WIFI_GetLatencyHistogram(i, histogram); i++)
+		if (std::strcmp(histogram->stage, stage) == 0)
+			return true;
+	return false;
+}
+
+TEST_CASE(RLM3_WIFI_GetLatencyHistogram_Transmit)
+{
+	ExpectServerConnect(2);
+	for (size_t i = 0; i < 2; i++)
+	{
+		SIM_RLM3_UART4_Transmit("AT+CIPSEND=2,3\r\n");
+		SIM_RLM3_UART4_Receive("OK\r\n");
+		SIM_AddDelay(5);
+		SIM_RLM3_UART4_Receive("> \r\n");
+		SIM_RLM3_UART4_Transmit("abc");
+		SIM_RLM3_UART4_Receive("Recv 3 bytes\r\n");
+		SIM_RLM3_UART4_Receive("SEND OK\r\n");
+	}
+
+	RLM3_WIFI_Init();
+	RLM3_WIFI_NetworkConnect("test-sid", "test-pwd");
+	RLM3_WIFI_ServerConnect(2, "test-server", "test-port");
+	ASSERT(RLM3_WIFI_Transmit(2, (const uint8_t*)"abc", 3));
+	ASSERT(RLM3_WIFI_Transmit(2, (const uint8_t*)"abc", 3));
+
+	RLM3_WIFI_LatencyHistogram histogram;
+	ASSERT(RLM3_WIFI_GetLatencyHistogram(0, &histogram));
+	ASSERT(std::strcmp(histogram.stage, "ping") == 0);
+	ASSERT(FindLatencyHistogram("transmit_c", &histogram));
+	ASSERT(histogram.count == 2);
+	ASSERT(histogram.max_time >= 5);
+	ASSERT(histogram.total_time >= 10);
+	ASSERT(histogram.buckets[0] == 0);
+	ASSERT(FindLatencyHistogram("transmit_write", &histogram));
+	ASSERT(histogram.count == 2);
+	ASSERT(FindLatencyHistogram("transmit_e", &histogram));
+	ASSERT(histogram.count == 2);
+	ASSERT(!FindLatencyHistogram("transmit_buffered_b", &histogram));
+}
+
+TEST_CASE(RLM3_WIFI_GetLatencyHistogram_Timeout)
+{
+	ExpectInit();
+	SIM_RLM3_UART4_Transmit("AT+GMR\r\n");
+	SIM_RLM3_UART4_Transmit("AT+GMR\r\n");
+	SIM_AddDelay(20);
+	SIM_RLM3_UART4_Receive("OK\r\n");
+
+	RLM3_WIFI_Init();
+	uint32_t at_version = 0;
+	uint32_t sdk_version = 0;
+	ASSERT(!RLM3_WIFI_GetVersion(&at_version, &sdk_version));
+	ASSERT(RLM3_WIFI_GetVersion(&at_version, &sdk_version));
+
+	// The command and the wait for its answer share a stage.
+	RLM3_WIFI_LatencyHistogram histogram;
+	ASSERT(FindLatencyHistogram("get_version", &histogram));
+	ASSERT(histogram.count == 4);
+	ASSERT(histogram.timeout_count == 1);
+	ASSERT(histogram.max_time >= 1000);
+	ASSERT(histogram.total_time < 1100);
+}
+
+TEST_CASE(RLM3_WIFI_Capture_Replay)
+{
+	ExpectServerConnect(2);
+	SIM_AddDelay(100);
+	SIM_RLM3_UART4_Receive("+IPD,2,5:abcde\r\n");
+
+	RLM3_WIFI_SetCapture(true);
+	RLM3_WIFI_Init();
+	RLM3_WIFI_NetworkConnect("test-sid", "test-pwd");
+	RLM3_WIFI_ServerConnect(2, "test-server", "test-port");
+	while (g_recv_buffer_count < 5)
+		RLM3_Take();
+	RLM3_WIFI_SetCapture(false);
+
+	std::vector<uint8_t> capture(RLM3_WIFI_CAPTURE_BUFFER_SIZE);
+	capture.resize(RLM3_WIFI_GetCapture(capture.data(), capture.size()));
+	std::vector<CaptureRecord> records = DecodeCapture(capture.data(), capture.size());
+	ASSERT(records.front().is_transmit && records.front().data == "AT\r\n");
+	ASSERT(!records.back().is_transmit && records.back().data == "+IPD,2,5:abcde\r\n");
+	ASSERT(records.back().time >= records.front().time + 100);
+
+	std::string transmitted = ReplayCapture(records);
+	ASSERT(transmitted.find("AT+CIPSTART=2,\"TCP\",\"test-server\",test-port\r\n") != std::string::npos);
+	ASSERT(g_recv_buffer_count == 10);
+	ASSERT(std::strncmp((const char*)g_recv_buffer_data + 5, "abcde", 5) == 0);
+}
+
+TEST_CASE(RLM3_WIFI_Capture_Wraps)
+{
+	ExpectInit();
+
+	RLM3_WIFI_Init();
+	RLM3_WIFI_SetCapture(true);
+	std::string line = "WIFI GOT IP\r\n";
+	for (size_t i = 0; i < 2 * RLM3_WIFI_CAPTURE_BUFFER_SIZE / line.size(); i++)
+		RLM3_WIFI_ParseBytes((const uint8_t*)line.data(), line.size());
+	RLM3_WIFI_ParseBytes((const uint8_t*)"WIFI DISCONNECT\r\n", 17);
+
+	std::vector<uint8_t> capture(RLM3_WIFI_CAPTURE_BUFFER_SIZE);
+	capture.resize(RLM3_WIFI_GetCapture(capture.data(), capture.size()));
+	ASSERT(capture.size() > RLM3_WIFI_CAPTURE_BUFFER_SIZE - 128);
+	std::string received;
+	for (const CaptureRecord& record : DecodeCapture(capture.data(), capture.size()))
+		received += record.data;
+	ASSERT(received.size() > RLM3_WIFI_CAPTURE_BUFFER_SIZE - 128);
+	ASSERT(received.substr(received.size() - 17) == "WIFI DISCONNECT\r\n");
+
+	std::vector<uint8_t> small(100);
+	small.resize(RLM3_WIFI_GetCapture(small.data(), small.size()));
+	ASSERT(small.size() <= 100 && small.size() > 0);
+	ASSERT(small == std::vector<uint8_t>(capture.end() - small.size(), capture.end()));
+	RLM3_WIFI_SetCapture(false);
+}
+
+TEST_CASE(RLM3_WIFI_GetIsrTiming_Init)
+{
+	ExpectInit();
+
+	RLM3_WIFI_Init();
+
+	RLM3_WIFI_IsrTiming timing;
+#ifndef RLM3_WIFI_ISR_TIMING
+	ASSERT(!RLM3_WIFI_GetIsrTiming(0, &timing));
+#else
+	ASSERT(RLM3_WIFI_GetIsrTiming(0, &timing));
+	ASSERT(std::strcmp(timing.name, "receive") == 0);
+	ASSERT(timing.count == std::strlen("AT\r\nOK\r\nATE0\r\nOK\r\nOK\r\nOK\r\nOK\r\nOK\r\n"));
+	ASSERT(timing.min_time == 3 && timing.mean_time == 3 && timing.max_time == 3);
+	size_t receive_count = timing.count;
+
+	ASSERT(RLM3_WIFI_GetIsrTiming(1, &timing));
+	ASSERT(std::strcmp(timing.name, "transmit") == 0);
+	ASSERT(timing.count >= std::strlen("AT\r\nATE0\r\nAT+CIPMODE=0\r\nAT+CIPMUX=1\r\nAT+CWMODE_CUR=1\r\nAT+CWAUTOCONN=0\r\n"));
+
+	ASSERT(RLM3_WIFI_GetIsrTiming(2, &timing));
+	ASSERT(std::strcmp(timing.name, "parse_bytes") == 0);
+	ASSERT(timing.count == 0);
+
+	size_t state_count = 0;
+	for (size_t i = 3; RLM3_WIFI_GetIsrTiming(i, &timing); i++)
+	{
+		ASSERT(std::strncmp(timing.name, "state_", 6) == 0);
+		state_count += timing.count;
+	}
+	ASSERT(state_count == receive_count);
+#endif
+}
+
 TEST_SETUP(WIFI_TESTING_SETUP)
 {
 	g_client_thread = RLM3_GetCurrentTask();;
 	g_recv_buffer_count = 0;
+	g_recv_block_calls.clear();
+	g_recv_datagram_calls.clear();
 	g_network_callback_count = 0;
 	g_network_connect_calls.clear();
 	g_network_disconnect_calls.clear();
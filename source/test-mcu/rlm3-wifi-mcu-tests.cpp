@@ -59,6 +59,16 @@ TEST_CASE(RLM3_WIFI_GetVersion_HappyCase)
 	RLM3_WIFI_Deinit();
 }
 
+TEST_CASE(RLM3_WIFI_SetBaudRate_HappyCase)
+{
+	ASSERT(RLM3_WIFI_Init());
+	ASSERT(RLM3_WIFI_SetBaudRate(921600));
+	uint32_t at_version = 0;
+	uint32_t sdk_version = 0;
+	ASSERT(RLM3_WIFI_GetVersion(&at_version, &sdk_version));
+	RLM3_WIFI_Deinit();
+}
+
 TEST_CASE(RLM3_WIFI_NetworkConnect_HappyCase)
 {
 	ASSERT(!RLM3_WIFI_IsNetworkConnected());